@@ -8,7 +8,7 @@ if $OSTYPE == Windows
 
     CXX = cl 
     CXXFLAGS += /c /I. /I install-win/include /DWIN32 /EHsc /MD 
-    LDFLAGS += /NODEFAULTLIB:libcmtd.lib /LIBPATH:install-win/lib crypt32.lib libeay32.lib libssh2.lib ws2_32.lib advapi32.lib shell32.lib user32.lib gdi32.lib
+    LDFLAGS += /NODEFAULTLIB:libcmtd.lib /LIBPATH:install-win/lib crypt32.lib libeay32.lib libssh2.lib zlib.lib ws2_32.lib advapi32.lib shell32.lib user32.lib gdi32.lib
 else
     if $OSTYPE == Darwin
         build_dir = build-mac
@@ -22,8 +22,8 @@ else
         ext = 
 
         CXX = g++
-        CXXFLAGS += -g -I. -c -D_FILE_OFFSET_BITS=64 -std=c++0x
-        LDFLAGS += -static-libgcc -lstdc++ -lssh2 -lcrypto
+        CXXFLAGS += -g -I. -c -D_FILE_OFFSET_BITS=64 -std=c++0x -pthread
+        LDFLAGS += -static-libgcc -lstdc++ -lssh2 -lcrypto -lz -pthread
     endif
 endif
 
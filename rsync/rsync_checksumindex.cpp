@@ -0,0 +1,125 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_checksumindex.h>
+
+#include <cstring>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// Bits in the filter per block.  With one hash function this lets about 1 in 16 checksums that are not in the
+// index through the filter.
+const int FilterBitsPerBlock = 16;
+
+// The filter has at least this many bits (one cache line).
+const int MinimumFilterBits = 512;
+
+// Slots in the table per block.  The table is never more than half full, which keeps linear probes short.
+const int SlotsPerBlock = 2;
+
+const int MinimumSlots = 16;
+
+// Return the number of bits needed to represent 'n' - 1, i.e., log2 of the smallest power of 2 not less than 'n'.
+int getLog2(uint32_t n)
+{
+    int bits = 0;
+    while ((static_cast<uint64_t>(1) << bits) < n) {
+        ++bits;
+    }
+    return bits;
+}
+
+} // unnamed namespace
+
+ChecksumIndex::ChecksumIndex()
+    : d_filter(0)
+    , d_filterCapacity(0)
+    , d_filterShift(32)
+    , d_slots(0)
+    , d_slotCapacity(0)
+    , d_slotMask(0)
+    , d_next(0)
+    , d_nextCapacity(0)
+{
+    reset(0);
+}
+
+ChecksumIndex::~ChecksumIndex()
+{
+    delete [] d_filter;
+    delete [] d_slots;
+    delete [] d_next;
+}
+
+void ChecksumIndex::reset(int count)
+{
+    int filterBits = getLog2(static_cast<uint32_t>(count) * FilterBitsPerBlock);
+    if (filterBits < getLog2(MinimumFilterBits)) {
+        filterBits = getLog2(MinimumFilterBits);
+    }
+    int filterWords = (1 << filterBits) / 64;
+    if (filterWords > d_filterCapacity) {
+        delete [] d_filter;
+        d_filter = new uint64_t[filterWords];
+        d_filterCapacity = filterWords;
+    }
+    ::memset(d_filter, 0, filterWords * sizeof(uint64_t));
+    d_filterShift = 32 - filterBits;
+
+    int slots = 1 << getLog2(static_cast<uint32_t>(count) * SlotsPerBlock);
+    if (slots < MinimumSlots) {
+        slots = MinimumSlots;
+    }
+    if (slots > d_slotCapacity) {
+        delete [] d_slots;
+        d_slots = new Slot[slots];
+        d_slotCapacity = slots;
+    }
+    for (int i = 0; i < slots; ++i) {
+        d_slots[i].d_head = -1;
+    }
+    d_slotMask = slots - 1;
+
+    if (count > d_nextCapacity) {
+        delete [] d_next;
+        d_next = new int32_t[count];
+        d_nextCapacity = count;
+    }
+}
+
+void ChecksumIndex::add(int index, uint32_t checksum)
+{
+    uint32_t hash = getHash(checksum);
+    uint32_t bit = hash >> d_filterShift;
+    d_filter[bit >> 6] |= static_cast<uint64_t>(1) << (bit & 63);
+
+    uint32_t slot = hash & d_slotMask;
+    while (d_slots[slot].d_head != -1 && d_slots[slot].d_checksum != checksum) {
+        slot = (slot + 1) & d_slotMask;
+    }
+
+    // Blocks with the same checksum are chained from the last one added, as the old bucket list did.
+    d_next[index] = d_slots[slot].d_head;
+    d_slots[slot].d_checksum = checksum;
+    d_slots[slot].d_head = index;
+}
+
+} // namespace rsync
@@ -0,0 +1,99 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#ifndef INCLUDED_RSYNC_CHECKSUMINDEX_H
+#define INCLUDED_RSYNC_CHECKSUMINDEX_H
+
+#include <stdint.h>
+
+namespace rsync
+{
+
+// This class maps the 32-bit rolling checksums of the blocks of a file to the block indices.  It is sized to the
+// number of blocks, so lookups stay fast for very large files.
+//
+// A lookup first tests a bitset with a few bits per block, which is small enough to stay in the cache and rejects
+// most checksums that don't belong to any block by touching a single cache line.  Checksums that pass the filter
+// are located in an open-addressing table, and blocks sharing the same checksum are chained together.
+class ChecksumIndex
+{
+public:
+    // Create an empty index.
+    ChecksumIndex();
+
+    ~ChecksumIndex();
+
+    // Remove all blocks and prepare the index for 'count' blocks.  Memory is only reallocated when it grows.
+    void reset(int count);
+
+    // Add block 'index' with the rolling checksum 'checksum'.  'index' must be less than the count passed to
+    // 'reset()' and each block can only be added once.
+    void add(int index, uint32_t checksum);
+
+    // Return the block most recently added with the rolling checksum 'checksum', or -1 if there is none.
+    int find(uint32_t checksum) const
+    {
+        uint32_t hash = getHash(checksum);
+        uint32_t bit = hash >> d_filterShift;
+        if (!(d_filter[bit >> 6] & (static_cast<uint64_t>(1) << (bit & 63)))) {
+            return -1;
+        }
+        for (uint32_t slot = hash & d_slotMask; d_slots[slot].d_head != -1; slot = (slot + 1) & d_slotMask) {
+            if (d_slots[slot].d_checksum == checksum) {
+                return d_slots[slot].d_head;
+            }
+        }
+        return -1;
+    }
+
+    // Return the block added before 'index' with the same rolling checksum, or -1 if there is none.
+    int next(int index) const
+    {
+        return d_next[index];
+    }
+
+private:
+    // NOT IMPLEMENTED
+    ChecksumIndex(const ChecksumIndex&);
+    ChecksumIndex& operator=(const ChecksumIndex&);
+
+    // The rolling checksum is poorly distributed in its low bits when blocks are short, so mix all bits before
+    // using them.
+    static uint32_t getHash(uint32_t checksum)
+    {
+        return checksum * 0x9e3779b1u;
+    }
+
+    struct Slot
+    {
+        uint32_t d_checksum;       // the rolling checksum
+        int32_t d_head;            // the last block added with this checksum; -1 if the slot is empty
+    };
+
+    uint64_t *d_filter;            // the bitset, indexed by the highest bits of the hash
+    int d_filterCapacity;          // the number of 64-bit words allocated for 'd_filter'
+    int d_filterShift;             // how many bits the hash is shifted to index 'd_filter'
+
+    Slot *d_slots;                 // the open-addressing table, probed linearly from the lowest bits of the hash
+    int d_slotCapacity;            // the number of slots allocated
+    uint32_t d_slotMask;           // the number of slots in use minus 1
+
+    int32_t *d_next;               // for each block, the previous block with the same checksum
+    int d_nextCapacity;            // the size of 'd_next'
+};
+
+} // namespace rsync
+
+#endif // INCLUDED_RSYNC_CHECKSUMINDEX_H
@@ -0,0 +1,295 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_checksumutil.h>
+
+#include <rsync/rsync_util.h>
+
+#include <qi/qi_build.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define RSYNC_CHECKSUMUTIL_X86 1
+#endif
+
+#ifdef RSYNC_CHECKSUMUTIL_X86
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RSYNC_TARGET_SSE2
+#define RSYNC_TARGET_AVX2
+#else
+#define RSYNC_TARGET_SSE2 __attribute__((target("sse2")))
+#define RSYNC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#endif // RSYNC_CHECKSUMUTIL_X86
+
+namespace rsync
+{
+
+namespace
+{
+
+// The reference implementation.  'chunk' is always read as signed chars so the result doesn't depend on whether
+// 'char' is signed on the platform.
+void getRollingChecksumScalar(const char *chunk, int size, uint32_t *s1, uint32_t *s2)
+{
+    const signed char *p = reinterpret_cast<const signed char *>(chunk);
+    uint32_t a = 0, b = 0;
+    for (int i = 0; i < size; ++i) {
+        a += static_cast<int32_t>(p[i]);
+        b += a;
+    }
+    *s1 = a;
+    *s2 = b;
+}
+
+#ifdef RSYNC_CHECKSUMUTIL_X86
+
+// The vector kernels split the data into blocks of 'W' bytes.  For block 'k' with the byte sum 'S(k)' and the
+// weighted sum 'T(k)' = W * c[0] + (W - 1) * c[1] + ... + 1 * c[W - 1], the scalar loop would give:
+//
+//     s2 += W * s1 + T(k);  s1 += S(k);
+//
+// Every lane of the vector accumulators below keeps its share of 's1', of the running sum of 's1' before each block
+// ('prefix'), and of 'T', so the horizontal sums only have to be taken once at the end.  All arithmetic wraps modulo
+// 2^32, exactly like the scalar loop.
+
+RSYNC_TARGET_SSE2
+inline uint32_t sumLanes(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+}
+
+RSYNC_TARGET_SSE2
+void getRollingChecksumSSE2(const char *chunk, int size, uint32_t *s1, uint32_t *s2)
+{
+    const int W = 16;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i lowWeights = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i highWeights = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+
+    __m128i sum1 = zero;
+    __m128i prefix = zero;
+    __m128i sum2 = zero;
+
+    int blocks = size / W;
+    for (int k = 0; k < blocks; ++k) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(chunk + k * W));
+
+        // Sign extend the bytes to 16 bits.
+        __m128i sign = _mm_cmpgt_epi8(zero, bytes);
+        __m128i low = _mm_unpacklo_epi8(bytes, sign);
+        __m128i high = _mm_unpackhi_epi8(bytes, sign);
+
+        prefix = _mm_add_epi32(prefix, sum1);
+        sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_add_epi16(low, high), ones));
+        sum2 = _mm_add_epi32(sum2, _mm_add_epi32(_mm_madd_epi16(low, lowWeights),
+                                                 _mm_madd_epi16(high, highWeights)));
+    }
+
+    uint32_t a = sumLanes(sum1);
+    uint32_t b = W * sumLanes(prefix) + sumLanes(sum2);
+
+    const signed char *p = reinterpret_cast<const signed char *>(chunk);
+    for (int i = blocks * W; i < size; ++i) {
+        a += static_cast<int32_t>(p[i]);
+        b += a;
+    }
+    *s1 = a;
+    *s2 = b;
+}
+
+RSYNC_TARGET_AVX2
+inline uint32_t sumLanes(__m256i v)
+{
+    __m128i x = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(x));
+}
+
+RSYNC_TARGET_AVX2
+void getRollingChecksumAVX2(const char *chunk, int size, uint32_t *s1, uint32_t *s2)
+{
+    const int W = 32;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i lowWeights = _mm256_setr_epi16(32, 31, 30, 29, 28, 27, 26, 25,
+                                                 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m256i highWeights = _mm256_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9,
+                                                  8, 7, 6, 5, 4, 3, 2, 1);
+
+    __m256i sum1 = zero;
+    __m256i prefix = zero;
+    __m256i sum2 = zero;
+
+    int blocks = size / W;
+    for (int k = 0; k < blocks; ++k) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(chunk + k * W));
+
+        // Sign extend the first and the second 16 bytes to 16 bits.
+        __m256i low = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(bytes));
+        __m256i high = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(bytes, 1));
+
+        prefix = _mm256_add_epi32(prefix, sum1);
+        sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_add_epi16(low, high), ones));
+        sum2 = _mm256_add_epi32(sum2, _mm256_add_epi32(_mm256_madd_epi16(low, lowWeights),
+                                                       _mm256_madd_epi16(high, highWeights)));
+    }
+
+    uint32_t a = sumLanes(sum1);
+    uint32_t b = W * sumLanes(prefix) + sumLanes(sum2);
+
+    const signed char *p = reinterpret_cast<const signed char *>(chunk);
+    for (int i = blocks * W; i < size; ++i) {
+        a += static_cast<int32_t>(p[i]);
+        b += a;
+    }
+    *s1 = a;
+    *s2 = b;
+}
+
+bool hasSSE2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool hasAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    // The OS must also save the ymm registers (OSXSAVE and XCR0 bits 1 and 2).
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // RSYNC_CHECKSUMUTIL_X86
+
+typedef void (*RollingChecksumFunction)(const char *, int, uint32_t *, uint32_t *);
+
+RollingChecksumFunction getKernelFunction(ChecksumUtil::Kernel kernel)
+{
+    switch (kernel) {
+    case ChecksumUtil::SCALAR:
+        return &getRollingChecksumScalar;
+#ifdef RSYNC_CHECKSUMUTIL_X86
+    case ChecksumUtil::SSE2:
+        return hasSSE2() ? &getRollingChecksumSSE2 : 0;
+    case ChecksumUtil::AVX2:
+        return hasAVX2() ? &getRollingChecksumAVX2 : 0;
+#endif
+    default:
+        return 0;
+    }
+}
+
+// The cpu is only checked once.
+RollingChecksumFunction getDefaultKernelFunction()
+{
+    static RollingChecksumFunction function = getKernelFunction(ChecksumUtil::getDefaultKernel());
+    return function;
+}
+
+} // unnamed namespace
+
+void ChecksumUtil::getRollingChecksum(const char *chunk, int size, uint32_t *s1, uint32_t *s2)
+{
+    getDefaultKernelFunction()(chunk, size, s1, s2);
+}
+
+bool ChecksumUtil::getRollingChecksum(Kernel kernel, const char *chunk, int size, uint32_t *s1, uint32_t *s2)
+{
+    RollingChecksumFunction function = getKernelFunction(kernel);
+    if (!function) {
+        return false;
+    }
+    function(chunk, size, s1, s2);
+    return true;
+}
+
+bool ChecksumUtil::isKernelSupported(Kernel kernel)
+{
+    return getKernelFunction(kernel) != 0;
+}
+
+ChecksumUtil::Kernel ChecksumUtil::getDefaultKernel()
+{
+    if (isKernelSupported(AVX2)) {
+        return AVX2;
+    }
+    if (isKernelSupported(SSE2)) {
+        return SSE2;
+    }
+    return SCALAR;
+}
+
+void ChecksumUtil::getMDDigest(int protocol, const char *data, int size, int32_t seed, char digest[16])
+{
+    Util::md_struct context;
+    Util::md_init(protocol, &context);
+    Util::md_update(protocol, &context, data, size);
+    Util::md_update(protocol, &context, reinterpret_cast<char *>(&seed), sizeof seed);
+    Util::md_final(protocol, &context, digest);
+}
+
+int ChecksumUtil::getBlockLength(int64_t size)
+{
+    const unsigned int minimumBlockLength = 700;
+    const unsigned int maxBlockLength = 0x20000;
+    if (size < minimumBlockLength * minimumBlockLength) {
+        return minimumBlockLength;
+    }
+
+    uint32_t g = 0x80000000;
+    uint32_t c = 0x80000000;
+
+    while (c) {
+        if (static_cast<int64_t>(g) * g > size) {
+            g ^= c;
+        }
+        c >>= 1;
+        g |= c;
+    }
+    return (g > maxBlockLength) ? maxBlockLength : (g >> 3) * 8;
+}
+
+} // namespace rsync
@@ -0,0 +1,56 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#ifndef INCLUDED_RSYNC_CHECKSUMUTIL_H
+#define INCLUDED_RSYNC_CHECKSUMUTIL_H
+
+#include <stdint.h>
+
+namespace rsync
+{
+
+struct ChecksumUtil
+{
+    // Implementations of the rolling checksum.  SSE2 and AVX2 are only available on x86 cpus.
+    enum Kernel {
+        SCALAR,
+        SSE2,
+        AVX2
+    };
+
+    // Compute the rsync rolling checksum of the first 'size' bytes of 'chunk', using the fastest kernel supported
+    // by the cpu.  Bytes are treated as signed chars, as rsync does.
+    static void getRollingChecksum(const char *chunk, int size, uint32_t *s1, uint32_t *s2);
+
+    // Same as above, but always use the specified kernel.  Return false without touching 's1' and 's2' if the
+    // kernel isn't supported.
+    static bool getRollingChecksum(Kernel kernel, const char *chunk, int size, uint32_t *s1, uint32_t *s2);
+
+    // If the kernel can be used on this cpu.
+    static bool isKernelSupported(Kernel kernel);
+
+    // Return the kernel picked by 'getRollingChecksum()'.
+    static Kernel getDefaultKernel();
+
+    // Compute the MD4 (protocol 29) or MD5 (protocol 30) digest of a block, with 'seed' appended.
+    static void getMDDigest(int protocol, const char *data, int size, int32_t seed, char digest[16]);
+
+    // Given a file size, return a good block length.
+    static int getBlockLength(int64_t size);
+};
+
+} // namespace rsync
+
+#endif // INCLUDED_RSYNC_CHECKSUMUTIL_H
@@ -15,20 +15,34 @@
 
 #include <rsync/rsync_client.h>
 
+#include <rsync/rsync_checksumutil.h>
+#include <rsync/rsync_directoryscanner.h>
 #include <rsync/rsync_entry.h>
+#include <rsync/rsync_entrypool.h>
 #include <rsync/rsync_file.h>
+#include <rsync/rsync_filefinalizer.h>
+#include <rsync/rsync_filelist.h>
+#include <rsync/rsync_filewriter.h>
+#include <rsync/rsync_filter.h>
 #include <rsync/rsync_log.h>
+#include <rsync/rsync_mappedfile.h>
 #include <rsync/rsync_pathutil.h>
+#include <rsync/rsync_signaturecache.h>
+#include <rsync/rsync_signaturepipeline.h>
 #include <rsync/rsync_socketio.h>
 #include <rsync/rsync_sshio.h>
 #include <rsync/rsync_timeutil.h>
+#include <rsync/rsync_tokencompressor.h>
 #include <rsync/rsync_util.h>
 
 #include <openssl/evp.h>
 
 #include <set>
+#include <map>
 #include <algorithm>
 #include <sstream>
+#include <atomic>
+#include <thread>
 
 #include <cassert>
 #include <cstdio>
@@ -60,56 +74,8 @@ enum {
 // The initial chunk size
 const int DefaultChunkSize = 64 * 1024;
 
-const int NumberOfHashBuckets = 65536;
-
-// The rsync rolling checksum
-inline void getRollingChecksum(const char *chunk, int size,
-                               uint32_t &s1, uint32_t &s2)
-{
-    s1 = s2 = 0;
-    for (int i = 0; i < size; ++i) {
-        s1 += static_cast<int32_t>(chunk[i]);
-        s2 += s1;
-    }
-}
-
-// The hash for making the checksum hash table
-inline int getChecksumHash(uint32_t checksum)
-{
-    return ((checksum & 0xffff) + (checksum >> 16)) & 0xffff;
-}
-
-// A convenient method for calculating MD4/MD5 checksums
-void getMDDigest(int protocol, const char *data, int size, int32_t seed, char digest[16])
-{
-    Util::md_struct context;
-    Util::md_init(protocol, &context);
-    Util::md_update(protocol, &context, data, size);
-    Util::md_update(protocol, &context, reinterpret_cast<char *>(&seed), sizeof seed);
-    Util::md_final(protocol, &context, digest);
-}
- 
-// Given a file size, return a good block length.
-int getBlockLength(int64_t size)
-{
-    const unsigned int minimumBlockLength = 700;
-    const unsigned int maxBlockLength = 0x20000;
-    if (size < minimumBlockLength * minimumBlockLength) {
-        return minimumBlockLength;
-    }
-
-    uint32_t g = 0x80000000;
-    uint32_t c = 0x80000000;
-
-    while (c) {
-        if (static_cast<int64_t>(g) * g > size) {
-            g ^= c;
-        }
-        c >>= 1;
-        g |= c;
-    }
-    return (g > maxBlockLength) ? maxBlockLength : (g >> 3) * 8;
-}
+// The most bytes read ahead from an old file that can't be mapped.
+const int MaxReadAheadSize = 1 << 20;
 
 // Used to save the partial file.
 class PartialFileKeeper
@@ -158,6 +124,346 @@ private:
     time_t d_startTime;
 };
 
+// Used to stop the file writer from writing a file that is about to be closed when the download ends, normally or
+// not.
+class FileWriterStopper
+{
+public:
+
+    explicit FileWriterStopper(FileWriter *writer)
+        : d_writer(writer)
+    {
+    }
+
+    ~FileWriterStopper()
+    {
+        d_writer->abort();
+    }
+
+private:
+    //NOT IMPLEMENTED
+    FileWriterStopper(const FileWriterStopper&);
+    FileWriterStopper& operator=(const FileWriterStopper&);
+
+    FileWriter *d_writer;
+};
+
+// Used to discard a downloaded file that hasn't been handed over to the finalizer, removing its temporary file if it
+// has a name.
+class TemporaryFileRemover
+{
+public:
+
+    TemporaryFileRemover(File *file, const std::string &path)
+        : d_file(file)
+        , d_path(path)
+    {
+    }
+
+    ~TemporaryFileRemover()
+    {
+        if (d_file) {
+            d_file->close();
+            delete d_file;
+            if (!d_path.empty()) {
+                PathUtil::remove(d_path.c_str(), false);
+            }
+        }
+    }
+
+    // Give up the file once it has been handed over.
+    File *release()
+    {
+        File *file = d_file;
+        d_file = 0;
+        return file;
+    }
+
+private:
+    //NOT IMPLEMENTED
+    TemporaryFileRemover(const TemporaryFileRemover&);
+    TemporaryFileRemover& operator=(const TemporaryFileRemover&);
+
+    File *d_file;
+    std::string d_path;
+};
+
+// Add to 'entries' the paths in 'files', without any leading or trailing '/', along with every directory above them.
+// The directories, including the paths given with a trailing '/', are also added to 'directories' if it is not 0.
+void addIncludedEntries(const std::set<std::string> &files, std::set<std::string> *entries,
+                        std::set<std::string> *directories)
+{
+    for (std::set<std::string>::const_iterator iter = files.begin(); iter != files.end(); ++iter) {
+        const char *path = iter->c_str();
+        if (*path == '/') {
+            ++path;
+        }
+
+        for (const char *p = path; *p; ++p) {
+            if (*p == '/') {
+                std::string dir = std::string(path, p);
+                entries->insert(dir);
+                if (directories) {
+                    directories->insert(dir);
+                }
+            }
+        }
+        if (*path && path[::strlen(path) - 1] != '/') {
+            entries->insert(path);
+        }
+    }
+}
+
+// Builds the local file list for a download on a thread of its own, so that the local directory is indexed while the
+// remote file list is being received.
+class LocalFileListBuilder
+{
+public:
+
+    // Start adding the entries under 'localPath' to 'localFiles', preceded by the top directory unless 'singleFile'
+    // is true: those named in 'includeFiles' and the directories above them if it is not 0, leaving out those
+    // excluded by 'filter', otherwise everything listed by 'scanner'.
+    LocalFileListBuilder(DirectoryScanner *scanner, const std::string &localPath, bool singleFile, bool normalization,
+                         const std::set<std::string> *includeFiles, const Filter *filter, FileList *localFiles)
+        : d_scanner(scanner)
+        , d_localPath(localPath)
+        , d_singleFile(singleFile)
+        , d_normalization(normalization)
+        , d_includeFiles(includeFiles)
+        , d_filter(filter)
+        , d_localFiles(localFiles)
+        , d_completed(false)
+        , d_error(0)
+        , d_stopping(false)
+        , d_thread(&LocalFileListBuilder::run, this)
+    {
+    }
+
+    // Stop the listing if it hasn't been waited for, which is when the download has failed, and wait for the thread
+    // to exit.
+    ~LocalFileListBuilder()
+    {
+        d_stopping = true;
+        if (d_thread.joinable()) {
+            d_thread.join();
+        }
+        delete d_error;
+    }
+
+    // Wait until the list has been built.  Return false if cancelled, in which case only some of the entries have
+    // been added.  If an error stopped the listing, throw it here.
+    bool wait()
+    {
+        d_thread.join();
+        if (d_error) {
+            throw Exception(*d_error);
+        }
+        return d_completed;
+    }
+
+private:
+    //NOT IMPLEMENTED
+    LocalFileListBuilder(const LocalFileListBuilder&);
+    LocalFileListBuilder& operator=(const LocalFileListBuilder&);
+
+    void run()
+    {
+        try {
+            // The local entries are only kept here until they have been added to 'd_localFiles'.
+            EntryPool entryPool;
+
+            if (!d_singleFile) {
+                d_localFiles->add("./", true, 0, 0, 0);
+            }
+
+            // If 'd_includeFiles' is speicified, we'll create entries one by one from those included in it.
+            // Otherwise, we'll enumerate the entire directory recursively.
+            if (d_includeFiles) {
+                // The directories above them are on the remote file list too.
+                std::set<std::string> entries;
+                addIncludedEntries(*d_includeFiles, &entries, 0);
+                for (std::set<std::string>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+                    if (d_stopping) {
+                        return;
+                    }
+                    Entry *entry = PathUtil::createEntry(d_localPath.c_str(), iter->c_str(), &entryPool);
+                    if (entry && !d_filter->isPathExcluded(iter->c_str(), entry->isDirectory())) {
+                        d_localFiles->add(*entry);
+                    }
+                }
+
+                d_localFiles->sort(1);
+                d_completed = true;
+            } else {
+                std::vector<Entry*> entries;
+                d_scanner->setStopFlag(&d_stopping);
+                d_completed = d_scanner->scan(d_localPath.c_str(), d_normalization, &entries, &entryPool);
+                d_scanner->setStopFlag(0);
+                for (unsigned int i = 0; i < entries.size(); ++i) {
+                    d_localFiles->add(*entries[i]);
+                }
+            }
+        } catch (Exception &e) {
+            d_error = new Exception(e);
+        }
+    }
+
+    DirectoryScanner *d_scanner;
+    std::string d_localPath;
+    bool d_singleFile;
+    bool d_normalization;
+    const std::set<std::string> *d_includeFiles;
+    const Filter *d_filter;
+    FileList *d_localFiles;
+    bool d_completed;              // whether the list was built without being cancelled
+    Exception *d_error;            // the error that stopped the listing; 0 if none
+    std::atomic<bool> d_stopping;  // set when the list is no longer needed, to stop the listing early
+    std::thread d_thread;          // builds the list; started last, once everything above is set
+};
+
+// Keeps track of the segments of a remote file list.  Under incremental recursion, the server sends the file list in
+// segments: the top directory first, and then the entries in each directory received so far.  The server numbers
+// the entries across segments, starting from 1 and skipping one index between segments, and once all the files of a
+// segment have been received, the client must tell the server it is done with the segment.  Without incremental
+// recursion the whole list is one segment numbered from 0.
+class FileListSegments
+{
+public:
+    FileListSegments()
+        : d_segments()
+        , d_directories()
+        , d_finished(0)
+    {
+    }
+
+    // Add a segment holding the entries from 'begin' to 'end' of the list, of which 'pending' files are to be
+    // downloaded.  The first segment is numbered from 'firstIndex'; the others follow on from the last one.
+    void add(int begin, int end, int firstIndex, int pending)
+    {
+        Segment segment;
+        segment.d_begin = begin;
+        segment.d_end = end;
+        segment.d_firstIndex = firstIndex;
+        if (!d_segments.empty()) {
+            const Segment &last = d_segments.back();
+            segment.d_firstIndex = last.d_firstIndex + (last.d_end - last.d_begin) + 1;
+        }
+        segment.d_pending = pending;
+        d_segments.push_back(segment);
+    }
+
+    int getCount() const
+    {
+        return static_cast<int>(d_segments.size());
+    }
+
+    // Return the position in the list of the entry numbered 'index' by the server, or -1 if there is none.
+    int find(int index) const
+    {
+        int segment = getSegment(index, &Segment::d_firstIndex);
+        if (segment < 0 || index - d_segments[segment].d_firstIndex >= d_segments[segment].d_end -
+                                                                       d_segments[segment].d_begin) {
+            return -1;
+        }
+        return d_segments[segment].d_begin + (index - d_segments[segment].d_firstIndex);
+    }
+
+    // Return the index the server uses for the entry at 'position' of the list.
+    int getIndex(int position) const
+    {
+        const Segment &segment = d_segments[getSegment(position, &Segment::d_begin)];
+        return segment.d_firstIndex + (position - segment.d_begin);
+    }
+
+    // Mark the file at 'position' of the list as no longer to be downloaded.
+    void removePending(int position)
+    {
+        --d_segments[getSegment(position, &Segment::d_begin)].d_pending;
+    }
+
+    // Mark the earliest segment not yet finished as finished and return true if none of its files are still to be
+    // downloaded.  The server would take the last segment it has sent as the end of the list, so that one is only
+    // finished once 'listEnded' is true.
+    bool finishNext(bool listEnded)
+    {
+        if (d_finished >= getCount() || d_segments[d_finished].d_pending > 0 ||
+            (d_finished == getCount() - 1 && !listEnded)) {
+            return false;
+        }
+        ++d_finished;
+        return true;
+    }
+
+    // Directories are numbered in the order they are added, from 0.
+    void addDirectory(int position)
+    {
+        d_directories.push_back(position);
+    }
+
+    // Return the position in the list of the directory numbered 'directory', or -1 if there is none.
+    int getDirectory(int directory) const
+    {
+        if (directory < 0 || directory >= static_cast<int>(d_directories.size())) {
+            return -1;
+        }
+        return d_directories[directory];
+    }
+
+private:
+    struct Segment
+    {
+        int d_begin;               // the position in the list of the first entry
+        int d_end;                 // the position in the list after the last entry
+        int d_firstIndex;          // the index of the first entry used by the server
+        int d_pending;             // the number of files still to be downloaded
+    };
+
+    // Return the last segment whose 'field' is not greater than 'value', or -1 if there is none.
+    int getSegment(int value, int Segment::*field) const
+    {
+        int low = 0;
+        int high = getCount();
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (d_segments[middle].*field <= value) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low - 1;
+    }
+
+    std::vector<Segment> d_segments;   // segments in the order they were received
+    std::vector<int> d_directories;    // the position in the list of each directory, in the order of the server
+    int d_finished;                    // the number of segments finished
+};
+
+// Add the files at 'queue' from 'begin' to the end to 'pipeline', with the old files under 'localPath' as the basis
+// files.
+void addToPipeline(SignaturePipeline *pipeline, const FileList &remoteFiles, const std::string &localPath,
+                   const std::vector<int> &queue, size_t begin)
+{
+    for (size_t j = begin; j < queue.size(); ++j) {
+        if (remoteFiles.isReadable(queue[j])) {
+            std::string localFile = PathUtil::join(localPath.c_str(), remoteFiles.getPath(queue[j]).c_str());
+            pipeline->add(queue[j], PathUtil::exists(localFile.c_str()) ? localFile : std::string());
+        }
+    }
+}
+
+// Return the directory of the session in which 'path' is created: the directory above the highest directory in
+// 'directories' that 'path' is under, or else the directory above 'path'.
+std::string getCreationDirectory(const std::string &path, const std::set<std::string> &directories)
+{
+    for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        if (slash > 0 && directories.count(path.substr(0, slash))) {
+            return PathUtil::getDirectory(path.substr(0, slash).c_str());
+        }
+    }
+    return PathUtil::getDirectory(path.c_str());
+}
+
 // Valid characters for paths.
 uint8_t validatePathCharacterTable[] =
 {
@@ -208,9 +514,28 @@ Client::Client(IO*io, const char *rsyncCommand, int preferredProtocol, int *canc
     : d_usingSSH(dynamic_cast<SSHIO*>(io))
     , d_io(io)
     , d_stream(new Stream(d_io, cancelFlagAddress))
+    , d_cancelFlag(cancelFlagAddress)
     , d_rsyncCommand(rsyncCommand)
     , d_downloadLimit(0)
     , d_deletionEnabled(false)
+    , d_memoryMappingEnabled(false)
+    , d_basisMappingEnabled(false)
+    , d_signatureCache(0)
+    , d_signatureThreads(0)
+    , d_signatureMemoryBudget(0)
+    , d_compressionEnabled(false)
+    , d_tokenCompressor(0)
+    , d_inPlaceEnabled(false)
+    , d_sparseEnabled(false)
+    , d_preallocationEnabled(false)
+    , d_fileWriter(new FileWriter(0))
+    , d_finalizerThreads(0)
+    , d_scannerThreads(0)
+    , d_inodeOrderEnabled(false)
+    , d_streamingUploadEnabled(false)
+    , d_incrementalRecursionEnabled(false)
+    , d_incrementalRecursion(false)
+    , d_filter()
     , d_backupPaths()
     , d_protocol(preferredProtocol)
     , d_checksumSeed(0)
@@ -218,7 +543,7 @@ Client::Client(IO*io, const char *rsyncCommand, int preferredProtocol, int *canc
     , d_lastEntryMode(0)
     , d_lastEntryPath()
     , d_numberOfChecksums(256)
-    , d_hashBuckets(new int[NumberOfHashBuckets])
+    , d_checksumIndex()
     , d_checksums(new Checksum[d_numberOfChecksums])
     , d_chunk(new char[DefaultChunkSize])
     , d_chunkSize(DefaultChunkSize)
@@ -236,10 +561,11 @@ Client::~Client()
 {
     // Leave d_io alone as it may be resued for next sync.
 
-    delete [] d_hashBuckets;
     delete [] d_checksums;
     delete [] d_chunk;
 
+    delete d_tokenCompressor;
+    delete d_fileWriter;
     delete d_stream;
 }
 
@@ -255,6 +581,78 @@ void Client::setDeletionEnabled(bool deletionEnabled)
     d_deletionEnabled = deletionEnabled;
 }
     
+void Client::setMemoryMappingEnabled(bool memoryMappingEnabled)
+{
+    d_memoryMappingEnabled = memoryMappingEnabled;
+}
+
+void Client::setBasisMappingEnabled(bool basisMappingEnabled)
+{
+    d_basisMappingEnabled = basisMappingEnabled;
+}
+
+void Client::setSignatureCache(SignatureCache *signatureCache)
+{
+    d_signatureCache = signatureCache;
+}
+
+void Client::setSignatureThreads(int numberOfThreads, int64_t memoryBudget)
+{
+    d_signatureThreads = numberOfThreads;
+    d_signatureMemoryBudget = memoryBudget;
+}
+
+void Client::setCompressionEnabled(bool compressionEnabled)
+{
+    d_compressionEnabled = compressionEnabled;
+}
+
+void Client::setInPlaceEnabled(bool inPlaceEnabled)
+{
+    d_inPlaceEnabled = inPlaceEnabled;
+}
+
+void Client::setSparseEnabled(bool sparseEnabled)
+{
+    d_sparseEnabled = sparseEnabled;
+}
+
+void Client::setPreallocationEnabled(bool preallocationEnabled)
+{
+    d_preallocationEnabled = preallocationEnabled;
+}
+
+void Client::setWriteBehind(int64_t memoryBudget)
+{
+    delete d_fileWriter;
+    d_fileWriter = new FileWriter(memoryBudget);
+}
+
+void Client::setFinalizerThreads(int numberOfThreads)
+{
+    d_finalizerThreads = numberOfThreads;
+}
+
+void Client::setScannerThreads(int numberOfThreads)
+{
+    d_scannerThreads = numberOfThreads;
+}
+
+void Client::setInodeOrderEnabled(bool inodeOrderEnabled)
+{
+    d_inodeOrderEnabled = inodeOrderEnabled;
+}
+
+void Client::setStreamingUploadEnabled(bool streamingUploadEnabled)
+{
+    d_streamingUploadEnabled = streamingUploadEnabled;
+}
+
+void Client::setIncrementalRecursionEnabled(bool incrementalRecursionEnabled)
+{
+    d_incrementalRecursionEnabled = incrementalRecursionEnabled;
+}
+
 void Client::addBackupPath(const char *backupPath)
 {
     d_backupPaths.push_back(std::string(backupPath));
@@ -265,6 +663,16 @@ void Client::clearBackupPaths()
     d_backupPaths.clear();
 }
 
+void Client::addFilterRule(const char *rule)
+{
+    d_filter.add(rule);
+}
+
+void Client::clearFilterRules()
+{
+    d_filter.clear();
+}
+
 
 void Client::setStatsAddresses(int64_t *totalBytes, int64_t *physicalBytes, int64_t *logicalBytes, int64_t *skippedBytes)
 {
@@ -401,58 +809,72 @@ bool Client::receiveEntry(std::string *path, bool *isDir, int64_t *size, int64_t
     return true;
 }
 
-void Client::sendChecksum(int index, const char *oldFile)
+void Client::receiveSegment(FileList *remoteFiles, int directory)
 {
-    File f;
-
-    // Send the index and the flag
-    writeIndex(index);
-    d_stream->writeUInt16(0x8000); 
+    std::string path;
+    bool isDir;
+    int64_t size, time;
+    uint32_t mode;
+    std::string symlink;
 
-    // The size of the old file
-    int64_t oldFileSize = 0;
-    if (oldFile) {
-        oldFileSize = PathUtil::getSize(oldFile);
+    int begin = remoteFiles->size();
+    while (receiveEntry(&path, &isDir, &size, &time, &mode, &symlink)) {
+        int index = remoteFiles->add(path.c_str(), isDir, size, time, mode, symlink.c_str());
+        if (!remoteFiles->contains(directory, index)) {
+            LOG_FATAL(RSYNC_SEGMENT) << "Received '" << path << "' in the file list of '"
+                                     << remoteFiles->getPath(directory) << "'" << LOG_END
+        }
+        if (!remoteFiles->isLink(index)) {
+            *d_totalBytes += size;
+        }
     }
 
-    // If we can open the old file then send all zeroes
-    if (!oldFile || !f.open(oldFile, false, false)) {
-        d_stream->writeInt32(0);
-        d_stream->writeInt32(0);
-        d_stream->writeInt32(0);
-        d_stream->writeInt32(0);
-        return;
+    remoteFiles->sort(begin);
+}
+
+void Client::sendChecksum(int index, const char *oldFile)
+{
+    std::string signatures;
+    if (!SignaturePipeline::computeSignatures(oldFile, d_protocol, d_checksumSeed, d_signatureCache, d_cancelFlag,
+                                              &signatures)) {
+        d_stream->checkCancelFlag();
     }
+    writeSignatures(index, signatures);
+}
 
-    // The old file will be divided into 'count' blocks each of which has a length of 'blockLength'.
-    int32_t blockLength = getBlockLength(oldFileSize);
-    int32_t md5Length = 16;
-    int32_t count = (oldFileSize - 1) / blockLength + 1;
-    int32_t remainder = oldFileSize - (count - 1) * blockLength;
+void Client::writeSignatures(int index, const std::string &signatures)
+{
+    // Send the index and the flag
+    writeIndex(index);
+    d_stream->writeUInt16(0x8000);
 
-    resizeChunk(blockLength);
+    // Send the header and the actual checksums
+    d_stream->write(signatures.c_str(), static_cast<int>(signatures.size()));
+}
 
-    // Send the header
-    d_stream->writeInt32(count);
-    d_stream->writeInt32(blockLength);
-    d_stream->writeInt32(md5Length);
-    d_stream->writeInt32(remainder);
+bool Client::receiveFile(const char *remotePath, const char *newFilePath, const char *oldFilePath,
+                         int64_t expectedSize, int64_t *fileSize)
+{
+    // The file is updated in place if it is also the old file.
+    bool inPlace = oldFilePath && ::strcmp(newFilePath, oldFilePath) == 0;
 
-    // Send the actualy checksum
-    int bytes;
-    uint32_t s1, s2;
-    char digest[16];
-    for (int i = 0; i < count; ++i) {
-        d_stream->checkCancelFlag();
-        bytes = f.read(d_chunk, blockLength);
-        getRollingChecksum(d_chunk, bytes, s1, s2);
-        d_stream->writeInt32((s1 & 0xffff) | (s2 << 16));
-        getMDDigest(d_protocol, d_chunk, bytes, d_checksumSeed, digest);
-        d_stream->write(digest, sizeof(digest));
+    // Try to open the file
+    File newFile;
+    if (inPlace) {
+        newFile.openForUpdate(newFilePath, true);
+    } else {
+        newFile.open(newFilePath, true, true);
     }
+    if (!newFile.isValid()) {
+        LOG_FATAL(RSYNC_OPEN) << "Abort operation due to an open error" << LOG_END
+        return false;
+    }
+
+    return receiveFile(remotePath, &newFile, oldFilePath, inPlace, expectedSize, fileSize);
 }
 
-bool Client::receiveFile(const char *remotePath, const char *newFilePath, const char *oldFilePath, int64_t *fileSize)
+bool Client::receiveFile(const char *remotePath, File *newFile, const char *oldFilePath, bool inPlace,
+                         int64_t expectedSize, int64_t *fileSize)
 {
     // Receive the iflags
     uint32_t iflags = d_stream->readUInt16();
@@ -469,17 +891,17 @@ bool Client::receiveFile(const char *remotePath, const char *newFilePath, const
 
     resizeChunk(blockLength);
 
-    // Try to open the file
-    File newFile(newFilePath, true, true);
-    if (!newFile.isValid()) {
-        LOG_FATAL(RSYNC_OPEN) << "Abort operation due to an open error" << LOG_END
+    // If the disk is too full for the file, there is no point in downloading it or any other file.
+    bool preallocated = d_preallocationEnabled && !d_sparseEnabled && expectedSize > 0;
+    if (preallocated && !newFile->allocate(expectedSize)) {
+        LOG_FATAL(RSYNC_ALLOCATE) << "Abort operation as there is no space for '" << remotePath << "'" << LOG_END
         return false;
     }
 
     // If checksums have been received (count > 0), we must open the old file to retrieve chunks that have not
     // been modified
     File oldFile;
-    if (count) {
+    if (count && !inPlace) {
         if (!oldFilePath || !oldFile.open(oldFilePath, false, false)) {
             LOG_FATAL(RSYNC_BASE) << "Local file disappeared when transferring '" 
                                   << remotePath << "'" << LOG_END
@@ -487,10 +909,10 @@ bool Client::receiveFile(const char *remotePath, const char *newFilePath, const
     }
 
     int token;
+    const char *data = 0;
     *fileSize = 0;
     int64_t physicalBytes = 16;
     int64_t logicalBytes = 0;
-    int previousToken = 0;
 
     Util::md_struct md_context;
     Util::md_init(d_protocol, &md_context);
@@ -499,37 +921,155 @@ bool Client::receiveFile(const char *remotePath, const char *newFilePath, const
                   sizeof d_checksumSeed);  
     }
 
-    while ((token = d_stream->readInt32()) != 0) {
+    // If mapping is enabled and the old file can be mapped, matched chunks are hashed directly from the mapping,
+    // and each run of consecutive chunks is copied to the new file in one go, without passing through user space
+    // if possible.
+    MappedFile oldMapping;
+    if (oldFile.isValid() && d_basisMappingEnabled) {
+        oldMapping.map(oldFilePath);
+    }
+    int64_t runOffset = 0;         // the offset in the old file of the chunks matched but not yet copied
+    int64_t runLength = 0;         // the number of bytes matched but not yet copied
+
+    // Otherwise the old file is read into 'window', reading further ahead each time the chunks follow on from the
+    // window, and each run of consecutive chunks in the window is written in one go.
+    std::vector<char> window;
+    int64_t windowOffset = 0;      // the offset in the old file of the data in 'window'
+    int windowLength = 0;          // the number of bytes in 'window'
+    bool windowAtEnd = false;      // whether 'window' reaches the end of the old file
+    int64_t oldPosition = 0;       // the current position of the old file
+    int readAhead = 1;             // the number of chunks read into 'window' last time
+    int pendingStart = 0;          // the start in 'window' of the chunks matched but not yet written
+    int pendingLength = 0;         // the number of bytes in 'window' matched but not yet written
+
+    // Files updated in place are read back while being written, so they are written directly.
+    d_fileWriter->start(newFile, d_sparseEnabled, inPlace, inPlace);
+    FileWriterStopper stopper(d_fileWriter);
+
+    while ((token = receiveToken(&data, &physicalBytes)) != 0) {
         if (token > 0) {
-            // A positive token means a chunk is going to be sent over the wire, and the token is actually the
-            // length of the chunk
-            resizeChunk(token);
-            d_stream->read(d_chunk, token);
-            newFile.write(d_chunk, token);
-            Util::md_update(d_protocol, &md_context, d_chunk, token);
+            // A positive token means a chunk has been sent over the wire, and the token is actually the length of
+            // the chunk
+            if (runLength > 0) {
+                d_fileWriter->copy(&oldFile, runOffset, runLength, oldMapping.getData() + runOffset);
+                runLength = 0;
+            }
+            if (pendingLength > 0) {
+                d_fileWriter->write(&window[pendingStart], pendingLength);
+                pendingLength = 0;
+            }
+            d_fileWriter->write(data, token);
+            Util::md_update(d_protocol, &md_context, data, token);
             *fileSize += token; 
-            physicalBytes += 4 + token;
-            *d_physicalBytes += 4 + token;
             logicalBytes += token;
             *d_logicalBytes += token;
+        } else if (inPlace) {
+            // A chunk already at the right offset is only read for the checksum.  Otherwise the whole chunk is read
+            // before it is written, so it may overlap its new position.  The sender never refers to a chunk that
+            // has been overwritten, except at the same offset; if it did, the checksum of the whole file would not
+            // match.
+            token = -token - 1;
+            int64_t offset = static_cast<int64_t>(token) * blockLength;
+            if (offset != *fileSize) {
+                newFile->seek(offset, File::SEEK_FROM_BEGIN);
+            }
+            int bytes = newFile->read(d_chunk, blockLength);
+            if (offset != *fileSize) {
+                newFile->seek(*fileSize, File::SEEK_FROM_BEGIN);
+                d_fileWriter->write(d_chunk, bytes);
+            }
+            Util::md_update(d_protocol, &md_context, d_chunk, bytes);
+            if (d_tokenCompressor) {
+                d_tokenCompressor->seeToken(d_chunk, bytes);
+            }
+            *fileSize += bytes;
+            logicalBytes += bytes;
+            *d_logicalBytes += bytes;
+        } else if (oldMapping.isValid()) {
+            token = -token - 1;
+            int64_t offset = static_cast<int64_t>(token) * blockLength;
+            int bytes = 0;
+            if (offset < oldMapping.getSize()) {
+                bytes = static_cast<int>(std::min<int64_t>(blockLength, oldMapping.getSize() - offset));
+            }
+            const char *chunk = oldMapping.getData() + offset;
+            Util::md_update(d_protocol, &md_context, chunk, bytes);
+            if (d_tokenCompressor) {
+                d_tokenCompressor->seeToken(chunk, bytes);
+            }
+            if (runLength > 0 && runOffset + runLength != offset) {
+                d_fileWriter->copy(&oldFile, runOffset, runLength, oldMapping.getData() + runOffset);
+                runLength = 0;
+            }
+            if (runLength == 0) {
+                runOffset = offset;
+            }
+            runLength += bytes;
+            *fileSize += bytes;
+            logicalBytes += bytes;
+            *d_logicalBytes += bytes;
         } else if (oldFile.isValid()) {
             // Otherwise, the token indicate a chunk in the old file
             token = -token - 1;
-            if (previousToken == 0 || previousToken != token) {
-                oldFile.seek(static_cast<int64_t>(token) * blockLength, File::SEEK_FROM_BEGIN);
+            int64_t offset = static_cast<int64_t>(token) * blockLength;
+            if (offset < windowOffset || offset + (windowAtEnd ? 1 : blockLength) > windowOffset + windowLength) {
+                if (pendingLength > 0) {
+                    d_fileWriter->write(&window[pendingStart], pendingLength);
+                    pendingLength = 0;
+                }
+                if (offset == windowOffset + windowLength && !windowAtEnd) {
+                    readAhead = std::min(readAhead * 2, std::max(MaxReadAheadSize / blockLength, 1));
+                } else {
+                    readAhead = 1;
+                }
+                int size = readAhead * blockLength;
+                if (static_cast<int>(window.size()) < size) {
+                    window.resize(size);
+                }
+                if (offset != oldPosition) {
+                    oldFile.seek(offset, File::SEEK_FROM_BEGIN);
+                }
+                windowOffset = offset;
+                windowLength = oldFile.read(&window[0], size);
+                windowAtEnd = windowLength < size;
+                oldPosition = offset + windowLength;
+            }
+            int start = static_cast<int>(offset - windowOffset);
+            int bytes = std::max(std::min(blockLength, windowLength - start), 0);
+            if (pendingLength > 0 && pendingStart + pendingLength != start) {
+                d_fileWriter->write(&window[pendingStart], pendingLength);
+                pendingLength = 0;
+            }
+            if (pendingLength == 0) {
+                pendingStart = start;
+            }
+            pendingLength += bytes;
+            Util::md_update(d_protocol, &md_context, &window[0] + start, bytes);
+            if (d_tokenCompressor) {
+                d_tokenCompressor->seeToken(&window[0] + start, bytes);
             }
-            int bytes = oldFile.read(d_chunk, blockLength);
-            newFile.write(d_chunk, bytes);
-            Util::md_update(d_protocol, &md_context, d_chunk, bytes); 
-            previousToken = token + 1;
             *fileSize += bytes;
-            physicalBytes += 4;
-            *d_physicalBytes += 4;
             logicalBytes += bytes;
             *d_logicalBytes += bytes;
         }
     }
 
+    if (runLength > 0) {
+        d_fileWriter->copy(&oldFile, runOffset, runLength, oldMapping.getData() + runOffset);
+    }
+    if (pendingLength > 0) {
+        d_fileWriter->write(&window[pendingStart], pendingLength);
+    }
+
+    // Everything must be on disk before the file can be checked and renamed.
+    bool written = d_fileWriter->finish();
+
+    // Anything left from the old content is no longer needed.  A sparse file may also end with a hole, which
+    // nothing has been written to, and a preallocated file may have space reserved past its end.
+    if (inPlace || d_sparseEnabled || preallocated) {
+        newFile->truncate(*fileSize);
+    }
+
     // The MD5 checksum of the entire file is transmitted at the end, so we can make sure that we've got the
     // right file.  This means that if there is any error we'll be able to tell and retry later.
     char localDigest[16], remoteDigest[16];
@@ -538,13 +1078,107 @@ bool Client::receiveFile(const char *remotePath, const char *newFilePath, const
     physicalBytes += 16;
     *d_physicalBytes += 16;
 
-    if (::strncmp(remoteDigest, reinterpret_cast<const char*>(localDigest), sizeof(remoteDigest))) {
-        LOG_ERROR(RSYNC_CHECKSUM) << "Failed to download '" << remotePath << "': checksum mismatch" << LOG_END
-        return false;
-    } else {
-        LOG_INFO(RSYNC_DOWNLOAD) << "Downloaded " << remotePath
-                                 << " (" << logicalBytes << "/" << physicalBytes << ")" << LOG_END
-        return true;
+    if (!written) {
+        LOG_ERROR(RSYNC_WRITE) << "Failed to download '" << remotePath << "': write error" << LOG_END
+        return false;
+    } else if (::strncmp(remoteDigest, reinterpret_cast<const char*>(localDigest), sizeof(remoteDigest))) {
+        LOG_ERROR(RSYNC_CHECKSUM) << "Failed to download '" << remotePath << "': checksum mismatch" << LOG_END
+        return false;
+    } else {
+        LOG_INFO(RSYNC_DOWNLOAD) << "Downloaded " << remotePath
+                                 << " (" << logicalBytes << "/" << physicalBytes << ")" << LOG_END
+        return true;
+    }
+}
+
+void Client::compareFileLists(const FileList &localFiles, const FileList &remoteFiles, int begin,
+                              const std::string &localPath, std::vector<int> *queue)
+{
+    size_t first = queue->size();
+
+    // Find the first local entry that is not ahead of the remote entry at 'begin'.  Unless a single file is being
+    // downloaded, both lists start with the top directory, which is not compared with the other entries.
+    int i = begin > 0 ? 1 : 0;
+    int high = localFiles.size();
+    while (i < high) {
+        int middle = i + (high - i) / 2;
+        if (FileList::compare(localFiles, middle, remoteFiles, begin)) {
+            i = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (int index = begin; index < remoteFiles.size(); ++index) {
+
+        while (i < localFiles.size() && FileList::compare(localFiles, i, remoteFiles, index)) {
+            ++i;
+        }
+        std::string remoteFile = remoteFiles.getPath(index);
+        std::string path = PathUtil::join(localPath.c_str(), remoteFile.c_str());
+        if (i >= localFiles.size() || FileList::compare(remoteFiles, index, localFiles, i)) {
+            // Local file/dir doesn't exist
+            if (remoteFiles.isDirectory(index)) {
+                PathUtil::createDirectory(path.c_str());
+                *d_skippedBytes += remoteFiles.getSize(index);
+            } else if (remoteFiles.isLink(index)) {
+                PathUtil::createSymlink(path.c_str(), remoteFiles.getSymlink(index), remoteFiles.isDirectory(index));
+            } else if (!remoteFiles.isRegular(index)) {
+                LOG_INFO(RSYNC_SKIP) << "Skip non-regular file '" << remoteFile << "'" << LOG_END
+            } else {
+                // The rmeote file must be downloaded unless the path is invalid
+                const char *path = remoteFile.c_str();
+                if (validatePathCharacters(path) && (*path != '.' || ::strncmp(path, ".acrosync/", 10))) {
+                    queue->push_back(index);
+                }
+            }
+        } else if (remoteFiles.isLink(index)) {
+            PathUtil::remove(path.c_str());
+            PathUtil::createSymlink(path.c_str(), remoteFiles.getSymlink(index), remoteFiles.isDirectory(index));
+        } else if (remoteFiles.isDirectory(index)) {
+            // It is a directory on the remote side.
+            if (!localFiles.isDirectory(i)) {
+                PathUtil::remove(path.c_str());
+                PathUtil::createDirectory(path.c_str());
+                PathUtil::setMode(path.c_str(), remoteFiles.getMode(index));
+            } else if (localFiles.getMode(i) != remoteFiles.getMode(index)) {
+                PathUtil::setMode(path.c_str(), remoteFiles.getMode(index));
+            }
+        } else {
+            // It is a file on the remote side.
+            if (localFiles.isDirectory(i)) {
+                PathUtil::remove(path.c_str());
+                queue->push_back(index);
+            } else if (!remoteFiles.isRegular(index)) {
+                // Skipping non-regular file silently
+            } else if (localFiles.isOlderThan(i, remoteFiles, index)) {
+                if (validatePathCharacters(remoteFile.c_str())) {
+                    queue->push_back(index);
+                }
+            } else {
+                *d_skippedBytes += remoteFiles.getSize(index);
+                if (localFiles.getMode(i) != remoteFiles.getMode(index)) {
+                    PathUtil::setMode(path.c_str(), remoteFiles.getMode(index));
+                }
+            }
+        }
+    }
+
+    // The old files are read in the order of their inode numbers, which on most filesystems is close to the order
+    // of their data on disk.  The server sends the files in whatever order they are asked for.
+    if (d_inodeOrderEnabled && queue->size() > first + 1) {
+        std::vector<std::pair<uint64_t, int> > order;
+        for (size_t j = first; j < queue->size(); ++j) {
+            std::string localFile = PathUtil::join(localPath.c_str(), remoteFiles.getPath((*queue)[j]).c_str());
+            int64_t size, time, changeTime;
+            uint64_t device, inode = 0;
+            PathUtil::getFileIdentity(localFile.c_str(), &size, &time, &changeTime, &device, &inode);
+            order.push_back(std::make_pair(inode, (*queue)[j]));
+        }
+        std::sort(order.begin(), order.end());
+        for (size_t j = first; j < queue->size(); ++j) {
+            (*queue)[j] = order[j - first].second;
+        }
     }
 }
 
@@ -570,12 +1204,36 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
         PathUtil::createDirectory(localPath.c_str());
     }
 
-    start(remotePath.c_str(), /*downloading=*/true, /*recursive=*/true, /*deleting=*/false);
+    // With 'includeFiles', only the entries in it and the directories above them are asked for, so that the remote
+    // file list is no larger than the selection.  The rules set on the client still come first.
+    Filter filter(d_filter);
+    if (includeFiles && !singleFile) {
+        std::set<std::string> entries;
+        std::set<std::string> directories;
+        addIncludedEntries(*includeFiles, &entries, &directories);
+        for (std::set<std::string>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+            std::string rule = "+ /" + Filter::escape(iter->c_str());
+            if (directories.count(*iter)) {
+                rule += "/";
+            }
+            filter.add(rule.c_str());
+        }
+        filter.add("- *");
+    }
+
+    start(remotePath.c_str(), /*downloading=*/true, /*recursive=*/true, /*deleting=*/false, &filter);
 
-    std::vector<Entry*> remoteFiles;
-    Util::EntryListReleaser remoteFilesReleaser(&remoteFiles);
+    // The local directory is indexed while the remote file list is being received.  The server leaves out what the
+    // filter rules exclude, so the same is left out here to keep those local files from being deleted.
+    FileList localFiles;
+    DirectoryScanner scanner(d_scannerThreads, d_cancelFlag);
+    scanner.setInodeOrderEnabled(d_inodeOrderEnabled);
+    scanner.setFilter(&d_filter);
+    LocalFileListBuilder localFilesBuilder(&scanner, localPath, singleFile, d_protocol > 29, includeFiles,
+                                           &d_filter, &localFiles);
+
+    FileList remoteFiles;
 
-    Entry *entry;
     std::string path;
     bool isDir;
     int64_t size, time;
@@ -586,20 +1244,19 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
         statusOut((std::string("Indexing remote directory ") + remoteTop).c_str());
     }
 
-    // First receive the list of file entries from the server.
+    // First receive the list of file entries from the server.  Under incremental recursion this is only the first
+    // segment.
+    bool topAdded = false;         // whether the top directory wasn't sent and has been added here
     while ((receiveEntry(&path, &isDir, &size, &time, &mode, &symlink)) != 0) {
-        if (!singleFile && remoteFiles.empty() && path != ".") {
-            remoteFiles.push_back(new Entry("./", true, 0, 0, 0));
+        if (!singleFile && remoteFiles.size() == 0 && path != ".") {
+            remoteFiles.add("./", true, 0, 0, 0);
+            topAdded = true;
         }
 
-        entry = new Entry(path.c_str(), isDir, size, time, mode);
-        if (entry->isLink()) {
-            entry->setSymlink(symlink);
-        } else {
+        int index = remoteFiles.add(path.c_str(), isDir, size, time, mode, symlink.c_str());
+        if (!remoteFiles.isLink(index)) {
             *d_totalBytes += size;
         }
-        entry->normalizePath();
-        remoteFiles.push_back(entry);
     }
 
     // Ignore the 'io_error' flag.
@@ -607,7 +1264,7 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
         d_stream->readInt32();
     }
 
-    if (remoteFiles.empty()) {
+    if (remoteFiles.size() == 0) {
         return 0;
     }
 
@@ -616,41 +1273,11 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
     }
 
     // Usually the remote file list should be already sorted, but it doesn't hurt to sort it again.
-    std::vector<Entry*>::iterator start = remoteFiles.begin();
-    std::sort(++start, remoteFiles.end(), Entry::compareGlobally);
-
-    // Now let's construct the local file list.
-    std::vector<Entry*> localFiles, localDirectories;
-    Util::EntryListReleaser localFilesReleaser(&localFiles);
-
-    if (!singleFile) {
-    localFiles.push_back(new Entry("./", true, 0, 0, 0));
-    }
-
-    // If 'includeFiles' is speicified, we'll create entries one by one from those included in 'includeFiles'.
-    // Otherwise, we'll enumerate the entire directory recursively.
-    if (includeFiles) {
-    for (std::set<std::string>::const_iterator iter = includeFiles->begin();
-            iter != includeFiles->end(); ++iter) {
-        Entry *entry = PathUtil::createEntry(localPath.c_str(), iter->c_str());
-        if (entry) {
-            entry->normalizePath();
-        localFiles.push_back(entry);
-            }
-        }
-
-        std::sort(localFiles.begin() + 1, localFiles.end(), Entry::compareGlobally);
-    } else {
-        PathUtil::listDirectory(localPath.c_str(), "", &localFiles, &localDirectories, d_protocol > 29);
-        while (localDirectories.size()) {
-            entry = localDirectories.back();
-            localDirectories.pop_back();
-            localFiles.push_back(entry);
-            PathUtil::listDirectory(localPath.c_str(), entry->getPath(), &localFiles, &localDirectories,
-                                    d_protocol > 29);
+    remoteFiles.sort(1);
 
-            d_stream->checkCancelFlag();
-    }
+    // Now wait for the local file list.
+    if (!localFilesBuilder.wait()) {
+        d_stream->checkCancelFlag();
     }
 
     if (statusOut.isConnected()) {
@@ -658,60 +1285,16 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
     }
 
     std::vector<int> queue;         // store the indices of files needed to be downloaded
-
-    int begin = singleFile ? 0 : 1;
-    int i = begin;
-    for (int index = begin; index < remoteFiles.size(); ++index) {
-
-        while (i < localFiles.size() && Entry::compareGlobally(localFiles[i], remoteFiles[index])) {
-            ++i;
-        }
-        std::string path = PathUtil::join(localPath.c_str(), remoteFiles[index]->getPath());
-        if (i >= localFiles.size() || Entry::compareGlobally(remoteFiles[index], localFiles[i])) {
-            // Local file/dir doesn't exist
-            if (remoteFiles[index]->isDirectory()) {
-                PathUtil::createDirectory(path.c_str());
-                *d_skippedBytes += remoteFiles[index]->getSize();
-            } else if (remoteFiles[index]->isLink()) {
-                PathUtil::createSymlink(path.c_str(), remoteFiles[index]->getSymlink(), remoteFiles[index]->isDirectory());
-            } else if (!remoteFiles[index]->isRegular()) {
-                LOG_INFO(RSYNC_SKIP) << "Skip non-regular file '" << remoteFiles[index]->getPath() << "'" << LOG_END
-            } else {
-                // The rmeote file must be downloaded unless the path is invalid
-                const char *path = remoteFiles[index]->getPath();
-                if (validatePathCharacters(remoteFiles[index]->getPath()) && (*path != '.' || ::strncmp(path, ".acrosync/", 10))) {
-                    queue.push_back(index);
-                }
-            }
-        } else if (remoteFiles[index]->isLink()) {
-            PathUtil::remove(path.c_str());
-            PathUtil::createSymlink(path.c_str(), remoteFiles[index]->getSymlink(), remoteFiles[index]->isDirectory());
-        } else if (remoteFiles[index]->isDirectory()) {
-            // It is a directory on the remote side.
-            if (!localFiles[i]->isDirectory()) {
-                PathUtil::remove(path.c_str());
-                PathUtil::createDirectory(path.c_str());
-                PathUtil::setMode(path.c_str(), remoteFiles[index]->getMode());
-            } else if (localFiles[i]->getMode() != remoteFiles[index]->getMode()) {
-                PathUtil::setMode(path.c_str(), remoteFiles[index]->getMode());
-            }
-        } else {
-            // It is a file on the remote side.
-            if (localFiles[i]->isDirectory()) {
-                PathUtil::remove(path.c_str());
-                queue.push_back(index);
-            } else if (!remoteFiles[index]->isRegular()) {
-                // Skipping non-regular file silently
-            } else if (localFiles[i]->isOlderThan(*remoteFiles[index])) {
-                if (validatePathCharacters(remoteFiles[index]->getPath())) {
-                    queue.push_back(index);
-                }
-            } else {
-                *d_skippedBytes += remoteFiles[index]->getSize();
-                if (localFiles[i]->getMode() != remoteFiles[index]->getMode()) {
-                    PathUtil::setMode(path.c_str(), remoteFiles[index]->getMode());
-                }
-            }
+    compareFileLists(localFiles, remoteFiles, singleFile ? 0 : 1, localPath, &queue);
+
+    // Indices sent to and received from the server go through 'segments', as under incremental recursion they are
+    // not the positions in 'remoteFiles'.  The directories of each segment are numbered in order.
+    FileListSegments segments;
+    int firstEntry = d_incrementalRecursion && topAdded ? 1 : 0;
+    segments.add(firstEntry, remoteFiles.size(), d_incrementalRecursion ? 1 : 0, static_cast<int>(queue.size()));
+    for (int index = firstEntry; d_incrementalRecursion && index < remoteFiles.size(); ++index) {
+        if (remoteFiles.isDirectory(index)) {
+            segments.addDirectory(index);
         }
     }
 
@@ -721,12 +1304,33 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
 
     std::vector<int> retries;     // Store indices of files that must be retrasmitted due to errors.
 
+    // Under incremental recursion the server no longer knows the files of a segment once the segment is finished,
+    // so a file that fails is asked for again right away instead, without the base file, and only once.
+    std::set<int> retried;
+
+    bool listEnded = !d_incrementalRecursion;   // whether all segments of the file list have been received
+    int acknowledged = 0;                       // the number of segments the server has confirmed as finished
+
+    // Computes the checksums of the files in the queue ahead of time if 'd_signatureThreads' is not 0.
+    SignaturePipeline pipeline(d_signatureThreads, d_signatureMemoryBudget, d_cancelFlag);
+
+    // Closes and renames downloaded files in the background if 'd_finalizerThreads' is not 0.
+    FileFinalizer finalizer(d_finalizerThreads);
+    bool finalizing = d_finalizerThreads > 0 && !d_inPlaceEnabled;
+
     int phase = 0;
     int updated = 0;
-    while (phase < 2 && queue.size()) {
+    while (phase < 2 && (queue.size() || (phase == 0 && d_incrementalRecursion))) {
 
         int i = 0;
 
+        // Files are downloaded again in the second phase without the base files, so there is nothing to compute.
+        bool pipelined = phase == 0 && d_signatureThreads > 0;
+        if (pipelined) {
+            pipeline.reset(d_protocol, d_checksumSeed, d_signatureCache);
+            addToPipeline(&pipeline, remoteFiles, localPath, queue, 0);
+        }
+
         bool bufferFlushed = true;
         while (true) {
 
@@ -734,25 +1338,55 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
             // already been sent which includes the data length.
             if (bufferFlushed && i < queue.size()) {
 
-                if (!remoteFiles[queue[i]]->isReadable()) {
-                    LOG_INFO(RSYNC_SKIP) << "Skip unreadable file '" << remoteFiles[queue[i]]->getPath() << "'" << LOG_END
+                bool sent = true;
+                bool retrying = phase == 1 || retried.count(queue[i]);
+                if (!remoteFiles.isReadable(queue[i])) {
+                    LOG_INFO(RSYNC_SKIP) << "Skip unreadable file '" << remoteFiles.getPath(queue[i]) << "'" << LOG_END
+                    if (d_incrementalRecursion) {
+                        segments.removePending(queue[i]);
+                    }
                 } else {
-                    std::string localFile = PathUtil::join(localPath.c_str(), remoteFiles[queue[i]]->getPath()); 
+                    std::string localFile = PathUtil::join(localPath.c_str(), remoteFiles.getPath(queue[i]).c_str()); 
                     const char *oldFile = 0;
-                    if (phase == 0 && PathUtil::exists(localFile.c_str())) {
+                    if (!retrying && PathUtil::exists(localFile.c_str())) {
                         oldFile = localFile.c_str();
                     }
 
-                    // Send the checksums for each file to be downloaded.
-                    sendChecksum(queue[i], oldFile);
+                    if (pipelined && !retrying) {
+                        // Don't wait long for the checksums, so that the file content from the server can still be
+                        // received in the meantime.
+                        int index;
+                        std::string signatures;
+                        sent = pipeline.take(&index, &signatures, 10);
+                        if (!sent) {
+                            d_stream->checkCancelFlag();
+                        } else if (signatures.empty()) {
+                            // The worker failed; try again here so that the error is reported.
+                            sendChecksum(segments.getIndex(queue[i]), oldFile);
+                        } else {
+                            assert(index == queue[i]);
+                            writeSignatures(segments.getIndex(index), signatures);
+                        }
+                    } else {
+                        // Send the checksums for each file to be downloaded.
+                        sendChecksum(segments.getIndex(queue[i]), oldFile);
+                    }
                 }
-                ++i;
 
-                if (i == queue.size()) {
-                    writeIndex(Stream::INDEX_DONE);
+                if (sent) {
+                    ++i;
+                    if (!d_incrementalRecursion && i == static_cast<int>(queue.size())) {
+                        writeIndex(Stream::INDEX_DONE);
+                    }
                 }
             }
 
+            // Under incremental recursion each segment is finished in turn once all its files have been received,
+            // and the last one finished ends the phase.
+            while (d_incrementalRecursion && bufferFlushed && segments.finishNext(listEnded)) {
+                writeIndex(Stream::INDEX_DONE);
+            }
+
             // Try to flush the write buffer.  This is 'all or none' operation, meaning either it completes with a
             // success or no bytes have been sent.
             bufferFlushed = d_stream->tryFlushWriteBuffer();
@@ -761,33 +1395,120 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
             if (d_stream->isDataAvailable()) {
                 int index = readIndex();
                 if (index == Stream::INDEX_DONE) {
-                    break;
+                    // The server confirms each segment finished under incremental recursion.
+                    if (!d_incrementalRecursion || ++acknowledged == segments.getCount()) {
+                        break;
+                    }
+                    continue;
+                }
+
+                if (d_incrementalRecursion && index == Stream::INDEX_FLIST_EOF) {
+                    listEnded = true;
+                    continue;
+                }
+
+                // The next segment of the file list holds the entries in one of the directories received so far.
+                if (d_incrementalRecursion && index <= Stream::INDEX_FLIST_OFFSET && !listEnded) {
+                    int directory = segments.getDirectory(Stream::INDEX_FLIST_OFFSET - index);
+                    if (directory < 0) {
+                        LOG_FATAL(RSYNC_INDEX) << "Received an out-of-bound directory index: "
+                                               << Stream::INDEX_FLIST_OFFSET - index << LOG_END;
+                    }
+                    int begin = remoteFiles.size();
+                    receiveSegment(&remoteFiles, directory);
+                    size_t first = queue.size();
+                    if (begin < remoteFiles.size()) {
+                        compareFileLists(localFiles, remoteFiles, begin, localPath, &queue);
+                    }
+                    segments.add(begin, remoteFiles.size(), 0, static_cast<int>(queue.size() - first));
+                    for (int j = begin; j < remoteFiles.size(); ++j) {
+                        if (remoteFiles.isDirectory(j)) {
+                            segments.addDirectory(j);
+                        }
+                    }
+                    if (pipelined) {
+                        addToPipeline(&pipeline, remoteFiles, localPath, queue, first);
+                    }
+                    continue;
                 }
 
-                if (index < 0 || index >= remoteFiles.size()) {
+                int position = segments.find(index);
+                if (position < 0) {
                     LOG_FATAL(RSYNC_INDEX) << "Received an out-of-bound index: " << index << LOG_END;
                 }
+                index = position;
 
-                if (phase == 1) {
-                    LOG_INFO(RSYNC_RETRY) << "Attempting to download '" << remoteFiles[index]->getPath() << "' again" << LOG_END
+                std::string remoteFile = remoteFiles.getPath(index);
+                if (retried.count(index) || phase == 1) {
+                    LOG_INFO(RSYNC_RETRY) << "Attempting to download '" << remoteFile << "' again" << LOG_END
                 }
 
                 std::string oldFile = localPath.c_str();
                 if (!singleFile ) {
-                    oldFile = PathUtil::join(localPath.c_str(), remoteFiles[index]->getPath());
+                    oldFile = PathUtil::join(localPath.c_str(), remoteFile.c_str());
                 }
 
-                // Use the PartialFileKeeper class to keep the partially downloaded file if an error occurs
-                PartialFileKeeper keeper(temporaryFile, oldFile.c_str(), remoteFiles[index]->getMode());
                 int64_t fileSize = 0;
                 int64_t currentLogicalBytes = *d_logicalBytes;
-                if (!receiveFile(remoteFiles[index]->getPath(), temporaryFile, oldFile.c_str(), &fileSize)) {
-                    *d_logicalBytes = currentLogicalBytes;
-                    retries.push_back(index);
+                bool failed = false;
+                if (d_inPlaceEnabled) {
+                    // The local file is overwritten directly, so there is nothing to rename.  If the download fails
+                    // the file will be downloaded again in full.
+                    if (!receiveFile(remoteFile.c_str(), oldFile.c_str(), oldFile.c_str(),
+                                     remoteFiles.getSize(index), &fileSize)) {
+                        *d_logicalBytes = currentLogicalBytes;
+                        failed = true;
+                    } else {
+                        PathUtil::setModifiedTime(oldFile.c_str(), remoteFiles.getTime(index));
+                        PathUtil::setMode(oldFile.c_str(), remoteFiles.getMode(index));
+                        ++updated;
+                        d_updatedFiles.push_back(oldFile);
+                    }
+                } else if (finalizing) {
+                    // Each file has a temporary file of its own, so that it can be renamed while the next one is
+                    // being received.
+                    File *newFile = new File();
+                    std::string newFilePath;
+                    if (!newFile->openAnonymous(PathUtil::getDirectory(oldFile.c_str()).c_str())) {
+                        std::stringstream path;
+                        path << temporaryFile << "." << index;
+                        newFilePath = path.str();
+                        newFile->open(newFilePath.c_str(), true, true);
+                    }
+                    TemporaryFileRemover remover(newFile, newFilePath);
+                    if (!newFile->isValid()) {
+                        LOG_FATAL(RSYNC_OPEN) << "Abort operation due to an open error" << LOG_END
+                    }
+                    if (!receiveFile(remoteFile.c_str(), newFile, oldFile.c_str(), false,
+                                     remoteFiles.getSize(index), &fileSize)) {
+                        *d_logicalBytes = currentLogicalBytes;
+                        failed = true;
+                    } else {
+                        finalizer.add(remover.release(), newFilePath, oldFile, remoteFiles.getTime(index),
+                                      remoteFiles.getMode(index));
+                        ++updated;
+                        d_updatedFiles.push_back(oldFile);
+                    }
                 } else {
-                    keeper.setModifiedTime(remoteFiles[index]->getTime());
-                    ++updated;
-                    d_updatedFiles.push_back(oldFile);
+                    // Use the PartialFileKeeper class to keep the partially downloaded file if an error occurs
+                    PartialFileKeeper keeper(temporaryFile, oldFile.c_str(), remoteFiles.getMode(index));
+                    if (!receiveFile(remoteFile.c_str(), temporaryFile, oldFile.c_str(),
+                                     remoteFiles.getSize(index), &fileSize)) {
+                        *d_logicalBytes = currentLogicalBytes;
+                        failed = true;
+                    } else {
+                        keeper.setModifiedTime(remoteFiles.getTime(index));
+                        ++updated;
+                        d_updatedFiles.push_back(oldFile);
+                    }
+                }
+
+                if (failed && !d_incrementalRecursion) {
+                    retries.push_back(index);
+                } else if (failed && retried.insert(index).second) {
+                    queue.push_back(index);
+                } else if (d_incrementalRecursion) {
+                    segments.removePending(index);
                 }
             } 
         }
@@ -796,6 +1517,18 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
         queue.swap(retries);
         ++phase;
     }
+
+    // Files that couldn't be renamed have not been updated.
+    std::vector<std::string> failures;
+    finalizer.wait(&failures);
+    for (unsigned int i = 0; i < failures.size(); ++i) {
+        std::vector<std::string>::iterator iter = std::find(d_updatedFiles.begin(), d_updatedFiles.end(),
+                                                            failures[i]);
+        if (iter != d_updatedFiles.end()) {
+            d_updatedFiles.erase(iter);
+            --updated;
+        }
+    }
     
     writeIndex(Stream::INDEX_DONE);
     writeIndex(Stream::INDEX_DONE);
@@ -804,35 +1537,40 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
     d_stream->flushWriteBuffer();
     d_stream->flush();
 
+    // The segments were received one directory at a time, so the list has yet to be put in order as a whole.
+    if (d_incrementalRecursion) {
+        remoteFiles.sort(1);
+    }
+
     // The following code removes local files that do not exist on the remote side.
     if (d_deletionEnabled) {
         for (size_t i = localFiles.size() - 1, index = remoteFiles.size() - 1; i > 0; --i) {
-            while (index > 0 && Entry::compareGlobally(localFiles[i], remoteFiles[index])) {
+            while (index > 0 && FileList::compare(localFiles, i, remoteFiles, index)) {
                 --index;
             }
-            if (index <= 0 || Entry::compareGlobally(remoteFiles[index], localFiles[i])) {
-                LOG_INFO(RSYN_DELETE) << "Deleted " << localFiles[i]->getPath() << LOG_END
-                std::string path = PathUtil::join(localTop, localFiles[i]->getPath());
+            if (index <= 0 || FileList::compare(remoteFiles, index, localFiles, i)) {
+                std::string localFile = localFiles.getPath(i);
+                LOG_INFO(RSYN_DELETE) << "Deleted " << localFile << LOG_END
+                std::string path = PathUtil::join(localTop, localFile.c_str());
                 PathUtil::remove(path.c_str());
-                d_deletedFiles.push_back(localFiles[i]->getPath());
+                d_deletedFiles.push_back(localFile);
             }
         }
     }
     
     // Update all the directory entries recursively, in a depth first order, to calculate
     // the total size of all the files under each direcotry.
-    std::vector<Entry*> directoryStack;
-    directoryStack.push_back(remoteFiles[0]);
+    std::vector<int> directoryStack;
+    directoryStack.push_back(0);
     for (int index = 1; index < remoteFiles.size(); ++index) {
-        entry = remoteFiles[index];
-        while (directoryStack.size() > 1 && !directoryStack.back()->contains(entry)) {
+        while (directoryStack.size() > 1 && !remoteFiles.contains(directoryStack.back(), index)) {
             directoryStack.pop_back();
         }
-        if (entry->isDirectory()) {
-            directoryStack.push_back(entry);
+        if (remoteFiles.isDirectory(index)) {
+            directoryStack.push_back(index);
         } else {
             for (int i = 0; i < directoryStack.size(); ++i) {
-                directoryStack[i]->addSize(entry->getSize());
+                remoteFiles.addSize(directoryStack[i], remoteFiles.getSize(index));
             }
         }
     }
@@ -840,9 +1578,8 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
     // Send the directory info out if needed.
     if (entryOut.isConnected()) {
         for (int index = 0; index < remoteFiles.size(); ++index) {
-            entry = remoteFiles[index];
-            entryOut(entry->getPath(), entry->isDirectory(), entry->getSize(), entry->getTime(),
-                     entry->isLink() ? entry->getSymlink() : 0);
+            entryOut(remoteFiles.getPath(index).c_str(), remoteFiles.isDirectory(index), remoteFiles.getSize(index),
+                     remoteFiles.getTime(index), remoteFiles.isLink(index) ? remoteFiles.getSymlink(index) : 0);
         }
     }
 
@@ -858,7 +1595,7 @@ int Client::download(const char *localTop, const char *remoteTop, const char *te
 // and then terminate the operation.
 bool Client::list(const char *path)
 {    
-    start(path, /*downloading=*/true, /*recursive=*/false, /*deleting=*/false);
+    start(path, /*downloading=*/true, /*recursive=*/false, /*deleting=*/false, &d_filter);
 
     std::string pathStr;
     bool isDir;
@@ -866,11 +1603,11 @@ bool Client::list(const char *path)
     uint32_t mode;
     std::string symlink;
     
+    EntryPool entryPool;
     std::vector<Entry*> remoteFiles;
-    Util::EntryListReleaser localFilesReleaser(&remoteFiles);
 
     while ((receiveEntry(&pathStr, &isDir, &size, &time, &mode, &symlink)) != 0) {
-        Entry *entry = new Entry(pathStr.c_str(), isDir, size, time, mode);
+        Entry *entry = entryPool.create(pathStr.c_str(), isDir, size, time, mode);
         if (entry->isLink()) {
             entry->setSymlink(symlink);
         }
@@ -903,11 +1640,12 @@ bool Client::list(const char *path)
 
 // Send an entry to the remote server.  It is the exact opposite of 'receiveEntry()' so refer to that method if you need
 // to understand the details.
-void Client::sendEntry(Entry *entry, bool isTop, bool noDirContent)
+void Client::sendEntry(const FileList &fileList, int index, bool isTop, bool noDirContent)
 {
     int xflags = XFLAGS_SAME_UID | XFLAGS_SAME_GID;
+    std::string path = fileList.getPath(index);
 
-    if (entry->getTime() == d_lastEntryTime) {
+    if (fileList.getTime(index) == d_lastEntryTime) {
         xflags |= XFLAGS_SAME_TIME;
     }
 
@@ -915,16 +1653,16 @@ void Client::sendEntry(Entry *entry, bool isTop, bool noDirContent)
         xflags |= XFLAGS_TOP_DIR;
     }
     
-    uint32_t fileMode = entry->getMode();
+    uint32_t fileMode = fileList.getMode(index);
 
     if (d_lastEntryMode == fileMode) {
         xflags |= XFLAGS_SAME_MODE;
     }
 
     int l1 = 0, l2;
-    int filePathLength = ::strlen(entry->getPath());
+    int filePathLength = static_cast<int>(path.size());
     
-    if (noDirContent && entry->isDirectory()) {
+    if (noDirContent && fileList.isDirectory(index)) {
         if (d_protocol >= 30) {
             xflags |= XFLAGS_NO_CONTENT_DIR;
         } else {
@@ -934,7 +1672,7 @@ void Client::sendEntry(Entry *entry, bool isTop, bool noDirContent)
     
     if (d_lastEntryPath.size()) {
         for (; l1 < static_cast<int>(d_lastEntryPath.size()) && l1 < 255; ++l1) {
-            if (entry->getPath()[l1] != d_lastEntryPath[l1]) {
+            if (path[l1] != d_lastEntryPath[l1]) {
                 break;
             }
         }
@@ -951,7 +1689,7 @@ void Client::sendEntry(Entry *entry, bool isTop, bool noDirContent)
         xflags |= XFLAGS_LONG_NAME;
     }
 
-    if (xflags == 0 && !entry->isDirectory()) {
+    if (xflags == 0 && !fileList.isDirectory(index)) {
         xflags |= XFLAGS_TOP_DIR;
     }
     if (xflags == 0 || (xflags & 0xFF00)) {
@@ -973,9 +1711,9 @@ void Client::sendEntry(Entry *entry, bool isTop, bool noDirContent)
     } else {
         d_stream->writeUInt8(l2);
     }
-    d_stream->write(entry->getPath() + l1, l2);
+    d_stream->write(path.c_str() + l1, l2);
 
-    int64_t size = entry->getSize();
+    int64_t size = fileList.getSize(index);
 
     if (d_protocol < 30) {
         d_stream->writeInt64(size);
@@ -985,9 +1723,9 @@ void Client::sendEntry(Entry *entry, bool isTop, bool noDirContent)
 
     if (!(xflags & XFLAGS_SAME_TIME)) {
         if (d_protocol < 30) {
-            d_stream->writeInt64(entry->getTime());
+            d_stream->writeInt64(fileList.getTime(index));
         } else {
-            d_stream->writeVariableInt64(entry->getTime(), 4);
+            d_stream->writeVariableInt64(fileList.getTime(index), 4);
         }
     }
 
@@ -995,18 +1733,105 @@ void Client::sendEntry(Entry *entry, bool isTop, bool noDirContent)
         d_stream->writeInt32(fileMode);
     }
 
-    if (entry->isLink()) {
+    if (fileList.isLink(index)) {
+        const char *symlink = fileList.getSymlink(index);
+        int symlinkLength = static_cast<int>(::strlen(symlink));
         if (d_protocol < 30) {
-            d_stream->writeInt32(entry->getSymlinkLength());
+            d_stream->writeInt32(symlinkLength);
         } else {
-            d_stream->writeVariableInt32(entry->getSymlinkLength());
+            d_stream->writeVariableInt32(symlinkLength);
         }
-        d_stream->write(entry->getSymlink(), entry->getSymlinkLength());
+        d_stream->write(symlink, symlinkLength);
     }
 
-    d_lastEntryPath = entry->getPath();
+    d_lastEntryPath = path;
     d_lastEntryMode = fileMode;
-    d_lastEntryTime = entry->getTime();
+    d_lastEntryTime = fileList.getTime(index);
+}
+
+int Client::findBlock(const char *data, int blockLength, uint32_t s, int md5Length)
+{
+    char digest[16];
+    bool digestCalculated = false;
+    for (int block = d_checksumIndex.find(s); block != -1; block = d_checksumIndex.next(block)) {
+        // Potential match.  Must compute the MD5 checksum to confirm.
+        if (!digestCalculated) {
+            digestCalculated = true;
+            ChecksumUtil::getMDDigest(d_protocol, data, blockLength, d_checksumSeed, digest);
+        }
+        if (::memcmp(digest, d_checksums[block].d_sum2, md5Length) == 0) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+void Client::sendLiteral(const char *data, int size, int64_t *physicalBytes, int64_t *logicalBytes)
+{
+    if (size == 0) {
+        return;
+    }
+    int64_t bytes;
+    if (d_tokenCompressor) {
+        bytes = d_tokenCompressor->sendToken(-2, data, size, 0, 0);
+    } else {
+        d_stream->writeInt32(size);
+        d_stream->write(data, size);
+        bytes = size + 4;
+    }
+    *physicalBytes += bytes;
+    *d_physicalBytes += bytes;
+    *logicalBytes += size;
+    *d_logicalBytes += size;
+}
+
+void Client::sendMatch(int block, const char *data, int length, int64_t *physicalBytes, int64_t *logicalBytes)
+{
+    int64_t bytes;
+    if (d_tokenCompressor) {
+        bytes = d_tokenCompressor->sendToken(block, 0, 0, data, length);
+    } else {
+        d_stream->writeInt32(-(block + 1));
+        bytes = 4;
+    }
+    *physicalBytes += bytes;
+    *d_physicalBytes += bytes;
+    *logicalBytes += length;
+    *d_logicalBytes += length;
+}
+
+void Client::sendEnd(int64_t *physicalBytes)
+{
+    if (d_tokenCompressor) {
+        int64_t bytes = d_tokenCompressor->sendToken(-1, 0, 0, 0, 0);
+        *physicalBytes += bytes;
+        *d_physicalBytes += bytes;
+    } else {
+        d_stream->writeInt32(0);
+    }
+}
+
+int32_t Client::receiveToken(const char **data, int64_t *physicalBytes)
+{
+    int64_t bytes = 0;
+    int32_t token;
+    if (d_tokenCompressor) {
+        token = d_tokenCompressor->receiveToken(data, &bytes);
+    } else {
+        token = d_stream->readInt32();
+        if (token > 0) {
+            // A positive token is the length of the literal data that follows
+            resizeChunk(token);
+            d_stream->read(d_chunk, token);
+            *data = d_chunk;
+            bytes = 4 + token;
+        } else if (token < 0) {
+            bytes = 4;
+        }
+    }
+    *physicalBytes += bytes;
+    *d_physicalBytes += bytes;
+    return token;
 }
 
 // Send a file to the remote server
@@ -1084,13 +1909,8 @@ bool Client::sendFile(int index, const char *remotePath, const char *localPath)
             int bytes = f.read(d_chunk, d_chunkSize);
             size += bytes;
             if (bytes) {
-                d_stream->writeInt32(bytes);
-                d_stream->write(d_chunk, bytes);
+                sendLiteral(d_chunk, bytes, &physicalBytes, &logicalBytes);
                 Util::md_update(d_protocol, &md_context, d_chunk, bytes);
-                physicalBytes += bytes + 4;
-                *d_physicalBytes += bytes + 4;
-                logicalBytes += bytes;
-                *d_logicalBytes += bytes;
             } else {
                 break;
             }
@@ -1105,165 +1925,192 @@ bool Client::sendFile(int index, const char *remotePath, const char *localPath)
             d_checksums = new Checksum[count];
         }
 
-        // Allocate a new chunk if necessary.  The chunk is used as the buffer to read the file.
-        int chunkSize = blockLength * 2;
-        resizeChunk(chunkSize);
-
-        // Prepare the hash table that use the rolling checksum as the key.
-        for (int i = 0; i < NumberOfHashBuckets; ++i) {
-            d_hashBuckets[i] = -1;
-        }
+        // Prepare the index that uses the rolling checksum as the key.
+        d_checksumIndex.reset(count);
         for (int i = 0; i < count; ++i) {
             d_checksums[i].d_sum1 = d_stream->readInt32();
             d_stream->read(d_checksums[i].d_sum2, md5Length);
-            int bucket = getChecksumHash(d_checksums[i].d_sum1);
-            d_checksums[i].d_next = d_hashBuckets[bucket];
-            d_hashBuckets[bucket] = i;
-        }
-
-        // Read the first data into the chunk
-        int n = f.read(d_chunk, chunkSize);
-        size += n;
-        Util::md_update(d_protocol, &md_context, d_chunk, n);
-        int i = blockLength;
-        if (n < blockLength) {
-            // Not enough data to perform the rolling checksum.  Just send the raw data and done.
-            if (n > 0) {
-                d_stream->writeInt32(n);
-                d_stream->write(d_chunk, n);
-                physicalBytes += n + 4;
-                *d_physicalBytes += n + 4;
-                logicalBytes += n;
-                *d_logicalBytes += n;
-            }
-        } else {
-            // 's' is the rolling checksum at the core of rdiff.  's1' and 's2' are just its high
-            // and low 16 bits.
-            uint32_t s, s1, s2;
-            getRollingChecksum(d_chunk, blockLength, s1, s2);
-
-            // 'n' is the number of valid bytes in d_chunk; 'i' points to the next byte to be
-            // counted in 's1' and 's2'.  All bytes before 'i' (and after i - blockLength if 
-            // i > blockLength) should have been counted.
-            while (true) {
-                s = (s1 & 0xffff) | (s2 << 16);
-                int bucket = d_hashBuckets[getChecksumHash(s)];
-                bool matched = false;
-                char digest[16];
-                bool digestCalculated = false;
-                while (bucket != -1) {
-                    if (d_checksums[bucket].d_sum1 == s) {
-                        // Potential match.  Must compute the MD5 checksum to confirm.
-                        if (!digestCalculated) {
-                            digestCalculated = true;
-                            getMDDigest(d_protocol, d_chunk + i - blockLength, blockLength, d_checksumSeed, digest);
-                        }
-                        if (::memcmp(digest, d_checksums[bucket].d_sum2, md5Length) == 0) {
-                            matched = true;
+            d_checksumIndex.add(i, d_checksums[i].d_sum1);
+        }
+
+        MappedFile mappedFile;
+        if (d_memoryMappingEnabled && mappedFile.map(localPath)) {
+            // The same algorithm as the one below, except that the window slides over the mapped file, so there is
+            // no need to move data around and literal data is sent directly from the mapping.  'window' is the start
+            // of the current block, 'literal' is the start of the data not yet sent, and 'hashed' is where the
+            // digest of the whole file has been updated to.
+            const char *data = mappedFile.getData();
+            int64_t fileSize = mappedFile.getSize();
+            int64_t window = 0;
+            int64_t literal = 0;
+            int64_t hashed = 0;
+            size = fileSize;
+            if (fileSize < blockLength) {
+                sendLiteral(data, static_cast<int>(fileSize), &physicalBytes, &logicalBytes);
+            } else {
+                uint32_t s, s1, s2;
+                ChecksumUtil::getRollingChecksum(data, blockLength, &s1, &s2);
+                while (true) {
+                    s = (s1 & 0xffff) | (s2 << 16);
+                    int block = findBlock(data + window, blockLength, s, md5Length);
+                    if (block != -1) {
+                        sendLiteral(data + literal, static_cast<int>(window - literal), &physicalBytes, &logicalBytes);
+                        sendMatch(block, data + window, blockLength, &physicalBytes, &logicalBytes);
+                        window += blockLength;
+                        literal = window;
+                        Util::md_update(d_protocol, &md_context, data + hashed, static_cast<int>(literal - hashed));
+                        hashed = literal;
+                        if (fileSize - window < blockLength) {
                             break;
                         }
+                        ChecksumUtil::getRollingChecksum(data + window, blockLength, &s1, &s2);
+                        continue;
                     }
-                    bucket = d_checksums[bucket].d_next;
+
+                    // Don't let unmatched data pile up for more than a block, just like the buffer below.
+                    if (window - literal >= blockLength) {
+                        sendLiteral(data + literal, static_cast<int>(window - literal), &physicalBytes, &logicalBytes);
+                        literal = window;
+                        Util::md_update(d_protocol, &md_context, data + hashed, static_cast<int>(literal - hashed));
+                        hashed = literal;
+                    }
+
+                    if (window + blockLength >= fileSize) {
+                        break;
+                    }
+
+                    // Update the rolling checksum by one byte.
+                    int32_t out = static_cast<signed char>(data[window]);
+                    s1 -= out;
+                    s2 -= blockLength * out;
+                    s1 += static_cast<signed char>(data[window + blockLength]);
+                    s2 += s1;
+                    ++window;
                 }
-                if (matched) {
-                    if (i > blockLength) {
-                        // The data in the buffer is longer than 'blockLength'.  Send the first 'blockLength - i' bytes
-                        d_stream->writeInt32(i - blockLength);
-                        d_stream->write(d_chunk, i - blockLength);
-                        physicalBytes += i - blockLength + 4;
-                        *d_physicalBytes += i - blockLength + 4;
-                        logicalBytes += i - blockLength;
-                        *d_logicalBytes += i - blockLength;
+
+                // Whatever is left may still match the last block of the remote file.
+                int n = static_cast<int>(fileSize - literal);
+                bool matched = false;
+                if (n == remainder) {
+                    ChecksumUtil::getRollingChecksum(data + literal, remainder, &s1, &s2);
+                    s = (s1 & 0xffff) | (s2 << 16);
+                    if (s == d_checksums[count - 1].d_sum1) {
+                        char digest[16];
+                        ChecksumUtil::getMDDigest(d_protocol, data + literal, n, d_checksumSeed, digest);
+                        if (::memcmp(digest, d_checksums[count - 1].d_sum2, md5Length) == 0) {
+                            sendMatch(count - 1, data + literal, n, &physicalBytes, &logicalBytes);
+                            matched = true;
+                        }
                     }
-                    // Instead of sending the plain chunk data, just send the index as a negative token.  This is the
-                    // heart of the rsync algorithm
-                    d_stream->writeInt32(-(bucket + 1));
-                    physicalBytes += 4;
-                    *d_physicalBytes += 4;
-                    logicalBytes += blockLength;
-                    *d_logicalBytes += blockLength;
-                    ::memmove(d_chunk, d_chunk + i, n - i);
-                    n -= i;
-                    i = 0;
-                } else if (i >= chunkSize) {
-                    // We are at the end of the buffer.  Will send out the first 'i - blockLength' bytes and hope
-                    // a match will be found on the remaining 'blockLength' bytes and more.
-                    assert(n == chunkSize);
-                    int bytes = i - blockLength;
-                    d_stream->writeInt32(bytes);
-                    d_stream->write(d_chunk, bytes);
-                    physicalBytes += 4 + bytes;
-                    *d_physicalBytes += 4 + bytes;
-                    logicalBytes += bytes;
-                    *d_logicalBytes += bytes;
-                    ::memmove(d_chunk, d_chunk + bytes, n - bytes);
-                    n -= bytes;
-                    i -= bytes;
                 }
+                if (!matched) {
+                    sendLiteral(data + literal, n, &physicalBytes, &logicalBytes);
+                }
+            }
+            Util::md_update(d_protocol, &md_context, data + hashed, static_cast<int>(fileSize - hashed));
+        } else {
+            // Allocate a new chunk if necessary.  The chunk is used as the buffer to read the file.
+            int chunkSize = blockLength * 2;
+            resizeChunk(chunkSize);
+
+            // Read the first data into the chunk
+            int n = f.read(d_chunk, chunkSize);
+            size += n;
+            Util::md_update(d_protocol, &md_context, d_chunk, n);
+            int i = blockLength;
+            if (n < blockLength) {
+                // Not enough data to perform the rolling checksum.  Just send the raw data and done.
+                sendLiteral(d_chunk, n, &physicalBytes, &logicalBytes);
+            } else {
+                // 's' is the rolling checksum at the core of rdiff.  's1' and 's2' are just its high
+                // and low 16 bits.
+                uint32_t s, s1, s2;
+                ChecksumUtil::getRollingChecksum(d_chunk, blockLength, &s1, &s2);
+
+                // 'n' is the number of valid bytes in d_chunk; 'i' points to the next byte to be
+                // counted in 's1' and 's2'.  All bytes before 'i' (and after i - blockLength if 
+                // i > blockLength) should have been counted.
+                while (true) {
+                    s = (s1 & 0xffff) | (s2 << 16);
+                    int bucket = findBlock(d_chunk + i - blockLength, blockLength, s, md5Length);
+                    if (bucket != -1) {
+                        // The data in the buffer may be longer than 'blockLength'.  Send the first 'i - blockLength'
+                        // bytes
+                        sendLiteral(d_chunk, i - blockLength, &physicalBytes, &logicalBytes);
+
+                        // Instead of sending the plain chunk data, just send the index as a negative token.  This is the
+                        // heart of the rsync algorithm
+                        sendMatch(bucket, d_chunk + i - blockLength, blockLength, &physicalBytes, &logicalBytes);
+                        ::memmove(d_chunk, d_chunk + i, n - i);
+                        n -= i;
+                        i = 0;
+                    } else if (i >= chunkSize) {
+                        // We are at the end of the buffer.  Will send out the first 'i - blockLength' bytes and hope
+                        // a match will be found on the remaining 'blockLength' bytes and more.
+                        assert(n == chunkSize);
+                        int bytes = i - blockLength;
+                        sendLiteral(d_chunk, bytes, &physicalBytes, &logicalBytes);
+                        ::memmove(d_chunk, d_chunk + bytes, n - bytes);
+                        n -= bytes;
+                        i -= bytes;
+                    }
 
-                if (i >= n || (i == 0 && n < blockLength)) {
-                    // Read in more bytes.
-                    int bytes = f.read(d_chunk + n, chunkSize - n);
-                    size += bytes;
-                    Util::md_update(d_protocol, &md_context, d_chunk + n, bytes);
-                    n += bytes;
                     if (i >= n || (i == 0 && n < blockLength)) {
-                        // No more bytes from the file.  Must decide what to do with the bytes in the buffer.
-                        if (n == 0) {
-                            break;
-                        }
-                        if (n == remainder) {
-                            // Special case, the remaining bytes in the buffer is of the same length as the
-                            // last chunk of the remote file.  Calculate the checksum to find out if they are
-                            // actually identical.
-                            getRollingChecksum(d_chunk, remainder, s1, s2);
-                            s = (s1 & 0xffff) | (s2 << 16);
-                            if (s == d_checksums[count - 1].d_sum1) {
-                                char digest[16];
-                                getMDDigest(d_protocol, d_chunk, n, d_checksumSeed, digest);
-                                if (::memcmp(digest, d_checksums[count - 1].d_sum2, md5Length) == 0) {
-                                    d_stream->writeInt32(-count);
-                                    physicalBytes += 4;
-                                    *d_physicalBytes += 4;
-                                    logicalBytes += n;
-                                    *d_logicalBytes += n;
-                                    break;
+                        // Read in more bytes.
+                        int bytes = f.read(d_chunk + n, chunkSize - n);
+                        size += bytes;
+                        Util::md_update(d_protocol, &md_context, d_chunk + n, bytes);
+                        n += bytes;
+                        if (i >= n || (i == 0 && n < blockLength)) {
+                            // No more bytes from the file.  Must decide what to do with the bytes in the buffer.
+                            if (n == 0) {
+                                break;
+                            }
+                            if (n == remainder) {
+                                // Special case, the remaining bytes in the buffer is of the same length as the
+                                // last chunk of the remote file.  Calculate the checksum to find out if they are
+                                // actually identical.
+                                ChecksumUtil::getRollingChecksum(d_chunk, remainder, &s1, &s2);
+                                s = (s1 & 0xffff) | (s2 << 16);
+                                if (s == d_checksums[count - 1].d_sum1) {
+                                    char digest[16];
+                                    ChecksumUtil::getMDDigest(d_protocol, d_chunk, n, d_checksumSeed, digest);
+                                    if (::memcmp(digest, d_checksums[count - 1].d_sum2, md5Length) == 0) {
+                                        sendMatch(count - 1, d_chunk, n, &physicalBytes, &logicalBytes);
+                                        break;
+                                    }
                                 }
                             }
+
+                            // Send whatever in the buffer as it is.
+                            sendLiteral(d_chunk, n, &physicalBytes, &logicalBytes);
+                            break;
                         }
+                    }
 
-                        // Send whatever in the buffer as it is.
-                        d_stream->writeInt32(n);
-                        d_stream->write(d_chunk, n);
-                        physicalBytes += 4 + n;
-                        *d_physicalBytes += 4 + n;
-                        logicalBytes += n;
-                        *d_logicalBytes += n;
-                        break;
+                    if (i == 0) {
+                        ChecksumUtil::getRollingChecksum(d_chunk, blockLength, &s1, &s2);
+                        i = blockLength;
+                        assert(i <= n);
+                        continue;
                     }
-                }
 
-                if (i == 0) {
-                    getRollingChecksum(d_chunk, blockLength, s1, s2);
-                    i = blockLength;
-                    assert(i <= n);
-                    continue;
+                    // Update the rolling checkum by one byte.  Bytes are signed chars as in 'ChecksumUtil'.
+                    assert(i < n);
+                    assert(i >= blockLength);
+                    int32_t out = static_cast<signed char>(d_chunk[i - blockLength]);
+                    s1 -= out;
+                    s2 -= blockLength * out;
+                    s1 += static_cast<signed char>(d_chunk[i]);
+                    s2 += s1;
+                    ++i;
                 }
-
-                // Update the rolling checkum by one byte.
-                assert(i < n);
-                assert(i >= blockLength);
-                s1 -= d_chunk[i - blockLength];
-                s2 -= blockLength * d_chunk[i - blockLength];
-                s1 += d_chunk[i];
-                s2 += s1;
-                ++i;
             }
         }
     }
 
     // Send '0' to indicate that no more chunk will be sent.
-    d_stream->writeInt32(0);
+    sendEnd(&physicalBytes);
 
     // Send the MD5 checksum of the whole file.
     char localDigest[16];
@@ -1282,9 +2129,7 @@ bool Client::sendFile(int index, const char *remotePath, const char *localPath)
 // For directories, 'localTop' and 'remoteTop' must end with '/'.
 int Client::upload(const char *localTop, const char *remoteTop, const std::set<std::string> *includeFiles)
 {
-    std::vector<Entry*> localFiles, directories;
-    Util::EntryListReleaser localFileReleaser(&localFiles);
-    Util::EntryListReleaser directoriesReleaser(&directories);
+    FileList localFiles;
 
     std::string localPath = localTop;
     while (localPath[localPath.size() - 1] == '/') {
@@ -1295,56 +2140,52 @@ int Client::upload(const char *localTop, const char *remoteTop, const std::set<s
         statusOut((std::string("Indexing local directory ") + localTop).c_str());
     }
 
+    // Whether the local directory is to be listed while the file list is being sent.
+    bool isStreaming = false;
+
     if (PathUtil::isDirectory(localPath.c_str())) {
 
+        // The local entries are only kept here until they have been added to 'localFiles'.
+        EntryPool entryPool;
+
         // This top entry is required to enable remote deletion under the top directory.
-        localFiles.push_back(new Entry("./", true, 0, ::time(0),
-                             Entry::IS_DIR | Entry::IS_ALL_READABLE | Entry::IS_WRITABLE | Entry::IS_EXECUTABLE));
+        localFiles.add("./", true, 0, ::time(0),
+                       Entry::IS_DIR | Entry::IS_ALL_READABLE | Entry::IS_WRITABLE | Entry::IS_EXECUTABLE);
         
         if (includeFiles) {
             // We must include parent directories of every file.
             std::set<std::string> entries;
-            for (std::set<std::string>::const_iterator iter = includeFiles->begin();
-                 iter != includeFiles->end(); ++iter) {
-                const char *path = iter->c_str();
-                if (*path == '/') {
-                    ++path;
-                }
-
-                entries.insert(path);
-                for (const char *p = path; *p; ++p) {
-                    if (*p == '/' && *(p + 1) != 0) {
-                        std::string dir = std::string(path, p);
-                        entries.insert(dir);
-                    }
-                }
-            }
+            addIncludedEntries(*includeFiles, &entries, 0);
 
             // Now create entries.
             for (std::set<std::string>::const_iterator iter = entries.begin();
                 iter != entries.end(); ++iter) {
-                Entry *entry = PathUtil::createEntry(localPath.c_str(), iter->c_str());
-                if (entry) {
-                    entry->normalizePath();
-                    localFiles.push_back(entry);
+                Entry *entry = PathUtil::createEntry(localPath.c_str(), iter->c_str(), &entryPool);
+                if (entry && !d_filter.isPathExcluded(iter->c_str(), entry->isDirectory())) {
+                    localFiles.add(*entry);
                 }
             }
 
-            std::sort(localFiles.begin() + 1, localFiles.end(), Entry::compareGlobally);
+            localFiles.sort(1);
+
+        } else if (d_streamingUploadEnabled) {
+
+            // 'localFiles' will be populated once the session has started.
+            isStreaming = true;
 
         } else {
 
             // Populate 'localFiles' by iterating through the local directory recursively.
-            PathUtil::listDirectory(localPath.c_str(), "", &localFiles, &directories, d_protocol > 29);
-
-            while (directories.size()) {
-                Entry *entry = directories.back();
-                directories.pop_back();
-                localFiles.push_back(entry);
-                PathUtil::listDirectory(localPath.c_str(), entry->getPath(), &localFiles, &directories,
-                                        d_protocol > 29);
+            std::vector<Entry*> entries;
+            DirectoryScanner scanner(d_scannerThreads, d_cancelFlag);
+            scanner.setInodeOrderEnabled(d_inodeOrderEnabled);
+            scanner.setFilter(&d_filter);
+            if (!scanner.scan(localPath.c_str(), d_protocol > 29, &entries, &entryPool)) {
                 d_stream->checkCancelFlag();
             }
+            for (unsigned int i = 0; i < entries.size(); ++i) {
+                localFiles.add(*entries[i]);
+            }
         }
     } else {
         // 'localPath' points to a single file.
@@ -1354,7 +2195,8 @@ int Client::upload(const char *localTop, const char *remoteTop, const std::set<s
         if (!entry) {
             return 0;
         }
-        localFiles.push_back(entry);
+        localFiles.add(*entry);
+        delete entry;
     }
    
  
@@ -1363,11 +2205,31 @@ int Client::upload(const char *localTop, const char *remoteTop, const std::set<s
     *d_logicalBytes = 0;
     *d_skippedBytes = 0;
     
-    start(remoteTop, /*downloading=*/false, /*isRecursive=*/true, /*isDeleting=*/d_deletionEnabled);
+    start(remoteTop, /*downloading=*/false, /*isRecursive=*/true, /*isDeleting=*/d_deletionEnabled, &d_filter);
     
-    for (unsigned int i = 0; i < localFiles.size(); ++i) {
-        sendEntry(localFiles[i], i == 0);
-        *d_totalBytes += localFiles[i]->getSize();
+    for (int i = 0; i < localFiles.size(); ++i) {
+        sendEntry(localFiles, i, i == 0);
+        *d_totalBytes += localFiles.getSize(i);
+    }
+
+    if (isStreaming) {
+        // Each entry is sent as soon as it is listed.  The scanner lists entries in the order the file list must be
+        // in, so they can be sent without being sorted.
+        EntryPool entryPool;
+        DirectoryScanner scanner(d_scannerThreads, d_cancelFlag);
+        scanner.setInodeOrderEnabled(d_inodeOrderEnabled);
+        scanner.setFilter(&d_filter);
+        scanner.start(localPath.c_str(), d_protocol > 29, &entryPool);
+        std::vector<Entry*> entries;
+        while (scanner.next(&entries)) {
+            for (unsigned int i = 0; i < entries.size(); ++i) {
+                int index = localFiles.add(*entries[i]);
+                sendEntry(localFiles, index, false);
+                *d_totalBytes += localFiles.getSize(index);
+            }
+            entries.clear();
+        }
+        d_stream->checkCancelFlag();
     }
     
     if (statusOut.isConnected()) {
@@ -1393,7 +2255,7 @@ int Client::upload(const char *localTop, const char *remoteTop, const std::set<s
 
             // The remote generator will send the indices in order; so if there is a gap then it menas some files are not needed.
             for (++lastIndex; lastIndex < localFiles.size(); ++lastIndex) {
-                *d_skippedBytes += localFiles[lastIndex]->getSize();
+                *d_skippedBytes += localFiles.getSize(lastIndex);
             }
 
             ++phase;
@@ -1404,18 +2266,19 @@ int Client::upload(const char *localTop, const char *remoteTop, const std::set<s
             LOG_FATAL(RSYNC_INDEX) << "Received an out-of-bound index: " << index << LOG_END
         }
 
+        std::string path = localFiles.getPath(index);
         if (phase == 1) {
-            LOG_INFO(RSYNC_RETRY) << "Attempting to upload '" << localFiles[index]->getPath() << "' again" << LOG_END
-            *d_logicalBytes -= localFiles[index]->getSize();
+            LOG_INFO(RSYNC_RETRY) << "Attempting to upload '" << path << "' again" << LOG_END
+            *d_logicalBytes -= localFiles.getSize(index);
         }
         
         for (int i = lastIndex + 1; i < index; ++i) {
-            *d_skippedBytes += localFiles[i]->getSize();
+            *d_skippedBytes += localFiles.getSize(i);
         }
         lastIndex = index;
         
-        std::string localFile = PathUtil::join(localPath.c_str(), localFiles[index]->getPath());
-        if (sendFile(index, localFiles[index]->getPath(), localFile.c_str())) {
+        std::string localFile = PathUtil::join(localPath.c_str(), path.c_str());
+        if (sendFile(index, path.c_str(), localFile.c_str())) {
             ++updated;
             d_updatedFiles.push_back(localFile);
         }        
@@ -1450,117 +2313,151 @@ int Client::upload(const char *localTop, const char *remoteTop, const std::set<s
 // patterns to exclude everything but the file to be deleted.  
 void Client::remove(const char *remoteFile)
 {
-    std::string remotePath = remoteFile;
-    if (remotePath[remotePath.size() - 1] == '/') {
-        remotePath = remotePath.substr(0, remotePath.size() - 1);
-    }
-    std::string remoteDir = PathUtil::getDirectory(remotePath.c_str());
-
-    start(remoteDir.c_str(), /*downloading=*/false, /*recursive=*/false, /*isDeleting=*/true);
-
-    std::string includeFilter("+ /");
-    includeFilter += PathUtil::getBase(remotePath.c_str());
-    d_stream->writeInt32(includeFilter.size());
-    d_stream->write(includeFilter.c_str(), includeFilter.size());
-
-    includeFilter += "/";
-    d_stream->writeInt32(includeFilter.size());
-    d_stream->write(includeFilter.c_str(), includeFilter.size());
-
-    includeFilter += "**";
-    d_stream->writeInt32(includeFilter.size());
-    d_stream->write(includeFilter.c_str(), includeFilter.size());
-
-    std::string excludeFilter("- *");
-    d_stream->writeInt32(excludeFilter.size());
-    d_stream->write(excludeFilter.c_str(), excludeFilter.size());
+    remove(std::vector<std::string>(1, remoteFile));
+}
 
-    d_stream->writeInt32(0); 
-    d_stream->flushWriteBuffer();
+// The names to be removed from the same directory are all included by the filter rules of one session.
+void Client::remove(const std::vector<std::string> &remoteFiles)
+{
+    std::set<std::string> paths;
+    for (unsigned int i = 0; i < remoteFiles.size(); ++i) {
+        std::string remotePath = remoteFiles[i];
+        while (remotePath.size() && remotePath[remotePath.size() - 1] == '/') {
+            remotePath.erase(remotePath.size() - 1);
+        }
+        if (remotePath.size()) {
+            paths.insert(remotePath);
+        }
+    }
 
-    Entry entry("./", true, 0, ::time(0), 0);
-    sendEntry(&entry, true);
-    d_stream->writeUInt8(0); // no more file to send; end of list
-    if (d_protocol < 30) {
-        d_stream->writeInt32(0); 
+    std::map<std::string, std::vector<std::string> > names;   // the names to be removed from each directory
+    for (std::set<std::string>::const_iterator iter = paths.begin(); iter != paths.end(); ++iter) {
+        bool isUnderRemovedPath = false;
+        for (size_t slash = iter->find('/'); slash != std::string::npos && !isUnderRemovedPath;
+             slash = iter->find('/', slash + 1)) {
+            isUnderRemovedPath = paths.count(iter->substr(0, slash)) > 0;
+        }
+        if (!isUnderRemovedPath) {
+            names[PathUtil::getDirectory(iter->c_str())].push_back(PathUtil::getBase(iter->c_str()));
+        }
     }
-    d_stream->flushWriteBuffer();
 
-    // Send INDEX_DONE 4 times to terminate the transmission properly;
-    for (int i = 0; i < 4; ++i) {
-        int index = readIndex();
-        writeIndex(index);
-        if (index != Stream::INDEX_DONE) {
-            uint16_t iflags = d_stream->readUInt16();
-            d_stream->writeUInt16(iflags);
+    for (std::map<std::string, std::vector<std::string> >::const_iterator iter = names.begin();
+         iter != names.end(); ++iter) {
+        // The filter rules set on the client don't apply here.
+        Filter filter;
+        for (unsigned int i = 0; i < iter->second.size(); ++i) {
+            const char *name = iter->second[i].c_str();
+            filter.add(("+ /" + Filter::escape(name)).c_str());
+            filter.add(("+ /" + Filter::escape(name) + "/").c_str());
+            filter.add(("+ /" + Filter::escape(name, true) + "/**").c_str());
         }
-        d_stream->flushWriteBuffer();
+        filter.add("- *");
+
+        start(iter->first.c_str(), /*downloading=*/false, /*recursive=*/false, /*isDeleting=*/true, &filter);
+
+        FileList fileList;
+        fileList.add("./", true, 0, ::time(0), 0);
+        sendEntry(fileList, 0, true);
+        finishFileList();
     }
-    return;
 }
 
 // To create a new directory, send a file entry list that contains only that directory.
 void Client::mkdir(const char *path)
 {
-    std::string remotePath = path;
-    while (remotePath.back() == '/') {
-        remotePath.erase(remotePath.end() - 1);
+    create(std::vector<std::string>(1, path), std::vector<std::pair<std::string, std::string> >());
+}
+
+// Create a symbolic link on the remote side
+void Client::link(const char *remotePath, const char *link)
+{
+    create(std::vector<std::string>(),
+           std::vector<std::pair<std::string, std::string> >(1, std::make_pair(remotePath, link)));
+}
+
+// Everything to be created in the same directory is sent in one file list, along with everything under the new
+// directories there, so that each entry in the list is either at the top or under a directory in the list.
+void Client::create(const std::vector<std::string> &remotePaths,
+                    const std::vector<std::pair<std::string, std::string> > &links)
+{
+    std::set<std::string> directories;
+    for (unsigned int i = 0; i < remotePaths.size(); ++i) {
+        std::string remotePath = remotePaths[i];
+        while (remotePath.size() && remotePath[remotePath.size() - 1] == '/') {
+            remotePath.erase(remotePath.size() - 1);
+        }
+        if (remotePath.size()) {
+            directories.insert(remotePath);
+        }
     }
-    std::string remoteDir = PathUtil::getDirectory(remotePath.c_str());
 
-    if (remoteDir.size() == 0) {
-        remoteDir = "~";
+    // The entries to be created in each directory, as their paths and the indices of their links in 'links', or -1
+    // for directories.
+    std::map<std::string, std::vector<std::pair<std::string, int> > > entries;
+    for (std::set<std::string>::const_iterator iter = directories.begin(); iter != directories.end(); ++iter) {
+        entries[getCreationDirectory(*iter, directories)].push_back(std::make_pair(*iter, -1));
+    }
+    for (unsigned int i = 0; i < links.size(); ++i) {
+        const std::string &remotePath = links[i].first;
+        entries[getCreationDirectory(remotePath, directories)].push_back(std::make_pair(remotePath, i));
     }
-    
-    start(remoteDir.c_str(), /*downloading=*/false, /*recursive=*/false, /*isDeleting=*/false);
 
-    Entry entry((PathUtil::getBase(remotePath.c_str()) + "/").c_str(), true, 0, ::time(0), Entry::IS_ALL_READABLE | Entry::IS_WRITABLE | Entry::IS_EXECUTABLE);
-    sendEntry(&entry, true);
+    for (std::map<std::string, std::vector<std::pair<std::string, int> > >::const_iterator iter = entries.begin();
+         iter != entries.end(); ++iter) {
+        std::string remoteDir = iter->first.size() ? iter->first : "~";
 
-    d_stream->writeUInt8(0); // no more file to send; end of list
-    if (d_protocol < 30) {
-        d_stream->writeInt32(0); 
-    }
-    d_stream->flushWriteBuffer();
+        FileList fileList;
+        for (unsigned int i = 0; i < iter->second.size(); ++i) {
+            std::string path = iter->second[i].first.substr(iter->first.size());
+            while (path.size() && path[0] == '/') {
+                path.erase(0, 1);
+            }
+            int link = iter->second[i].second;
+            if (link < 0) {
+                fileList.add(path.c_str(), true, 0, ::time(0),
+                             Entry::IS_ALL_READABLE | Entry::IS_WRITABLE | Entry::IS_EXECUTABLE);
+            } else {
+                fileList.add(path.c_str(), false, 0, ::time(0),
+                             Entry::IS_FILE | Entry::IS_LINK | Entry::IS_ALL_READABLE | Entry::IS_WRITABLE,
+                             links[link].second.c_str());
+            }
+        }
+        fileList.sort(0);
 
-    // Send INDEX_DONE 4 times to terminate the transmission properly;
-    for (int i = 0; i < 4; ++i) {
-        int index = readIndex();
-        writeIndex(index);
-        if (index != Stream::INDEX_DONE) {
-            uint16_t iflags = d_stream->readUInt16();
-            d_stream->writeUInt16(iflags);
+        start(remoteDir.c_str(), /*downloading=*/false, /*recursive=*/false, /*isDeleting=*/false, 0);
+
+        // Only the new directories in 'remoteDir' itself are at the top.
+        for (int i = 0; i < fileList.size(); ++i) {
+            std::string path = fileList.getPath(i);
+            sendEntry(fileList, i, fileList.isDirectory(i) && path.find('/') + 1 == path.size());
         }
-        d_stream->flushWriteBuffer();
+        finishFileList();
     }
-    return;
 }
 
-// Create a symbolic link on the remote side
-void Client::link(const char *remotePath, const char *link)
+void Client::finishFileList()
 {
-    std::string remoteDir = PathUtil::getDirectory(remotePath);
-
-    start(remoteDir.c_str(), /*downloading=*/false, /*recursive=*/false, /*isDeleting=*/false);
-
-    Entry entry(PathUtil::getBase(remotePath).c_str(), false, 0, ::time(0),
-        Entry::IS_FILE | Entry::IS_LINK | Entry::IS_ALL_READABLE | Entry::IS_WRITABLE);
-    entry.setSymlink(link);
-    sendEntry(&entry, false);
-
     d_stream->writeUInt8(0); // no more file to send; end of list
     if (d_protocol < 30) {
         d_stream->writeInt32(0); 
     }
     d_stream->flushWriteBuffer();
-    d_stream->flush();
 
-    for (int i = 0; i < 4; ++i) {
-        readIndex();
-        writeIndex(Stream::INDEX_DONE);
+    // Send INDEX_DONE 4 times to terminate the transmission properly; the entries the server reports on before that
+    // are echoed back along with their flags.
+    int done = 0;
+    while (done < 4) {
+        int index = readIndex();
+        writeIndex(index);
+        if (index == Stream::INDEX_DONE) {
+            ++done;
+        } else {
+            uint16_t iflags = d_stream->readUInt16();
+            d_stream->writeUInt16(iflags);
+        }
         d_stream->flushWriteBuffer();
     }
-    return;
 }
 
 // List all modules.  Only valid under the daemon mode
@@ -1587,16 +2484,17 @@ void Client::listModules()
 }
 
 // Start an rsync session
-void Client::start(const char *remotePath, bool isDownloading, bool recursive, bool isDeleting)
+void Client::start(const char *remotePath, bool isDownloading, bool recursive, bool isDeleting, const Filter *filter)
 {
     d_stream->reset();
+    d_incrementalRecursion = false;
 
     // Options for the remote server (note that these are completely different from the command line options)
     //   --copy_dirlinks: treat symlinked dir as real dir
     //   -t: preserve times
     //   -u: skip files that are newer on the receiver
     //   -d: transfer directories without recursing
-    //   -e.:  server protocol options not used
+    //   -e.:  server protocol options; 'i' asks for incremental recursion
     std::string command = d_rsyncCommand + " --server --modify-window=2 ";
     if (isDownloading) {
         command += "--sender ";
@@ -1625,13 +2523,33 @@ void Client::start(const char *remotePath, bool isDownloading, bool recursive, b
         command += "--delete-during ";
     }
 
+    if (d_compressionEnabled) {
+        command += "--compress ";
+    }
+
+    // Tell the sender not to refer to blocks that have already been overwritten.
+    if (isDownloading && d_inPlaceEnabled) {
+        command += "--inplace ";
+    }
+
+    // Signatures can only be reused if they are always computed with the same seed.
+    if (isDownloading && d_signatureCache && d_signatureCache->isValid()) {
+        std::stringstream out;
+        out << "--checksum-seed=" << d_signatureCache->getSeed() << " ";
+        command += out.str();
+    }
+
     for (unsigned int i = 0; i < d_backupPaths.size(); ++i) {
         command += "--link-dest=";
         command += d_backupPaths[i];
         command += " ";
     }
     
-    command += "-tude. . ";
+    if (isDownloading && recursive && d_incrementalRecursionEnabled) {
+        command += "-tude.i . ";
+    } else {
+        command += "-tude. . ";
+    }
 
     if (*remotePath == 0) {
         command += "\"\"";
@@ -1665,7 +2583,8 @@ void Client::start(const char *remotePath, bool isDownloading, bool recursive, b
     
     if (d_protocol >= 30) {
         uint8_t compatibilityFlag = d_stream->readUInt8(); 
-        if (compatibilityFlag & 0x1) {
+        d_incrementalRecursion = (compatibilityFlag & 0x1) != 0;
+        if (d_incrementalRecursion && !(isDownloading && recursive)) {
             LOG_FATAL(RSYNC_COMPAT) << "Server demands incremental directory recursion" << LOG_END
         }
 
@@ -1676,6 +2595,13 @@ void Client::start(const char *remotePath, bool isDownloading, bool recursive, b
     
     d_checksumSeed = d_stream->readInt32();
 
+    // The compressed streams start afresh with every session.
+    delete d_tokenCompressor;
+    d_tokenCompressor = 0;
+    if (d_compressionEnabled) {
+        d_tokenCompressor = new TokenCompressor(d_stream, d_protocol);
+    }
+
     d_stream->enableBuffer();
     if (d_protocol >= 30) {
         d_stream->enableWriteMultiplex();
@@ -1685,7 +2611,16 @@ void Client::start(const char *remotePath, bool isDownloading, bool recursive, b
     d_lastEntryMode = 0;
     d_lastEntryTime = 0;
     
-    if (isDownloading || d_deletionEnabled) {
+    // The server only reads the filter rules if it is the sender or deletes files.  Each rule is sent with its
+    // length, and an empty one ends the list.
+    if (isDownloading || isDeleting) {
+        if (filter) {
+            const std::vector<std::string> &rules = filter->getRules();
+            for (unsigned int i = 0; i < rules.size(); ++i) {
+                d_stream->writeInt32(rules[i].size());
+                d_stream->write(rules[i].c_str(), rules[i].size());
+            }
+        }
         d_stream->writeInt32(0);
         d_stream->flushWriteBuffer();
     }
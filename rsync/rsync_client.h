@@ -16,13 +16,16 @@
 #ifndef INCLUDED_RSYNC_CLIENT_H
 #define INCLUDED_RSYNC_CLIENT_H
 
+#include <rsync/rsync_checksumindex.h>
 #include <rsync/rsync_stream.h>
 #include <rsync/rsync_io.h>
 #include <rsync/rsync_file.h>
+#include <rsync/rsync_filter.h>
 
 #include <block/block_out.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 #include <set>
 
@@ -31,6 +34,10 @@ namespace rsync
 
 class IO;
 class Entry;
+class FileList;
+class FileWriter;
+class SignatureCache;
+class TokenCompressor;
 
 class Client
 {
@@ -51,7 +58,9 @@ public:
     // 'includedFiles'), from the remote directory 'remoteTop' to the local directory 'localTop'.  For each file to
     // be downloaded, the file will be written to 'temporaryFile' first and then moved to its destination after
     // each file transfer.  The names of all downloaded and deleted files can be retrieved by calling
-    // 'getUpdatedFiles()' and 'getDeletedFiles()'.
+    // 'getUpdatedFiles()' and 'getDeletedFiles()'.  In a selective sync the server is asked to list only the
+    // files in 'includeFiles' and the directories above them, so the remote file list is no larger than the
+    // selection.
     int download(const char *localTop, const char *remoteTop, const char *temporaryFile,
                  const std::set<std::string> *includeFiles = 0);
 
@@ -68,6 +77,18 @@ public:
     // Create a symbolic link with the name 'link' that points to 'remotePath' under the same directory.
     void link(const char *remotePath, const char *link);
 
+    // Remove the files and directories specified by 'remotePaths' on the server, as by 'remove()', but in one session
+    // for each remote directory they are in rather than one for each path.  Paths under another one being removed
+    // are left out.
+    void remove(const std::vector<std::string> &remotePaths);
+
+    // Create the new directories 'remotePaths' on the server as by 'mkdir()', and the symbolic links 'links' as by
+    // 'link()' with the two members of each pair as the arguments, but in one session for each remote directory
+    // they are created in rather than one for each path.  Paths under a new directory are created in the same
+    // session as the directory, after it.
+    void create(const std::vector<std::string> &remotePaths,
+                const std::vector<std::pair<std::string, std::string> > &links);
+
     // List all modules provided by the rsync daemon server.  Used only in rsync daemon mode.
     void listModules();
 
@@ -78,12 +99,97 @@ public:
     // Remove all backup paths.
     void clearBackupPaths();
 
+    // Add a filter rule, such as '- *.o' or '+ /src/***', as described by 'Filter::add()'.  The rules are sent to the
+    // server, which leaves the files they exclude out of the remote file list and doesn't delete them, and local
+    // directories are listed with the same rules, so excluded files are neither transferred nor deleted on either
+    // side.  Excluded directories are not listed at all.  Throw an exception if the rule is not supported.
+    void addFilterRule(const char *rule);
+
+    // Remove all filter rules.
+    void clearFilterRules();
+
     // Set the download and upload limits.  The unit is Kilobytes per second.
     void setSpeedLimits(int downloadLimit, int uploadLimit);
 
     // If 'deletionEnabled' is true, files or dirs that do not exist on the other side will be removed.
     void setDeletionEnabled(bool deletionEnabled);
 
+    // If 'memoryMappingEnabled' is true, files to be uploaded are mapped into memory when scanned for matching
+    // blocks, instead of being read through a buffer.  Files that can't be mapped are always read.  This is off by
+    // default: if another process truncates a file while it is mapped, touching the pages past the new end raises
+    // SIGBUS, which kills the whole process, so only enable it when the local files are known not to be changed
+    // during a transfer.
+    void setMemoryMappingEnabled(bool memoryMappingEnabled);
+
+    // If 'basisMappingEnabled' is true, the old files from which matched blocks are copied when downloading are
+    // mapped into memory, so that runs of matched blocks can be copied in the kernel, instead of being read ahead
+    // through a buffer.  This is off by default, for the same reason as above.
+    void setBasisMappingEnabled(bool basisMappingEnabled);
+
+    // Use 'signatureCache' to keep the block signatures of local files between downloads, so that files that
+    // haven't changed since the last download don't need to be read to compute their signatures.  The server will
+    // be asked to use the checksum seed of the cache.  Pass 0 to disable the cache.  The cache is not owned by the
+    // client.
+    void setSignatureCache(SignatureCache *signatureCache);
+
+    // Compute the block signatures of local files on 'numberOfThreads' worker threads while downloading, ahead of
+    // the files whose signatures are being sent, holding at most about 'memoryBudget' bytes of signatures not yet
+    // sent.  If 'numberOfThreads' is 0 (the default), each file is read just before its signatures are sent.
+    void setSignatureThreads(int numberOfThreads, int64_t memoryBudget);
+
+    // If 'compressionEnabled' is true, ask the server to compress file content in both directions, as with the '-z'
+    // option.  Only literal data is compressed; the compressed bytes are what '*physicalBytes' counts.
+    void setCompressionEnabled(bool compressionEnabled);
+
+    // If 'inPlaceEnabled' is true, downloaded files are updated in place, as with the '--inplace' option, instead of
+    // being written to the temporary file and renamed over the local files.  Blocks that haven't moved are not
+    // written at all.  A file whose download fails is left partially updated until it is downloaded again.
+    void setInPlaceEnabled(bool inPlaceEnabled);
+
+    // If 'sparseEnabled' is true, blocks of zeroes in downloaded files are turned into holes, as with the '--sparse'
+    // option, so they take no disk space.  When updating in place the holes are punched into the existing files.
+    void setSparseEnabled(bool sparseEnabled);
+
+    // If 'preallocationEnabled' is true, disk space is reserved for each downloaded file from the size in the file
+    // list before any of it is written, which reduces fragmentation and stops the download of a file at once if the
+    // disk is too full for it.  Files are not preallocated if sparse files are enabled.
+    void setPreallocationEnabled(bool preallocationEnabled);
+
+    // If 'memoryBudget' is positive, downloaded files are written on a separate thread, with up to about
+    // 'memoryBudget' bytes waiting to be written, so that a slow disk doesn't hold up receiving from the network.
+    // Files updated in place are always written directly.  If 'memoryBudget' is 0 (the default), each piece of a
+    // file is written as soon as it is received.
+    void setWriteBehind(int64_t memoryBudget);
+
+    // If 'numberOfThreads' is positive, each downloaded file is written to a temporary file of its own, and closed,
+    // renamed over the local file and given its attributes on one of 'numberOfThreads' worker threads while the next
+    // file is received.  Where the filesystem allows it the temporary files have no name until they are complete;
+    // otherwise they are named after 'temporaryFile'.  Files whose download fails are not kept.  If
+    // 'numberOfThreads' is 0 (the default), each file is finished before the next one is received.
+    void setFinalizerThreads(int numberOfThreads);
+
+    // List local directories on 'numberOfThreads' worker threads when building the local file list, which helps
+    // on trees with many directories, especially over a network filesystem.  The file list is the same either way.
+    // If 'numberOfThreads' is 0 (the default), directories are listed one at a time.
+    void setScannerThreads(int numberOfThreads);
+
+    // If 'inodeOrderEnabled' is true, local files are looked up and opened in the order of their inode numbers
+    // rather than by name, both when listing local directories and when reading the files to be updated.  This
+    // avoids seeking back and forth on rotational disks when the files are not cached.  The file lists and the files
+    // transferred are the same either way.
+    void setInodeOrderEnabled(bool inodeOrderEnabled);
+
+    // If 'streamingUploadEnabled' is true, 'upload()' starts the session before listing the local directory, and
+    // sends each entry as soon as it has been listed, so that the server receives the file list while the rest of
+    // the tree is still being scanned.  The file list is the same either way.  This has no effect when uploading a
+    // single file or only the files in 'includeFiles'.  It is off by default.
+    void setStreamingUploadEnabled(bool streamingUploadEnabled);
+
+    // If 'incrementalRecursionEnabled' is true, 'download()' asks a server speaking protocol 30 or later for
+    // incremental recursion, under which the server sends the file list one directory at a time and the files in
+    // each directory can be downloaded while the rest of the list is still being built.  It is off by default.
+    void setIncrementalRecursionEnabled(bool incrementalRecursionEnabled);
+
     // Statistics that will be updated while the sync is in progress.
     // '*totalBytes': the total bytes of all bytes in the source directory
     // '*physicalBytes': the number of bytes that have been transmitted by the network
@@ -118,21 +224,62 @@ private:
     // Send a series of checksums calcuated from the base file 'oldFile' for the file with the specifed 'index'.
     void sendChecksum(int index, const char *oldFile);
 
-    // Send an entry to the remote server.
-    void sendEntry(Entry *entry, bool isTop, bool noDirContent = false);
+    // Send the checksums 'signatures' computed by 'SignaturePipeline' for the file with the specified 'index'.
+    void writeSignatures(int index, const std::string &signatures);
+
+    // Send the entry at 'index' of 'fileList' to the remote server.
+    void sendEntry(const FileList &fileList, int index, bool isTop, bool noDirContent = false);
+
+    // End the file list of a session that sends no file content, and echo back what the server sends until it is
+    // done.
+    void finishFileList();
 
     // Send a file to the remote server.
     bool sendFile(int index, const char *remotePath, const char *localPath);
 
+    // Return the block in 'd_checksums' that has the rolling checksum 's' and the same content as the 'blockLength'
+    // bytes at 'data', or -1 if there is no such block.
+    int findBlock(const char *data, int blockLength, uint32_t s, int md5Length);
+
+    // Send 'size' bytes at 'data' as literal data and update the stats.  Nothing is sent if 'size' is 0.
+    void sendLiteral(const char *data, int size, int64_t *physicalBytes, int64_t *logicalBytes);
+
+    // Send a match of the block 'block', whose content is the 'length' bytes at 'data', and update the stats.
+    void sendMatch(int block, const char *data, int length, int64_t *physicalBytes, int64_t *logicalBytes);
+
+    // Mark the end of the file content being sent and update the stats.
+    void sendEnd(int64_t *physicalBytes);
+
+    // Receive the next token of the file content.  Return the number of bytes of literal data pointed to by '*data'
+    // if positive, -(block + 1) for a match, or 0 at the end of the file.  Update the stats with the bytes received.
+    int32_t receiveToken(const char **data, int64_t *physicalBytes);
+
     // Receive an entry from the remote server.
     bool receiveEntry(std::string *path, bool *isDir, int64_t *size, int64_t *time, uint32_t *mode,
                       std::string *symlink);
 
-    // Receive a file from the remote server.
-    bool receiveFile(const char *remotePath, const char *newFile, const char *oldFile, int64_t *fileSize);
+    // Receive a segment of the file list under incremental recursion, holding the entries in the directory at
+    // 'directory' of 'remoteFiles', and append them to 'remoteFiles' in sorted order.
+    void receiveSegment(FileList *remoteFiles, int directory);
 
-    // Start a new rsync session. 
-    void start(const char *remotePath, bool isDownloading, bool recursive, bool isDeleting);
+    // Compare the entries of 'remoteFiles' from 'begin' to the end with those of 'localFiles', which are under
+    // 'localPath'.  Create directories and symlinks and update modes as needed, and append the indices of the files
+    // to be downloaded to 'queue'.
+    void compareFileLists(const FileList &localFiles, const FileList &remoteFiles, int begin,
+                          const std::string &localPath, std::vector<int> *queue);
+
+    // Receive a file from the remote server.  If 'newFile' is the same as 'oldFile' the file is updated in place.
+    // 'expectedSize' is the size of the file in the file list.
+    bool receiveFile(const char *remotePath, const char *newFile, const char *oldFile, int64_t expectedSize,
+                     int64_t *fileSize);
+
+    // Receive a file from the remote server into 'newFile', which has been opened for write, or for update if
+    // 'inPlace' is true.
+    bool receiveFile(const char *remotePath, File *newFile, const char *oldFile, bool inPlace, int64_t expectedSize,
+                     int64_t *fileSize);
+
+    // Start a new rsync session.  The rules of 'filter', if not 0, are sent to the server when it reads them.
+    void start(const char *remotePath, bool isDownloading, bool recursive, bool isDeleting, const Filter *filter);
 
     // Close the rsync session.
     void stop();
@@ -146,14 +293,31 @@ private:
     bool d_usingSSH;               // whether the remote server is an ssh server or an rsync daemon
     IO *d_io;                      // io channel to the remote server
     Stream *d_stream;              // data stream on top of 'd_io'
+    int *d_cancelFlag;             // points to the flag that aborts the sync operation
 
     std::string d_rsyncCommand;    // the path to the rsync executable on the server
 
     int d_downloadLimit;           // maximum download speed in kiloBytes/sec
     bool d_deletionEnabled;        // whether to propagate deletions
-
-    std::vector<std::string> d_includePatterns;    // include patterns
-    std::vector<std::string> d_excludePatterns;    // exclude patterns
+    bool d_memoryMappingEnabled;   // whether to map files into memory when uploading
+    bool d_basisMappingEnabled;    // whether to map old files into memory when downloading
+    SignatureCache *d_signatureCache;   // the cache of signatures of local files; may be 0
+    int d_signatureThreads;        // the number of threads computing signatures; 0 to compute them when sent
+    int64_t d_signatureMemoryBudget;    // the maximum number of bytes of signatures computed ahead
+    bool d_compressionEnabled;     // whether to compress file content
+    TokenCompressor *d_tokenCompressor; // compresses file content in the current session; 0 if not compressing
+    bool d_inPlaceEnabled;         // whether to update downloaded files in place
+    bool d_sparseEnabled;          // whether to leave holes for blocks of zeroes in downloaded files
+    bool d_preallocationEnabled;   // whether to reserve disk space for downloaded files before writing them
+    FileWriter *d_fileWriter;      // writes the content of downloaded files
+    int d_finalizerThreads;        // the number of threads finishing downloaded files; 0 to finish them in turn
+    int d_scannerThreads;          // the number of threads listing local directories; 0 to list them in turn
+    bool d_inodeOrderEnabled;      // whether to look up and open local files in the order of their inodes
+    bool d_streamingUploadEnabled; // whether to send the file list of an upload while the local directory is listed
+    bool d_incrementalRecursionEnabled; // whether to ask for the file list of a download one directory at a time
+    bool d_incrementalRecursion;   // whether the server sends the file list of the current session in segments
+
+    Filter d_filter;               // the include and exclude rules applied on both sides
 
     std::vector<std::string> d_backupPaths;        // paths of previous backups; used by the '--link-desk' option
     
@@ -166,13 +330,12 @@ private:
     struct Checksum
     {
         uint32_t d_sum1;           // the rolling checksum of each block
-        uint32_t d_next;           // the next pointer for making a hash table of checksum
         char d_sum2[16];           // the MD5 checksum of of each block
     };
 
     int d_numberOfChecksums;       // the number of checksums for the current file transfer
 
-    int* d_hashBuckets;            // the entries to the checksum hash table
+    ChecksumIndex d_checksumIndex; // maps rolling checksums to blocks in 'd_checksums'
     Checksum *d_checksums;         // store all the checksum
 
     char *d_chunk;                 // a chunk buffer used to send or receive file content
@@ -0,0 +1,317 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#include <rsync/rsync_directoryscanner.h>
+
+#include <rsync/rsync_entry.h>
+#include <rsync/rsync_entrypool.h>
+#include <rsync/rsync_filter.h>
+#include <rsync/rsync_log.h>
+#include <rsync/rsync_pathutil.h>
+
+#include <utility>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+DirectoryScanner::DirectoryScanner(int numberOfThreads, const int *cancelFlagAddress)
+    : d_cancelFlag(cancelFlagAddress)
+    , d_stopFlag(0)
+    , d_top()
+    , d_normalization(false)
+    , d_inodeOrderEnabled(false)
+    , d_filter(0)
+    , d_queues()
+    , d_pools()
+    , d_pool(0)
+    , d_next(0)
+    , d_visited()
+    , d_generation(0)
+    , d_stopping(false)
+{
+    for (int i = 0; i < numberOfThreads || i == 0; ++i) {
+        d_queues.push_back(new Queue());
+    }
+    for (int i = 0; i < numberOfThreads; ++i) {
+        d_workers.push_back(std::thread(&DirectoryScanner::run, this, i));
+    }
+}
+
+DirectoryScanner::~DirectoryScanner()
+{
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_workAvailable.notify_all();
+    for (unsigned int i = 0; i < d_workers.size(); ++i) {
+        d_workers[i].join();
+    }
+    for (unsigned int i = 0; i < d_queues.size(); ++i) {
+        delete d_queues[i];
+    }
+
+    // If not all entries were retrieved, release the directories visited and those not visited yet.  Subdirectories
+    // before the next one to visit have already been released.
+    std::vector<Node*> nodes;
+    if (d_next) {
+        nodes.push_back(d_next);
+    }
+    for (unsigned int i = 0; i < d_visited.size(); ++i) {
+        Node *node = d_visited[i].first;
+        nodes.insert(nodes.end(), node->d_children.begin() + d_visited[i].second, node->d_children.end());
+        delete node;
+    }
+    while (!nodes.empty()) {
+        Node *node = nodes.back();
+        nodes.pop_back();
+        nodes.insert(nodes.end(), node->d_children.begin(), node->d_children.end());
+        if (d_pools.empty()) {
+            delete node->d_entry;
+            for (unsigned int i = 0; i < node->d_files.size(); ++i) {
+                delete node->d_files[i];
+            }
+        }
+        delete node;
+    }
+    for (unsigned int i = 0; i < d_pools.size(); ++i) {
+        delete d_pools[i];
+    }
+}
+
+bool DirectoryScanner::scan(const char *top, bool normalization, std::vector<Entry*> *fileList, EntryPool *pool)
+{
+    start(top, normalization, pool);
+    while (next(fileList)) {
+    }
+    return !isStopped();
+}
+
+void DirectoryScanner::start(const char *top, bool normalization, EntryPool *pool)
+{
+    d_top = top;
+    d_normalization = normalization;
+    d_pool = pool;
+    if (pool) {
+        for (unsigned int i = 0; i < d_queues.size(); ++i) {
+            d_pools.push_back(new EntryPool());
+        }
+    }
+
+    Node *root = new Node();
+    root->d_entry = 0;
+    root->d_listed = false;
+    d_next = root;
+
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        {
+            std::unique_lock<std::mutex> queueLock(d_queues[0]->d_mutex);
+            d_queues[0]->d_nodes.push_back(root);
+        }
+        ++d_generation;
+    }
+    d_workAvailable.notify_all();
+}
+
+bool DirectoryScanner::next(std::vector<Entry*> *fileList)
+{
+    // Walk the tree depth first, handing over the entries of each directory visited, until reaching one that hasn't
+    // been listed yet.  Only wait for it if no directory has been visited in this call.
+    bool visited = false;
+    while (true) {
+        while (!d_next && !d_visited.empty()) {
+            Node *node = d_visited.back().first;
+            unsigned int next = d_visited.back().second;
+            if (next < node->d_children.size()) {
+                ++d_visited.back().second;
+                d_next = node->d_children[next];
+            } else {
+                delete node;
+                d_visited.pop_back();
+            }
+        }
+        if (!d_next || !isListed(d_next, !visited)) {
+            break;
+        }
+
+        if (d_next->d_entry) {
+            fileList->push_back(d_next->d_entry);
+        }
+        fileList->insert(fileList->end(), d_next->d_files.begin(), d_next->d_files.end());
+        d_visited.push_back(std::make_pair(d_next, 0u));
+        d_next = 0;
+        visited = true;
+    }
+
+    if (!visited) {
+        for (unsigned int i = 0; i < d_pools.size(); ++i) {
+            d_pool->splice(d_pools[i]);
+            delete d_pools[i];
+        }
+        d_pools.clear();
+        d_pool = 0;
+    }
+    return visited;
+}
+
+void DirectoryScanner::setInodeOrderEnabled(bool inodeOrderEnabled)
+{
+    d_inodeOrderEnabled = inodeOrderEnabled;
+}
+
+void DirectoryScanner::setFilter(const Filter *filter)
+{
+    d_filter = filter;
+}
+
+void DirectoryScanner::setStopFlag(const std::atomic<bool> *stopFlag)
+{
+    d_stopFlag = stopFlag;
+}
+
+void DirectoryScanner::list(Node *node, int worker)
+{
+    // 'PathUtil::listDirectory()' returns the subdirectories in reverse order.
+    std::vector<Entry*> directories;
+    if (!isStopped()) {
+        try {
+            PathUtil::listDirectory(d_top.c_str(), node->d_entry ? node->d_entry->getPath() : "", &node->d_files,
+                                    &directories, d_normalization, d_inodeOrderEnabled,
+                                    d_pools.empty() ? 0 : d_pools[worker]);
+        } catch (Exception&) {
+            // The error has already been logged; the directory is left out like one that can't be opened.
+        }
+    }
+    if (d_filter && !d_filter->isEmpty()) {
+        removeExcluded(&node->d_files);
+        removeExcluded(&directories);
+    }
+    for (int i = static_cast<int>(directories.size()) - 1; i >= 0; --i) {
+        Node *child = new Node();
+        child->d_entry = directories[i];
+        child->d_listed = false;
+        node->d_children.push_back(child);
+    }
+
+    // The children are queued so that the first one is listed next.  Once the node is marked as listed, it may be
+    // deleted by the thread retrieving the entries, so it must not be touched after that.
+    std::unique_lock<std::mutex> lock(d_mutex);
+    if (!directories.empty()) {
+        {
+            Queue *queue = d_queues[worker];
+            std::unique_lock<std::mutex> queueLock(queue->d_mutex);
+            queue->d_nodes.insert(queue->d_nodes.end(), node->d_children.rbegin(), node->d_children.rend());
+        }
+        ++d_generation;
+        d_workAvailable.notify_all();
+    }
+    node->d_listed = true;
+    d_directoryListed.notify_all();
+}
+
+bool DirectoryScanner::isStopped() const
+{
+    return (d_cancelFlag && *d_cancelFlag) || (d_stopFlag && *d_stopFlag);
+}
+
+void DirectoryScanner::removeExcluded(std::vector<Entry*> *entries)
+{
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < entries->size(); ++i) {
+        Entry *entry = (*entries)[i];
+        if (!d_filter->isExcluded(entry->getPath(), entry->isDirectory())) {
+            (*entries)[kept++] = entry;
+        } else if (d_pools.empty()) {
+            delete entry;
+        }
+    }
+    entries->resize(kept);
+}
+
+bool DirectoryScanner::isListed(Node *node, bool wait)
+{
+    if (d_workers.empty()) {
+        // Without workers, directories are listed here as they are needed.  They are taken from the back of the
+        // queue, which holds the next one to be visited.
+        while (wait && !node->d_listed) {
+            list(take(0), 0);
+        }
+        return node->d_listed;
+    }
+
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (wait && !node->d_listed) {
+        d_directoryListed.wait(lock);
+    }
+    return node->d_listed;
+}
+
+DirectoryScanner::Node *DirectoryScanner::take(int worker)
+{
+    {
+        Queue *queue = d_queues[worker];
+        std::unique_lock<std::mutex> lock(queue->d_mutex);
+        if (!queue->d_nodes.empty()) {
+            Node *node = queue->d_nodes.back();
+            queue->d_nodes.pop_back();
+            return node;
+        }
+    }
+
+    // Directories taken from the front of other queues are the ones nearest the top, which are likely to have the
+    // most below them.
+    for (unsigned int i = 1; i < d_queues.size(); ++i) {
+        Queue *queue = d_queues[(worker + i) % d_queues.size()];
+        std::unique_lock<std::mutex> lock(queue->d_mutex);
+        if (!queue->d_nodes.empty()) {
+            Node *node = queue->d_nodes.front();
+            queue->d_nodes.pop_front();
+            return node;
+        }
+    }
+    return 0;
+}
+
+void DirectoryScanner::run(int worker)
+{
+    while (true) {
+        // Directories queued after the generation is read will wake this worker up if it finds nothing to take.
+        uint64_t generation;
+        {
+            std::unique_lock<std::mutex> lock(d_mutex);
+            if (d_stopping) {
+                return;
+            }
+            generation = d_generation;
+        }
+
+        Node *node = take(worker);
+        if (node) {
+            list(node, worker);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(d_mutex);
+        while (generation == d_generation && !d_stopping) {
+            d_workAvailable.wait(lock);
+        }
+    }
+}
+
+} // close namespace rsync
@@ -0,0 +1,150 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#ifndef INCLUDED_RSYNC_DIRECTORYSCANNER_H
+#define INCLUDED_RSYNC_DIRECTORYSCANNER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace rsync
+{
+
+class Entry;
+class EntryPool;
+class Filter;
+
+// This class lists a local directory recursively on a pool of worker threads.  Each worker lists directories from a
+// queue of its own, depth first, and takes directories from the other end of the queues of other workers when its
+// own runs out, so that a deep branch doesn't keep the other workers waiting.  The entries are handed out in the
+// same order as if they were listed one directory at a time, each as soon as its directory has been listed.
+class DirectoryScanner
+{
+public:
+
+    // Create a scanner with 'numberOfThreads' workers that stop listing when the value pointed to by
+    // 'cancelFlagAddress' becomes non-zero.  If 'numberOfThreads' is 0, directories are listed by the thread calling
+    // 'scan()'.
+    DirectoryScanner(int numberOfThreads, const int *cancelFlagAddress);
+
+    // Wait for the workers to exit.
+    ~DirectoryScanner();
+
+    // Append the entries under the directory 'top' to 'fileList', as 'PathUtil::listDirectory()' lists them, with
+    // each directory followed by its own entries: the files of a directory in order, then each of its
+    // subdirectories in order, followed by the entries under it.  'normalization' is passed to
+    // 'PathUtil::listDirectory()'.  If 'pool' is not 0, the entries are created in 'pool'; each worker creates
+    // entries in a pool of its own, which is handed over to 'pool' at the end.  Return false if cancelled or
+    // stopped, in which case only some of the entries are appended.
+    bool scan(const char *top, bool normalization, std::vector<Entry*> *fileList, EntryPool *pool = 0);
+
+    // Start listing the directory 'top' as by 'scan()', and return without waiting.  The entries are then retrieved
+    // with 'next()' while the rest are still being listed.  'start()' must not be called again until 'next()' has
+    // returned false.  Entries created in the pools of the workers are only valid until the scanner is destroyed
+    // unless they are all retrieved, in which case they are handed over to 'pool'.
+    void start(const char *top, bool normalization, EntryPool *pool = 0);
+
+    // Append to 'fileList' the entries that follow those already retrieved since 'start()', in the order of 'scan()',
+    // waiting for the next directory to be listed if none is ready.  Return false if all entries have already been
+    // retrieved.  If cancelled or stopped, directories not listed yet are left out.
+    bool next(std::vector<Entry*> *fileList);
+
+    // If 'inodeOrderEnabled' is true, the entries of each directory are looked up in the order of their inode
+    // numbers, as by 'PathUtil::listDirectory()'.
+    void setInodeOrderEnabled(bool inodeOrderEnabled);
+
+    // Leave out the entries excluded by 'filter', which must outlive the scan; the directories excluded are not
+    // listed at all.  If 'filter' is 0, all entries are kept.
+    void setFilter(const Filter *filter);
+
+    // Stop listing, as if cancelled, once the value pointed to by 'stopFlag' becomes true.  Unlike the cancel flag,
+    // which stops the whole transfer, this lets the owner of the scanner abandon a scan of its own.  If 'stopFlag'
+    // is 0, only the cancel flag is checked.
+    void setStopFlag(const std::atomic<bool> *stopFlag);
+
+private:
+    // NOT IMPLEMENTED
+    DirectoryScanner(const DirectoryScanner&);
+    DirectoryScanner& operator=(const DirectoryScanner&);
+
+    struct Node
+    {
+        Entry *d_entry;                // the entry of the directory; 0 for the top directory
+        std::vector<Entry*> d_files;   // the entries in the directory other than subdirectories, in order
+        std::vector<Node*> d_children; // the subdirectories, in order
+        bool d_listed;                 // set once the two members above are filled in; protected by 'd_mutex'
+    };
+
+    struct Queue
+    {
+        std::mutex d_mutex;            // protects 'd_nodes'
+        std::deque<Node*> d_nodes;     // directories waiting to be listed; the owner takes them from the back
+    };
+
+    // List the directory of 'node' and add its subdirectories to the queue of worker 'worker'.
+    void list(Node *node, int worker);
+
+    // Return true if the scan has been cancelled or stopped.
+    bool isStopped() const;
+
+    // Remove the entries excluded by 'd_filter' from 'entries', deleting them unless they are created in pools.
+    void removeExcluded(std::vector<Entry*> *entries);
+
+    // Return true if the directory of 'node' has been listed, waiting for it first if 'wait' is true.
+    bool isListed(Node *node, bool wait);
+
+    // Take a directory to be listed from the queue of worker 'worker', or from any other queue if it is empty.
+    // Return 0 if there is none.
+    Node *take(int worker);
+
+    // The loop run by worker 'worker'.
+    void run(int worker);
+
+    const int *d_cancelFlag;       // workers stop listing if the value becomes non-zero
+    const std::atomic<bool> *d_stopFlag;   // workers stop listing if the value becomes true; may be 0
+    std::string d_top;             // the directory being scanned
+    bool d_normalization;          // passed to 'PathUtil::listDirectory()'
+    bool d_inodeOrderEnabled;      // passed to 'PathUtil::listDirectory()'
+    const Filter *d_filter;        // the rules deciding which entries are left out; 0 to keep all
+    std::vector<Queue*> d_queues;  // the queue of each worker
+    std::vector<EntryPool*> d_pools;   // the pool each worker creates entries in; empty if not using pools
+    EntryPool *d_pool;             // the pool the pools of the workers are handed over to; 0 if not using pools
+
+    Node *d_next;                  // the directory to be retrieved next; 0 to take it from 'd_visited'
+    std::vector<std::pair<Node*, unsigned int> > d_visited;   // the directories retrieved whose subdirectories
+                                                              // haven't all been, each with the next one to visit
+
+    uint64_t d_generation;         // incremented each time directories are queued
+    bool d_stopping;               // set when the workers must exit
+
+    std::mutex d_mutex;            // protects the two members above and the 'd_listed' member of nodes
+    std::condition_variable d_workAvailable;   // signalled when directories are queued
+    std::condition_variable d_directoryListed; // signalled when a directory has been listed
+
+    std::vector<std::thread> d_workers;        // the worker threads
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_DIRECTORYSCANNER_H
@@ -15,6 +15,8 @@
 
 #include <rsync/rsync_entry.h>
 
+#include <rsync/rsync_entrypool.h>
+
 #include <algorithm>
 
 #include <cstring>
@@ -25,13 +27,93 @@
 namespace rsync
 {
 
+Entry::Entry(const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode)
+    : d_path(0)
+    , d_pathLength(static_cast<uint32_t>(::strlen(path)))
+    , d_mode(mode)
+    , d_size(size)
+    , d_time(time)
+    , d_symlink(0)
+    , d_pool(0)
+    , d_data(0)
+{
+    d_path = copyString(path, d_pathLength, 0);
+    if (isDirectory) {
+        d_size = 0;
+        d_mode |= IS_DIR;
+    }
+}
+
+Entry::Entry(EntryPool *pool, const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode)
+    : d_path(0)
+    , d_pathLength(static_cast<uint32_t>(::strlen(path)))
+    , d_mode(mode)
+    , d_size(size)
+    , d_time(time)
+    , d_symlink(0)
+    , d_pool(pool)
+    , d_data(0)
+{
+    d_path = copyString(path, d_pathLength, 0);
+    if (isDirectory) {
+        d_size = 0;
+        d_mode |= IS_DIR;
+    }
+}
+
+Entry::~Entry()
+{
+    releaseString(d_path);
+    releaseString(d_symlink);
+}
+
+Entry::Entry(const Entry& other)
+    : d_path(0)
+    , d_pathLength(other.d_pathLength)
+    , d_mode(other.d_mode)
+    , d_size(other.d_size)
+    , d_time(other.d_time)
+    , d_symlink(0)
+    , d_pool(0)
+    , d_data(0)
+{
+    d_path = copyString(other.d_path, d_pathLength, 0);
+}
+
+void Entry::setSymlink(const std::string& symlink)
+{
+    releaseString(d_symlink);
+    d_symlink = copyString(symlink.c_str(), symlink.size(), 0);
+}
+
+int Entry::getSymlinkLength() const
+{
+    return static_cast<int>(::strlen(d_symlink));
+}
+
+char *Entry::copyString(const char *string, size_t length, size_t extra) const
+{
+    char *copy = d_pool ? d_pool->allocate(length + extra + 1, 1) : new char[length + extra + 1];
+    ::memcpy(copy, string, length);
+    copy[length] = 0;
+    return copy;
+}
+
+void Entry::releaseString(char *string) const
+{
+    // Strings in a pool are released with the pool.
+    if (!d_pool) {
+        delete [] string;
+    }
+}
+
 bool Entry::compareLocally(const Entry* lhs, const Entry* rhs)
 {
     // Directories are always arranged before files.  If both are of the same kind, compare them
     // as strings.
     if (lhs->isDirectory()) {
         if (rhs->isDirectory()) {
-            return lhs->d_path < rhs->d_path;
+            return ::strcmp(lhs->d_path, rhs->d_path) < 0;
         } else {
             return false;
         }
@@ -39,7 +121,7 @@ bool Entry::compareLocally(const Entry* lhs, const Entry* rhs)
         if (rhs->isDirectory()) {
             return true;
         } else {
-            return lhs->d_path < rhs->d_path;
+            return ::strcmp(lhs->d_path, rhs->d_path) < 0;
         }
     }
 }
@@ -106,36 +188,49 @@ bool Entry::compareGlobally(const Entry* lhs, const Entry* rhs)
 
 void Entry::normalizePath()
 {
-    if (isDirectory() && d_path[d_path.size() - 1] != '/') {
-        d_path.append("/");
+    if (!isDirectory() || (d_pathLength > 0 && d_path[d_pathLength - 1] == '/')) {
+        return;
     }
+
+    char *path = copyString(d_path, d_pathLength, 1);
+    path[d_pathLength] = '/';
+    path[d_pathLength + 1] = 0;
+    releaseString(d_path);
+    d_path = path;
+    ++d_pathLength;
 }
     
 bool Entry::contains(const Entry* other) const
 {
-    return other->d_path.compare(0, d_path.size(), d_path) == 0;
+    return ::strncmp(other->d_path, d_path, d_pathLength) == 0;
 }
 
 bool Entry::isOlderThan(const Entry &other) const
+{
+    return isOlder(d_time, other.d_time);
+}
+
+bool Entry::isOlder(int64_t time, int64_t otherTime)
 {
 #ifdef WIN32
-    if (other.d_time > 1426620844) {
+    if (otherTime > 1426620844) {
         return false;
     }
 #endif
-    return d_time + 1 < other.d_time;
+    return time + 1 < otherTime;
 }
 
 std::string Entry::getLocalName() const
 {
-    size_t begin = d_path.rfind('/');
-    if (begin == d_path.size() - 1) {
-        begin = d_path.rfind('/', begin - 1);
+    std::string path(d_path, d_pathLength);
+    size_t begin = path.rfind('/');
+    if (begin == path.size() - 1) {
+        begin = path.rfind('/', begin - 1);
     }
     if (begin == std::string::npos) {
-        return d_path;
+        return path;
     } else {
-        return d_path.substr(begin + 1);
+        return path.substr(begin + 1);
     }
 }
 
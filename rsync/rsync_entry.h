@@ -25,6 +25,8 @@
 namespace rsync
 {
 
+class EntryPool;
+
 // This class encapsulates info about a file/dir, such as file name, file size, modified time, and mode.
 class Entry
 {
@@ -60,43 +62,23 @@ public:
     // Retrun 'true' if this entry is older than 'other'
     bool isOlderThan(const Entry &other) const;
 
+    // Return 'true' if a file modified at 'time' is older than one modified at 'otherTime'
+    static bool isOlder(int64_t time, int64_t otherTime);
+
     // Return the last path component
     std::string getLocalName() const;
 
-    // Create a new entry
-    Entry(const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode)
-        : d_path(path)
-        , d_size(size)
-        , d_time(time)
-        , d_mode(mode)
-        , d_symlink(0)
-        , d_data(0)
-    {
-        if (isDirectory) {
-            d_size = 0;
-            d_mode |= IS_DIR;
-        }
-    }
-
-    ~Entry()
-    {
-        delete d_symlink;
-    }
+    // Create a new entry.  Entries created by an 'EntryPool' are created by 'EntryPool::create()' instead.
+    Entry(const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode);
 
-    Entry(const Entry& other)
-        : d_path(other.d_path)
-        , d_size(other.d_size)
-        , d_time(other.d_time)
-        , d_mode(other.d_mode)
-        , d_symlink(0)
-        , d_data(0)
-    {
-    }
+    ~Entry();
 
+    // The copy is not in any pool, and has no symlink.
+    Entry(const Entry& other);
 
     const char *getPath() const
     {
-        return d_path.c_str();
+        return d_path;
     }
 
     bool isDirectory() const
@@ -145,21 +127,14 @@ public:
         d_size += size;
     }
     
-    void setSymlink(const std::string& symlink)
-    {
-        delete d_symlink;
-        d_symlink = new std::string(symlink);
-    }
+    void setSymlink(const std::string& symlink);
     
     const char *getSymlink() const
     {
-        return d_symlink->c_str();
+        return d_symlink;
     }
     
-    int getSymlinkLength() const
-    {
-        return static_cast<int>(d_symlink->size());
-    }
+    int getSymlinkLength() const;
     
     void *getData() const
     {
@@ -174,11 +149,25 @@ private:
     // NOT IMPLEMENTED
     Entry& operator=(const Entry&);
 
-    std::string d_path;                  // path of the entry (usually relative to the top directory)
+    friend class EntryPool;
+
+    // Create a new entry whose strings are allocated from 'pool'.
+    Entry(EntryPool *pool, const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode);
+
+    // Return a copy of the 'length' bytes at 'string', with room for 'extra' more bytes and a terminating null,
+    // allocated from 'd_pool' if there is one.
+    char *copyString(const char *string, size_t length, size_t extra) const;
+
+    // Release a string returned by 'copyString()'.
+    void releaseString(char *string) const;
+
+    char *d_path;                        // path of the entry (usually relative to the top directory)
+    uint32_t d_pathLength;               // the length of 'd_path'
+    uint32_t d_mode;                     // file node
     int64_t d_size;                      // file size; could be 0 for a directory
     int64_t d_time;                      // last modified time
-    uint32_t d_mode;                     // file node
-    std::string *d_symlink;              // contains the symbolic link; is NULL if the entry is not a symlink
+    char *d_symlink;                     // contains the symbolic link; is NULL if the entry is not a symlink
+    EntryPool *d_pool;                   // the pool the entry and its strings are allocated from; 0 if none
 
     void *d_data;                        // A generic field usually used to store a pointer
 };
@@ -0,0 +1,113 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#include <rsync/rsync_entrypool.h>
+
+#include <rsync/rsync_entry.h>
+
+#include <algorithm>
+#include <new>
+
+#include <cstring>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// The size of the first block of a pool.
+const size_t InitialBlockSize = 16 * 1024;
+
+// The size blocks stop growing at.
+const size_t MaxBlockSize = 1024 * 1024;
+
+} // unnamed namespace
+
+EntryPool::EntryPool()
+    : d_blocks()
+    , d_next(0)
+    , d_remaining(0)
+    , d_blockSize(InitialBlockSize)
+{
+}
+
+EntryPool::~EntryPool()
+{
+    clear();
+}
+
+Entry *EntryPool::create(const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode)
+{
+    // Entries have no destructor to run, as everything they point to is in the pool as well.
+    char *memory = allocate(sizeof(Entry), sizeof(int64_t));
+    return new (memory) Entry(this, path, isDirectory, size, time, mode);
+}
+
+void EntryPool::splice(EntryPool *other)
+{
+    if (other == this) {
+        return;
+    }
+
+    // New entries keep going into the current block, which is the last one.
+    if (!d_blocks.empty()) {
+        d_blocks.insert(d_blocks.end() - 1, other->d_blocks.begin(), other->d_blocks.end());
+    } else {
+        d_blocks.swap(other->d_blocks);
+        d_next = other->d_next;
+        d_remaining = other->d_remaining;
+        d_blockSize = other->d_blockSize;
+    }
+    other->d_blocks.clear();
+    other->d_next = 0;
+    other->d_remaining = 0;
+    other->d_blockSize = InitialBlockSize;
+}
+
+void EntryPool::clear()
+{
+    for (unsigned int i = 0; i < d_blocks.size(); ++i) {
+        delete [] d_blocks[i];
+    }
+    d_blocks.clear();
+    d_next = 0;
+    d_remaining = 0;
+    d_blockSize = InitialBlockSize;
+}
+
+char *EntryPool::allocate(size_t size, size_t alignment)
+{
+    size_t padding = (alignment - reinterpret_cast<size_t>(d_next) % alignment) % alignment;
+    if (!d_next || padding + size > d_remaining) {
+        // A new block is aligned for anything, as it comes from 'new'.
+        size_t blockSize = std::max(d_blockSize, size);
+        d_blocks.push_back(new char[blockSize]);
+        d_next = d_blocks.back();
+        d_remaining = blockSize;
+        d_blockSize = std::min(d_blockSize * 2, MaxBlockSize);
+        padding = 0;
+    }
+
+    char *memory = d_next + padding;
+    d_next += padding + size;
+    d_remaining -= padding + size;
+    return memory;
+}
+
+} // close namespace rsync
@@ -0,0 +1,71 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#ifndef INCLUDED_RSYNC_ENTRYPOOL_H
+#define INCLUDED_RSYNC_ENTRYPOOL_H
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <vector>
+
+namespace rsync
+{
+
+class Entry;
+
+// This class allocates entries, along with their paths and symlinks, from large blocks of memory, so that creating
+// an entry doesn't take a separate allocation for each part of it, and all entries are released together by
+// releasing the blocks.  Entries created by a pool must not be deleted; they become invalid when the pool is
+// destroyed or cleared.  A pool may only be used by one thread at a time.
+class EntryPool
+{
+public:
+
+    // Create an empty pool.
+    EntryPool();
+
+    // Release all entries created by the pool.
+    ~EntryPool();
+
+    // Create an entry as by the 'Entry' constructor in the pool.
+    Entry *create(const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode);
+
+    // Take over the entries created by 'other', which becomes empty, so that they are released with this pool.
+    void splice(EntryPool *other);
+
+    // Release all entries created by the pool.
+    void clear();
+
+private:
+    // NOT IMPLEMENTED
+    EntryPool(const EntryPool&);
+    EntryPool& operator=(const EntryPool&);
+
+    friend class Entry;
+
+    // Allocate 'size' bytes aligned to 'alignment', which must be a power of 2.
+    char *allocate(size_t size, size_t alignment);
+
+    std::vector<char*> d_blocks;   // all blocks allocated
+    char *d_next;                  // the first free byte in the last block
+    size_t d_remaining;            // the number of free bytes in the last block
+    size_t d_blockSize;            // the size of the next block; it grows up to a limit
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_ENTRYPOOL_H
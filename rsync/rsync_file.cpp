@@ -38,12 +38,16 @@ File::Handle File::InvalidHandle = INVALID_HANDLE_VALUE;
 File::File()
     : d_handle(InvalidHandle)
     , d_path("")
+    , d_holeOffset(0)
+    , d_holeLength(0)
 {
 }
 
 File::File(const char *fullPath, bool forWrite, bool reportError)
     : d_handle(InvalidHandle)
     , d_path(fullPath)
+    , d_holeOffset(0)
+    , d_holeLength(0)
 {
     open(fullPath, forWrite, reportError);
 }
@@ -65,6 +69,32 @@ bool File::open(const char *fullPath, bool forWrite, bool reportError)
     return true;
 }
 
+bool File::openForUpdate(const char *fullPath, bool reportError)
+{
+    d_path = fullPath;
+    std::basic_string<wchar_t> path = PathUtil::convertToUTF16(fullPath);
+    d_handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, 0);
+    if (d_handle == InvalidHandle) {
+        if (reportError) {
+            LOG_ERROR(FILE_OPEN) << "Failed to open '" << fullPath << "': "
+                                 << Util::getLastError() << LOG_END
+        }
+        return false;
+    }
+    return true;
+}
+
+bool File::openAnonymous(const char * /* directory */)
+{
+    return false;
+}
+
+bool File::link(const char * /* fullPath */, bool /* reportError */)
+{
+    return false;
+}
+
 File::~File()
 {
     this->close();
@@ -118,6 +148,67 @@ int64_t File::seek(int64_t offset, int method)
     return result | (static_cast<int64_t>(distanceToMoveHigh) << 32);
 }
 
+int64_t File::copyRange(File * /* source */, int64_t /* offset */, int64_t /* length */)
+{
+    // Not supported; the caller will write the data itself.
+    return 0;
+}
+
+int File::writeSparse(const char *buffer, int size, bool /* punchHoles */)
+{
+    // Files are not marked as sparse on Windows, so skipping the zeroes would save nothing.
+    return write(buffer, size);
+}
+
+bool File::punchHole()
+{
+    return true;
+}
+
+bool File::truncate(int64_t size)
+{
+    if (d_handle == InvalidHandle) {
+        return false;
+    }
+
+    LARGE_INTEGER position, zero, end;
+    zero.QuadPart = 0;
+    end.QuadPart = size;
+    if (!SetFilePointerEx(d_handle, zero, &position, FILE_CURRENT) ||
+        !SetFilePointerEx(d_handle, end, 0, FILE_BEGIN) || !SetEndOfFile(d_handle)) {
+        LOG_ERROR(FILE_TRUNCATE) << "Failed to change the size of '" << d_path << "' to " << size << ": "
+                                 << Util::getLastError() << LOG_END
+        return false;
+    }
+    SetFilePointerEx(d_handle, position, 0, FILE_BEGIN);
+    return true;
+}
+
+bool File::allocate(int64_t size)
+{
+    if (d_handle == InvalidHandle) {
+        return false;
+    }
+
+    // Setting an allocation size smaller than the file would cut it short.
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(d_handle, &fileSize) || fileSize.QuadPart >= size) {
+        return true;
+    }
+
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = size;
+    if (!SetFileInformationByHandle(d_handle, FileAllocationInfo, &info, sizeof(info))) {
+        DWORD error = GetLastError();
+        if (error == ERROR_DISK_FULL || error == ERROR_HANDLE_DISK_FULL) {
+            LOG_ERROR(FILE_ALLOCATE) << "Failed to allocate " << size << " bytes for '" << d_path << "': "
+                                     << Util::getLastError() << LOG_END
+            return false;
+        }
+    }
+    return true;
+}
+
 void File::close()
 {
     if (d_handle == InvalidHandle) {
@@ -135,22 +226,96 @@ void File::close()
 #include <dirent.h>
 #include <utime.h>
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+
+#if defined(__linux__)
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace rsync
 {
 
+namespace
+{
+
+// Copy 'length' bytes at 'inputOffset' of 'input' to 'outputOffset' of 'output' in the kernel.  Return the number of
+// bytes copied.
+int64_t copyFileRange(int input, int64_t inputOffset, int output, int64_t outputOffset, int64_t length)
+{
+    int64_t copied = 0;
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    while (copied < length) {
+        loff_t in = inputOffset + copied;
+        loff_t out = outputOffset + copied;
+        long rc = ::syscall(SYS_copy_file_range, input, &in, output, &out, static_cast<size_t>(length - copied), 0);
+        if (rc <= 0) {
+            break;
+        }
+        copied += rc;
+    }
+#else
+    (void)input;
+    (void)inputOffset;
+    (void)output;
+    (void)outputOffset;
+    (void)length;
+#endif
+    return copied;
+}
+
+// Data is checked for zeroes in blocks of this size, the smallest hole most filesystems can make.
+const int SparseBlockSize = 4096;
+
+// Return true if all 'size' bytes at 'data' are zero.
+bool isAllZero(const char *data, int size)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= size; i += 64) {
+        const __m128i *p = reinterpret_cast<const __m128i *>(data + i);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+            return false;
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        if (data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // unnamed namespace
+
 File::Handle File::InvalidHandle = -1;
 
 File::File()
     : d_handle(InvalidHandle)
     , d_path("")
+    , d_holeOffset(0)
+    , d_holeLength(0)
 {
 }
 
 File::File(const char *fullPath, bool forWrite, bool reportError)
     : d_handle(InvalidHandle)
     , d_path(fullPath)
+    , d_holeOffset(0)
+    , d_holeLength(0)
 {
     open(fullPath, forWrite, reportError);
 }
@@ -170,6 +335,53 @@ bool File::open(const char *fullPath, bool forWrite, bool reportError)
     return d_handle != InvalidHandle;
 }
 
+bool File::openForUpdate(const char *fullPath, bool reportError)
+{
+    d_path = fullPath;
+    d_handle = ::open(fullPath, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (d_handle == InvalidHandle && reportError) {
+        LOG_ERROR(RSYNC_OPEN) << "Failed to open '" << fullPath << "': " << strerror(errno) << LOG_END
+    }
+    return d_handle != InvalidHandle;
+}
+
+bool File::openAnonymous(const char *directory)
+{
+#if defined(O_TMPFILE)
+    d_path = directory;
+    d_handle = ::open(directory, O_TMPFILE | O_WRONLY, S_IRUSR | S_IWUSR);
+    return d_handle != InvalidHandle;
+#else
+    return false;
+#endif
+}
+
+bool File::link(const char *fullPath, bool reportError)
+{
+#if defined(__linux__)
+    if (d_handle == InvalidHandle) {
+        return false;
+    }
+
+    // Linking the descriptor itself needs special privileges, but linking its path in /proc doesn't.
+    char descriptorPath[64];
+    ::snprintf(descriptorPath, sizeof(descriptorPath), "/proc/self/fd/%d", d_handle);
+    if (::linkat(AT_FDCWD, descriptorPath, AT_FDCWD, fullPath, AT_SYMLINK_FOLLOW) != 0) {
+        if (reportError) {
+            LOG_ERROR(RSYNC_LINK) << "Failed to link '" << fullPath << "': " << strerror(errno) << LOG_END
+        }
+        return false;
+    }
+    d_path = fullPath;
+    return true;
+#else
+    if (reportError) {
+        LOG_ERROR(RSYNC_LINK) << "Failed to link '" << fullPath << "': not supported" << LOG_END
+    }
+    return false;
+#endif
+}
+
 File::~File()
 {
     this->close();
@@ -180,6 +392,13 @@ int File::read(char *buffer, int size)
     if (d_handle == InvalidHandle) {
         return 0;
     }
+    // Zeroes skipped by 'writeSparse()' must be in place before they are read back.
+    if (d_holeLength > 0) {
+        int64_t position = seek(0, SEEK_FROM_CURRENT);
+        if (position < d_holeOffset + d_holeLength && position + size > d_holeOffset && !punchHole()) {
+            return 0;
+        }
+    }
     int rc = static_cast<int>(::read(d_handle, buffer, size));
     if (rc == -1) {
         LOG_ERROR(RSYNC_FILE) << "Error reading from '" << d_path << "': " << strerror(errno) << LOG_END
@@ -190,7 +409,7 @@ int File::read(char *buffer, int size)
 
 int File::write(const char *buffer, int size)
 {
-    if (d_handle == InvalidHandle) {
+    if (d_handle == InvalidHandle || !punchHole()) {
         return 0;
     }
     int bytes = 0;
@@ -208,6 +427,91 @@ int File::write(const char *buffer, int size)
     return bytes;
 }
 
+int File::writeSparse(const char *buffer, int size, bool punchHoles)
+{
+    if (d_handle == InvalidHandle) {
+        return 0;
+    }
+    int64_t position = seek(0, SEEK_FROM_CURRENT);
+    if (position < 0) {
+        return write(buffer, size);
+    }
+
+    // Split the buffer at block boundaries of the file, and write out each run of blocks that aren't all zeroes.
+    // Zeroes in partial blocks at either end are skipped too, as data may arrive in pieces smaller than a block;
+    // the blocks they are in become holes if the rest of them is never written.
+    int written = 0;
+    int start = 0;
+    while (start < size) {
+        int end = start;
+        int zeroes = 0;
+        while (end < size) {
+            int length = SparseBlockSize - static_cast<int>((position + end) % SparseBlockSize);
+            length = std::min(length, size - end);
+            bool zero = isAllZero(buffer + end, length);
+            if (end > start && zero != (zeroes > 0)) {
+                break;
+            }
+            if (zero) {
+                zeroes += length;
+            }
+            end += length;
+        }
+
+        if (zeroes == 0) {
+            int bytes = write(buffer + start, end - start);
+            written += bytes;
+            if (bytes != end - start) {
+                return written;
+            }
+        } else {
+            if (punchHoles) {
+                // Zeroes passed in pieces smaller than a block can only be deallocated when put together.
+                if (d_holeLength > 0 && d_holeOffset + d_holeLength != position + start && !punchHole()) {
+                    return written;
+                }
+                if (d_holeLength == 0) {
+                    d_holeOffset = position + start;
+                }
+                d_holeLength += zeroes;
+            }
+            seek(position + end, SEEK_FROM_BEGIN);
+            written += zeroes;
+        }
+        start = end;
+    }
+    return written;
+}
+
+bool File::punchHole()
+{
+    if (d_holeLength == 0) {
+        return true;
+    }
+    int64_t offset = d_holeOffset;
+    int64_t length = d_holeLength;
+    d_holeLength = 0;
+
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (::fallocate(d_handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+        return true;
+    }
+#endif
+
+    // The old data can't be deallocated, so it must be overwritten.
+    static const char zeroes[SparseBlockSize] = { 0 };
+    while (length > 0) {
+        int bytes = static_cast<int>(std::min<int64_t>(length, SparseBlockSize));
+        if (::pwrite(d_handle, zeroes, bytes, offset) != bytes) {
+            LOG_ERROR(RSYNC_FILE) << "Error writing '" << d_path << "': " << strerror(errno) << LOG_END
+            return false;
+        }
+        offset += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
 int64_t File::seek(int64_t offset, int method)
 {
     if (d_handle == InvalidHandle) {
@@ -220,12 +524,105 @@ int64_t File::seek(int64_t offset, int method)
 #endif
 }
 
+int64_t File::copyRange(File *source, int64_t offset, int64_t length)
+{
+    if (d_handle == InvalidHandle || !source->isValid() || !punchHole()) {
+        return 0;
+    }
+    int64_t position = seek(0, SEEK_FROM_CURRENT);
+    if (position < 0) {
+        return 0;
+    }
+
+    int64_t copied = 0;
+
+#if defined(__linux__) && defined(FICLONERANGE)
+    // A range can only be cloned in whole filesystem blocks, so the two ranges must be aligned the same way.  The
+    // unaligned ends are copied instead.
+    struct stat st;
+    if (::fstat(d_handle, &st) == 0 && st.st_blksize > 0 && offset % st.st_blksize == position % st.st_blksize) {
+        int64_t alignment = st.st_blksize;
+        int64_t head = (alignment - offset % alignment) % alignment;
+        if (head < length) {
+            copied = copyFileRange(source->d_handle, offset, d_handle, position, head);
+            int64_t cloneLength = (length - head) / alignment * alignment;
+            if (copied == head && cloneLength > 0) {
+                struct file_clone_range range;
+                range.src_fd = source->d_handle;
+                range.src_offset = offset + head;
+                range.src_length = cloneLength;
+                range.dest_offset = position + head;
+                if (::ioctl(d_handle, FICLONERANGE, &range) == 0) {
+                    copied += cloneLength;
+                }
+            }
+        }
+    }
+#endif
+
+    if (copied < length) {
+        copied += copyFileRange(source->d_handle, offset + copied, d_handle, position + copied, length - copied);
+    }
+
+    seek(position + copied, SEEK_FROM_BEGIN);
+    return copied;
+}
+
+bool File::truncate(int64_t size)
+{
+    if (d_handle == InvalidHandle || !punchHole()) {
+        return false;
+    }
+    if (::ftruncate(d_handle, size) != 0) {
+        LOG_ERROR(RSYNC_FILE) << "Failed to change the size of '" << d_path << "' to " << size << ": "
+                              << strerror(errno) << LOG_END
+        return false;
+    }
+    return true;
+}
+
+bool File::allocate(int64_t size)
+{
+    if (d_handle == InvalidHandle) {
+        return false;
+    }
+    if (size <= 0) {
+        return true;
+    }
+
+    int rc = 0;
+#if defined(__linux__)
+    rc = ::fallocate(d_handle, FALLOC_FL_KEEP_SIZE, 0, size) == 0 ? 0 : errno;
+#elif defined(__APPLE__)
+    // Try to get contiguous space first.
+    fstore_t store = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, 0, 0 };
+    struct stat st;
+    if (::fstat(d_handle, &st) == 0 && st.st_size < size) {
+        store.fst_length = size - st.st_size;
+        if (::fcntl(d_handle, F_PREALLOCATE, &store) == -1) {
+            store.fst_flags = F_ALLOCATEALL;
+            rc = ::fcntl(d_handle, F_PREALLOCATE, &store) == -1 ? errno : 0;
+        }
+    }
+#endif
+
+    // Filesystems that can't allocate space in advance are not an error.
+    if (rc != 0 && rc != EOPNOTSUPP && rc != ENOSYS && rc != EINVAL) {
+        LOG_ERROR(RSYNC_FILE) << "Failed to allocate " << size << " bytes for '" << d_path << "': "
+                              << strerror(rc) << LOG_END
+        return false;
+    }
+    return true;
+}
+
 void File::close()
 {
     if (d_handle == InvalidHandle) {
         return;
     }
+    punchHole();
     ::close(d_handle);
+    d_handle = InvalidHandle;
 }
 
 } // close namespace rsync
@@ -55,15 +55,48 @@ public:
     // Open a file for read or write.  If an error occurs, report it in log if 'reportError' is true.
     bool open(const char *fullPath, bool forWrite, bool reportError);
 
+    // Open a file for both read and write, creating it if it doesn't exist.  Unlike 'open()' the existing content is
+    // kept.  If an error occurs, report it in log if 'reportError' is true.
+    bool openForUpdate(const char *fullPath, bool reportError);
+
+    // Open a new file for write in 'directory' without giving it a name, so that it can't be seen until 'link()' is
+    // called.  Return false if the platform or the filesystem doesn't support such files.
+    bool openAnonymous(const char *directory);
+
+    // Give the name 'fullPath', which must not exist, to a file opened by 'openAnonymous()'.  If an error occurs,
+    // report it in log if 'reportError' is true.
+    bool link(const char *fullPath, bool reportError);
+
     // Read 'size' bytes from the file into 'buffer'.
     int read(char *buffer, int size);
 
     // Write 'size' bytes from 'buffer' into the file.
     int write(const char *buffer, int size);
 
+    // Same as 'write()', except that zeroes are skipped over rather than written, leaving holes in the file.  If
+    // 'punchHoles' is true the skipped ranges are deallocated, for files that may already have data there;
+    // otherwise they are assumed to be holes already.  Consecutive ranges of zeroes are deallocated together, before
+    // anything other than reading elsewhere is done to the file.  As nothing is written for zeroes at the end of the
+    // file, 'truncate()' must be called to set the final size.
+    int writeSparse(const char *buffer, int size, bool punchHoles);
+
     // Move the current read/write position.
     int64_t seek(int64_t offset, int method);
 
+    // Copy 'length' bytes at 'offset' of 'source' to the current position of this file without passing them through
+    // user space, sharing the data blocks between the two files where the filesystem supports it.  The current
+    // position is moved past the bytes copied.  Return the number of bytes copied, which is less than 'length' if
+    // the rest can't be copied this way and must be written instead.
+    int64_t copyRange(File *source, int64_t offset, int64_t length);
+
+    // Change the size of the file to 'size', discarding anything after it.  The current position is not changed.
+    bool truncate(int64_t size);
+
+    // Reserve disk space for the first 'size' bytes of the file without changing its size, so that writing them
+    // can't run out of space.  Return false if the space can't be reserved; if the filesystem can't reserve space in
+    // advance, do nothing and return true.  Space reserved past the end of the file is released by 'truncate()'.
+    bool allocate(int64_t size);
+
     // Close the file
     void close();
 
@@ -78,8 +111,14 @@ private:
     File(const File&);
     File operator=(const File&);
 
+    // Deallocate the range of zeroes skipped by 'writeSparse()' but not yet deallocated, or write the zeroes if it
+    // can't be.  Return false on error.
+    bool punchHole();
+
     Handle d_handle;
     std::string d_path;
+    int64_t d_holeOffset;          // the offset of the range of zeroes yet to be deallocated
+    int64_t d_holeLength;          // the length of the range of zeroes yet to be deallocated; 0 if none
 };
 
 } // close namespace rsync
@@ -0,0 +1,164 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#include <rsync/rsync_filefinalizer.h>
+
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_log.h>
+#include <rsync/rsync_pathutil.h>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// The most files waiting to be finished, each holding a file descriptor.
+const unsigned int MaxPendingFiles = 64;
+
+// Prepended to the name of the destination to name an anonymous file that can't be linked to the destination
+// directly.  Names starting with '.acrosync' are never listed, so the file is hidden if it is left behind.
+const char *AnonymousFilePrefix = ".acrosync-tmp-";
+
+} // unnamed namespace
+
+FileFinalizer::FileFinalizer(int numberOfThreads)
+    : d_jobs()
+    , d_busy(0)
+    , d_failures()
+    , d_stopping(false)
+{
+    for (int i = 0; i < numberOfThreads; ++i) {
+        d_workers.push_back(std::thread(&FileFinalizer::run, this));
+    }
+}
+
+FileFinalizer::~FileFinalizer()
+{
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_jobAvailable.notify_all();
+    for (unsigned int i = 0; i < d_workers.size(); ++i) {
+        d_workers[i].join();
+    }
+}
+
+bool FileFinalizer::finalize(File *file, const std::string &temporaryFile, const std::string &destination,
+                             int64_t modifiedTime, uint32_t mode)
+{
+    std::string path = temporaryFile;
+    bool named = true;
+    if (path.empty()) {
+        // A file can't be linked over an existing one, so it is linked to a temporary name first in that case.
+        path = destination;
+        if (PathUtil::exists(path.c_str())) {
+            path = PathUtil::join(PathUtil::getDirectory(destination.c_str()).c_str(),
+                                  (AnonymousFilePrefix + PathUtil::getBase(destination.c_str())).c_str());
+            PathUtil::remove(path.c_str(), false);
+        }
+        named = file->link(path.c_str(), true);
+    }
+
+    file->close();
+    delete file;
+
+    if (!named) {
+        LOG_ERROR(RSYNC_FINALIZE) << "Failed to save the file downloaded for '" << destination << "'" << LOG_END
+        return false;
+    }
+
+    if (path != destination && !PathUtil::rename(path.c_str(), destination.c_str(), true)) {
+        PathUtil::remove(path.c_str(), false);
+        LOG_ERROR(RSYNC_FINALIZE) << "Failed to save the file downloaded for '" << destination << "'" << LOG_END
+        return false;
+    }
+
+    PathUtil::setModifiedTime(destination.c_str(), modifiedTime);
+    PathUtil::setMode(destination.c_str(), mode);
+    return true;
+}
+
+void FileFinalizer::add(File *file, const std::string &temporaryFile, const std::string &destination,
+                        int64_t modifiedTime, uint32_t mode)
+{
+    if (d_workers.empty()) {
+        if (!finalize(file, temporaryFile, destination, modifiedTime, mode)) {
+            d_failures.push_back(destination);
+        }
+        return;
+    }
+
+    Job job = { file, temporaryFile, destination, modifiedTime, mode };
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        while (d_jobs.size() >= MaxPendingFiles) {
+            d_jobDone.wait(lock);
+        }
+        d_jobs.push_back(job);
+    }
+    d_jobAvailable.notify_one();
+}
+
+void FileFinalizer::wait(std::vector<std::string> *failures)
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (!d_jobs.empty() || d_busy > 0) {
+        d_jobDone.wait(lock);
+    }
+    failures->insert(failures->end(), d_failures.begin(), d_failures.end());
+    d_failures.clear();
+}
+
+void FileFinalizer::run()
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (true) {
+        while (d_jobs.empty() && !d_stopping) {
+            d_jobAvailable.wait(lock);
+        }
+
+        // Files still waiting are finished before exiting, as they have been downloaded completely.
+        if (d_jobs.empty()) {
+            return;
+        }
+
+        Job job = d_jobs.front();
+        d_jobs.pop_front();
+        ++d_busy;
+        lock.unlock();
+
+        bool finalized = false;
+        try {
+            finalized = finalize(job.d_file, job.d_temporaryFile, job.d_destination, job.d_modifiedTime,
+                                 job.d_mode);
+        } catch (Exception&) {
+            // The error has already been logged.
+        }
+
+        lock.lock();
+        --d_busy;
+        if (!finalized) {
+            d_failures.push_back(job.d_destination);
+        }
+        d_jobDone.notify_all();
+    }
+}
+
+} // close namespace rsync
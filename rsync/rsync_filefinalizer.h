@@ -0,0 +1,97 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#ifndef INCLUDED_RSYNC_FILEFINALIZER_H
+#define INCLUDED_RSYNC_FILEFINALIZER_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rsync
+{
+
+class File;
+
+// This class finishes off downloaded files on a pool of worker threads, so that the thread receiving the next file
+// doesn't wait for closing, renaming and setting the attributes of the last one, which can take a while on some
+// filesystems.  A file is given its final name only after it has been closed, so a destination never holds a
+// partial file.
+//
+// The number of files waiting to be finished is limited, so that they don't use up all open file descriptors.
+class FileFinalizer
+{
+public:
+
+    // Create a finalizer with 'numberOfThreads' workers.  If 'numberOfThreads' is 0, files are finished by the
+    // thread adding them.
+    explicit FileFinalizer(int numberOfThreads);
+
+    // Finish all files added and wait for the workers to exit.
+    ~FileFinalizer();
+
+    // Close 'file', move it to 'destination', replacing any existing file, and set its modified time and mode.  If
+    // 'temporaryFile' is empty 'file' must have been opened by 'File::openAnonymous()'; otherwise it is the path
+    // 'file' was opened with.  'file' is deleted.  Return false and report the error in log if the file can't be
+    // moved, in which case it is removed.
+    static bool finalize(File *file, const std::string &temporaryFile, const std::string &destination,
+                         int64_t modifiedTime, uint32_t mode);
+
+    // Finish 'file' as by 'finalize()', taking ownership of it.  Wait if too many files are waiting to be finished.
+    void add(File *file, const std::string &temporaryFile, const std::string &destination, int64_t modifiedTime,
+             uint32_t mode);
+
+    // Wait until all files added have been finished, and append the destinations of those that failed to
+    // 'failures'.
+    void wait(std::vector<std::string> *failures);
+
+private:
+    // NOT IMPLEMENTED
+    FileFinalizer(const FileFinalizer&);
+    FileFinalizer& operator=(const FileFinalizer&);
+
+    struct Job
+    {
+        File *d_file;                  // the file to be finished
+        std::string d_temporaryFile;   // the path of the file; empty if it has none yet
+        std::string d_destination;     // the final path of the file
+        int64_t d_modifiedTime;        // the modified time to be set
+        uint32_t d_mode;               // the mode to be set
+    };
+
+    // The loop run by each worker.
+    void run();
+
+    std::deque<Job> d_jobs;        // files waiting to be finished
+    int d_busy;                    // the number of files being finished by the workers
+    std::vector<std::string> d_failures;       // destinations of files that failed since the last 'wait()'
+    bool d_stopping;               // set when the workers must exit
+
+    std::mutex d_mutex;            // protects all members above
+    std::condition_variable d_jobAvailable;    // signalled when a file is added
+    std::condition_variable d_jobDone;         // signalled when a file is finished
+
+    std::vector<std::thread> d_workers;        // the worker threads
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_FILEFINALIZER_H
@@ -0,0 +1,384 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#include <rsync/rsync_filelist.h>
+
+#include <rsync/rsync_entry.h>
+#include <rsync/rsync_log.h>
+
+#include <algorithm>
+
+#include <cstring>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// A path split into its directory and its last component, which are indexed as if they were one string.
+struct SplitPath
+{
+    const char *d_directory;       // the directory, without a null
+    size_t d_directoryLength;      // the length of 'd_directory'
+    const char *d_name;            // the last component, followed by a null
+
+    unsigned char operator[](size_t i) const
+    {
+        return i < d_directoryLength ? d_directory[i] : d_name[i - d_directoryLength];
+    }
+};
+
+// A path that entries are sorted by before their names: the path of a directory for the directory itself, and the
+// directory of any other entry.
+struct SortGroup
+{
+    SplitPath d_path;              // the path, which ends with a '/' unless it is empty
+    uint32_t d_owner;              // the index of the directory in the list of directories, or the number of
+                                   // directories plus the index of the entry
+};
+
+// Compare sort groups by their paths as plain strings.
+bool compareGroups(const SortGroup &lhs, const SortGroup &rhs)
+{
+    size_t i = 0;
+    while (lhs.d_path[i] == rhs.d_path[i] && lhs.d_path[i] != 0) {
+        ++i;
+    }
+    return lhs.d_path[i] < rhs.d_path[i];
+}
+
+// Compare entries of the same directory by their names.
+struct NameComparator
+{
+    const char *d_strings;
+    const uint32_t *d_names;
+
+    bool operator()(uint32_t lhs, uint32_t rhs) const
+    {
+        return ::strcmp(d_strings + d_names[lhs], d_strings + d_names[rhs]) < 0;
+    }
+};
+
+// Rearrange the elements of 'column' from 'begin' so that they are in 'order'.
+template <typename T>
+void reorder(std::vector<T> *column, const std::vector<uint32_t> &order, int begin)
+{
+    std::vector<T> sorted;
+    sorted.reserve(order.size());
+    for (unsigned int i = 0; i < order.size(); ++i) {
+        sorted.push_back((*column)[order[i]]);
+    }
+    std::copy(sorted.begin(), sorted.end(), column->begin() + begin);
+}
+
+// The FNV-1a hash of the 'length' bytes at 'data'.
+uint32_t hash(const char *data, size_t length)
+{
+    uint32_t value = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        value ^= static_cast<unsigned char>(data[i]);
+        value *= 16777619u;
+    }
+    return value;
+}
+
+} // unnamed namespace
+
+FileList::FileList()
+    : d_strings()
+    , d_directoryOffsets()
+    , d_directoryLengths()
+    , d_directoryHashes()
+    , d_directories()
+    , d_names()
+    , d_modes()
+    , d_sizes()
+    , d_times()
+{
+}
+
+int FileList::add(const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode, const char *symlink)
+{
+    size_t length = ::strlen(path);
+    bool hasSlash = length > 0 && path[length - 1] == '/';
+
+    // The directory is everything up to the last '/' that is not the trailing one.
+    size_t split = hasSlash ? length - 1 : length;
+    while (split > 0 && path[split - 1] != '/') {
+        --split;
+    }
+
+    if (isDirectory) {
+        size = 0;
+        mode |= Entry::IS_DIR;
+    }
+
+    d_directories.push_back(findDirectory(path, static_cast<uint32_t>(split)));
+    d_names.push_back(addString(path + split, length - split));
+    if (isDirectory && !hasSlash) {
+        // Turn the null into the trailing '/'.
+        d_strings.back() = '/';
+        d_strings.push_back(0);
+    }
+    d_modes.push_back(mode);
+    d_sizes.push_back(size);
+    d_times.push_back(time);
+
+    int index = static_cast<int>(d_modes.size()) - 1;
+    if (isLink(index)) {
+        addString(symlink ? symlink : "", symlink ? ::strlen(symlink) : 0);
+    }
+    return index;
+}
+
+int FileList::add(const Entry &entry)
+{
+    return add(entry.getPath(), entry.isDirectory(), entry.getSize(), entry.getTime(), entry.getMode(),
+               entry.isLink() ? entry.getSymlink() : 0);
+}
+
+void FileList::sort(int begin)
+{
+    if (begin >= size() || isSorted(begin)) {
+        return;
+    }
+
+    // Entries are ordered first by their groups, then with a directory ahead of the rest of its group, and the rest
+    // by their names.  This is the order of 'compare()': the paths of groups all end with '/', so comparing them as
+    // strings compares them component by component, and within a group, files come before the directories under it,
+    // each of which starts a group of its own.  Only the paths of groups need to be compared, and then only names
+    // within each directory.  Note that whether an entry counts as a directory depends on its path, as in 'compare()'.
+    uint32_t numberOfDirectories = static_cast<uint32_t>(d_directoryOffsets.size());
+    std::vector<SortGroup> groups;
+    groups.reserve(numberOfDirectories);
+    for (uint32_t i = 0; i < numberOfDirectories; ++i) {
+        SortGroup group = { { &d_strings[d_directoryOffsets[i]], d_directoryLengths[i],
+                              &d_strings[d_directoryOffsets[i] + d_directoryLengths[i]] }, i };
+        groups.push_back(group);
+    }
+    std::vector<bool> isDirectoryName(size() - begin);
+    for (int i = begin; i < size(); ++i) {
+        const char *name = &d_strings[d_names[i]];
+        size_t length = ::strlen(name);
+        if (length > 0 && name[length - 1] == '/') {
+            isDirectoryName[i - begin] = true;
+            SortGroup group = { { &d_strings[d_directoryOffsets[d_directories[i]]],
+                                  d_directoryLengths[d_directories[i]], name }, numberOfDirectories + i - begin };
+            groups.push_back(group);
+        }
+    }
+    std::sort(groups.begin(), groups.end(), compareGroups);
+
+    // Directories and entries with the same path share a rank.  The key of an entry is twice the rank of its group,
+    // plus one if it isn't the directory of the group.
+    std::vector<uint32_t> keys(size() - begin);
+    std::vector<uint32_t> directoryRanks(numberOfDirectories);
+    uint32_t rank = 0;
+    for (unsigned int i = 0; i < groups.size(); ++i) {
+        if (i > 0 && compareGroups(groups[i - 1], groups[i])) {
+            ++rank;
+        }
+        if (groups[i].d_owner < numberOfDirectories) {
+            directoryRanks[groups[i].d_owner] = rank;
+        } else {
+            keys[groups[i].d_owner - numberOfDirectories] = 2 * rank;
+        }
+    }
+    for (int i = begin; i < size(); ++i) {
+        if (!isDirectoryName[i - begin]) {
+            keys[i - begin] = 2 * directoryRanks[d_directories[i]] + 1;
+        }
+    }
+
+    // A counting sort by the keys, followed by sorting the names of the entries that have the same key.
+    std::vector<uint32_t> counts(2 * rank + 3, 0);
+    for (unsigned int i = 0; i < keys.size(); ++i) {
+        ++counts[keys[i] + 1];
+    }
+    for (unsigned int i = 1; i < counts.size(); ++i) {
+        counts[i] += counts[i - 1];
+    }
+    std::vector<uint32_t> order(keys.size());
+    for (unsigned int i = 0; i < keys.size(); ++i) {
+        order[counts[keys[i]]++] = begin + i;
+    }
+
+    NameComparator comparator = { &d_strings[0], &d_names[0] };
+    for (unsigned int i = 0; i < order.size(); ) {
+        unsigned int j = i + 1;
+        while (j < order.size() && keys[order[j] - begin] == keys[order[i] - begin]) {
+            ++j;
+        }
+        if (j - i > 1) {
+            std::sort(order.begin() + i, order.begin() + j, comparator);
+        }
+        i = j;
+    }
+
+    reorder(&d_directories, order, begin);
+    reorder(&d_names, order, begin);
+    reorder(&d_modes, order, begin);
+    reorder(&d_sizes, order, begin);
+    reorder(&d_times, order, begin);
+}
+
+std::string FileList::getPath(int index) const
+{
+    uint32_t directory = d_directories[index];
+    std::string path(&d_strings[d_directoryOffsets[directory]], d_directoryLengths[directory]);
+    path += &d_strings[d_names[index]];
+    return path;
+}
+
+const char *FileList::getSymlink(int index) const
+{
+    const char *name = &d_strings[d_names[index]];
+    return name + ::strlen(name) + 1;
+}
+
+bool FileList::isDirectory(int index) const
+{
+    return (d_modes[index] & Entry::IS_DIR) && !(d_modes[index] & Entry::IS_FILE);
+}
+
+bool FileList::isReadable(int index) const
+{
+    return d_modes[index] & Entry::IS_READABLE;
+}
+
+bool FileList::isLink(int index) const
+{
+    return (d_modes[index] & Entry::IS_LINK) && (d_modes[index] & Entry::IS_FILE);
+}
+
+bool FileList::isRegular(int index) const
+{
+    return (d_modes[index] & Entry::IS_FILE) && !(d_modes[index] & Entry::IS_DIR);
+}
+
+bool FileList::isOlderThan(int index, const FileList &other, int otherIndex) const
+{
+    return Entry::isOlder(d_times[index], other.d_times[otherIndex]);
+}
+
+bool FileList::contains(int directory, int index) const
+{
+    SplitPath outer = { &d_strings[d_directoryOffsets[d_directories[directory]]],
+                        d_directoryLengths[d_directories[directory]], &d_strings[d_names[directory]] };
+    SplitPath inner = { &d_strings[d_directoryOffsets[d_directories[index]]],
+                        d_directoryLengths[d_directories[index]], &d_strings[d_names[index]] };
+    for (size_t i = 0; outer[i] != 0; ++i) {
+        if (inner[i] != outer[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FileList::compare(const FileList &lhs, int lhsIndex, const FileList &rhs, int rhsIndex)
+{
+    // This is 'Entry::compareGlobally()' on split paths.
+    uint32_t lhsDirectory = lhs.d_directories[lhsIndex];
+    uint32_t rhsDirectory = rhs.d_directories[rhsIndex];
+    SplitPath p1 = { &lhs.d_strings[lhs.d_directoryOffsets[lhsDirectory]], lhs.d_directoryLengths[lhsDirectory],
+                     &lhs.d_strings[lhs.d_names[lhsIndex]] };
+    SplitPath p2 = { &rhs.d_strings[rhs.d_directoryOffsets[rhsDirectory]], rhs.d_directoryLengths[rhsDirectory],
+                     &rhs.d_strings[rhs.d_names[rhsIndex]] };
+
+    // Entries in the same directory differ only in their last components.
+    size_t i = 0;
+    if (&lhs == &rhs && lhsDirectory == rhsDirectory) {
+        i = p1.d_directoryLength;
+    }
+
+    while (p1[i] == p2[i]) {
+        if (p1[i] == 0) {
+            return false;
+        }
+        ++i;
+    }
+
+    size_t i3 = i;
+    for (; p1[i3] != 0 && p1[i3] != '/'; ++i3) {}
+    size_t i4 = i;
+    for (; p2[i4] != 0 && p2[i4] != '/'; ++i4) {}
+
+    if (p1[i] < p2[i]) {
+        if (p1[i] == 0 && i > 0 && p1[i - 1] == '/') {
+            return true;
+        }
+        if (p1[i3] == '/' && p2[i4] != '/') {
+            return false;
+        } else {
+            return true;
+        }
+    } else {
+        if (p2[i] == 0 && i > 0 && p2[i - 1] == '/') {
+            return false;
+        }
+        if (p2[i4] == '/' && p1[i3] != '/') {
+            return true;
+        } else {
+            return false;
+        }
+    }
+}
+
+bool FileList::isSorted(int begin) const
+{
+    for (int i = begin + 1; i < size(); ++i) {
+        if (compare(*this, i, *this, i - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t FileList::findDirectory(const char *path, uint32_t length)
+{
+    uint32_t value = hash(path, length);
+    typedef std::unordered_multimap<uint32_t, uint32_t>::const_iterator Iterator;
+    std::pair<Iterator, Iterator> range = d_directoryHashes.equal_range(value);
+    for (Iterator iter = range.first; iter != range.second; ++iter) {
+        uint32_t directory = iter->second;
+        if (d_directoryLengths[directory] == length &&
+            ::memcmp(&d_strings[d_directoryOffsets[directory]], path, length) == 0) {
+            return directory;
+        }
+    }
+
+    uint32_t directory = static_cast<uint32_t>(d_directoryOffsets.size());
+    d_directoryOffsets.push_back(addString(path, length));
+    d_directoryLengths.push_back(length);
+    d_directoryHashes.insert(std::make_pair(value, directory));
+    return directory;
+}
+
+uint32_t FileList::addString(const char *string, size_t length)
+{
+    if (d_strings.size() + length + 1 > 0xFFFFFFFFu) {
+        LOG_FATAL(RSYNC_FILELIST) << "Too many paths in the file list" << LOG_END
+    }
+    uint32_t offset = static_cast<uint32_t>(d_strings.size());
+    d_strings.insert(d_strings.end(), string, string + length);
+    d_strings.push_back(0);
+    return offset;
+}
+
+} // close namespace rsync
@@ -0,0 +1,136 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#ifndef INCLUDED_RSYNC_FILELIST_H
+#define INCLUDED_RSYNC_FILELIST_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace rsync
+{
+
+class Entry;
+
+// This class holds a file list in a compact form.  Rather than an object for each entry, there is an array for each
+// attribute, indexed by the position of the entry in the list.  The path of an entry is split into the directory,
+// which is stored only once for all entries in it, and the last component; paths, directories, and symlinks are all
+// kept in a single buffer.  Paths follow the same conventions as those of 'Entry', with a trailing '/' for
+// directories.  The index of an entry doesn't change unless the list is sorted.
+class FileList
+{
+public:
+
+    // Create an empty list.
+    FileList();
+
+    // Append an entry, as by the 'Entry' constructor followed by 'Entry::normalizePath()'.  'symlink' is ignored
+    // unless 'mode' indicates a symlink.  Return the index of the entry.
+    int add(const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode, const char *symlink = 0);
+
+    // Append a copy of 'entry'.  Return the index of the entry.
+    int add(const Entry &entry);
+
+    // Sort the entries from 'begin' to the end as by 'Entry::compareGlobally()'.  Entries that are already in order
+    // only take a single pass to check.  Otherwise, whole paths are only compared for directories; other entries are
+    // placed by a counting sort and compared by their names within each directory.
+    void sort(int begin);
+
+    // Return the number of entries.
+    int size() const
+    {
+        return static_cast<int>(d_modes.size());
+    }
+
+    // Return the path of the entry at 'index'.
+    std::string getPath(int index) const;
+
+    // Return the symlink of the entry at 'index', which must be a symlink.
+    const char *getSymlink(int index) const;
+
+    int64_t getSize(int index) const
+    {
+        return d_sizes[index];
+    }
+
+    void addSize(int index, int64_t size)
+    {
+        d_sizes[index] += size;
+    }
+
+    int64_t getTime(int index) const
+    {
+        return d_times[index];
+    }
+
+    uint32_t getMode(int index) const
+    {
+        return d_modes[index];
+    }
+
+    bool isDirectory(int index) const;
+
+    bool isReadable(int index) const;
+
+    bool isLink(int index) const;
+
+    bool isRegular(int index) const;
+
+    // Return true if the entry at 'index' is older than the entry at 'otherIndex' of 'other', as by
+    // 'Entry::isOlderThan()'.
+    bool isOlderThan(int index, const FileList &other, int otherIndex) const;
+
+    // Return true if the entry at 'index' is the directory at 'directory' or is under it, as by 'Entry::contains()'.
+    bool contains(int directory, int index) const;
+
+    // Compare the entry at 'lhsIndex' of 'lhs' with the entry at 'rhsIndex' of 'rhs' as by
+    // 'Entry::compareGlobally()'.
+    static bool compare(const FileList &lhs, int lhsIndex, const FileList &rhs, int rhsIndex);
+
+private:
+    // NOT IMPLEMENTED
+    FileList(const FileList&);
+    FileList& operator=(const FileList&);
+
+    // Return true if the entries from 'begin' to the end are already in the order of 'sort()'.
+    bool isSorted(int begin) const;
+
+    // Return the index of the directory of 'length' bytes at 'path', adding it if it is new.
+    uint32_t findDirectory(const char *path, uint32_t length);
+
+    // Append 'length' bytes at 'string' and a terminating null to 'd_strings'.  Return the offset.
+    uint32_t addString(const char *string, size_t length);
+
+    std::vector<char> d_strings;               // directories, names, and symlinks, each followed by a null
+
+    std::vector<uint32_t> d_directoryOffsets;  // the offset of each directory in 'd_strings'
+    std::vector<uint32_t> d_directoryLengths;  // the length of each directory, including the trailing '/'
+    std::unordered_multimap<uint32_t, uint32_t> d_directoryHashes;  // maps hashes of directories to their indices
+
+    // One element for each entry.  The symlink of a symlink follows its name in 'd_strings'.
+    std::vector<uint32_t> d_directories;       // the index of the directory of the entry
+    std::vector<uint32_t> d_names;             // the offset of the last path component in 'd_strings'
+    std::vector<uint32_t> d_modes;             // file modes
+    std::vector<int64_t> d_sizes;              // file sizes; 0 for directories until sizes are added
+    std::vector<int64_t> d_times;              // last modified times
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_FILELIST_H
@@ -0,0 +1,247 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_filewriter.h>
+
+#include <rsync/rsync_file.h>
+
+#include <algorithm>
+
+#include <cstring>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// The size of each buffer in the pool.
+const int BufferSize = 256 * 1024;
+
+// The largest number of bytes passed to a single 'File::write()' call.
+const int MaxWriteSize = 1 << 30;
+
+} // unnamed namespace
+
+FileWriter::FileWriter(int64_t memoryBudget)
+    : d_file(0)
+    , d_sparse(false)
+    , d_punchHoles(false)
+    , d_direct(true)
+    , d_failed(false)
+    , d_current(0)
+    , d_currentLength(0)
+    , d_buffers()
+    , d_freeBuffers()
+    , d_jobs()
+    , d_busy(false)
+    , d_stopping(false)
+{
+    if (memoryBudget > 0) {
+        int64_t count = std::max<int64_t>(memoryBudget / BufferSize, 2);
+        for (int64_t i = 0; i < count; ++i) {
+            d_buffers.push_back(new std::vector<char>(BufferSize));
+        }
+        d_freeBuffers = d_buffers;
+        d_writer = std::thread(&FileWriter::run, this);
+    }
+}
+
+FileWriter::~FileWriter()
+{
+    abort();
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_jobAvailable.notify_all();
+    if (d_writer.joinable()) {
+        d_writer.join();
+    }
+    for (unsigned int i = 0; i < d_buffers.size(); ++i) {
+        delete d_buffers[i];
+    }
+}
+
+void FileWriter::start(File *file, bool sparse, bool punchHoles, bool direct)
+{
+    abort();
+
+    std::unique_lock<std::mutex> lock(d_mutex);
+    d_file = file;
+    d_sparse = sparse;
+    d_punchHoles = punchHoles;
+    d_direct = direct || !d_writer.joinable();
+    d_failed = false;
+}
+
+void FileWriter::write(const char *data, int size)
+{
+    if (size <= 0) {
+        return;
+    }
+
+    if (d_direct) {
+        Job job = { 0, data, size, 0, 0 };
+        if (!perform(job)) {
+            d_failed = true;
+        }
+        return;
+    }
+
+    // The buffer being filled belongs to this thread, so it is filled without holding the lock.
+    while (size > 0) {
+        if (!d_current) {
+            std::unique_lock<std::mutex> lock(d_mutex);
+            while (d_freeBuffers.empty()) {
+                d_jobDone.wait(lock);
+            }
+            d_current = d_freeBuffers.back();
+            d_freeBuffers.pop_back();
+            d_currentLength = 0;
+        }
+
+        int bytes = std::min(size, BufferSize - d_currentLength);
+        ::memcpy(&(*d_current)[d_currentLength], data, bytes);
+        d_currentLength += bytes;
+        data += bytes;
+        size -= bytes;
+
+        if (d_currentLength == BufferSize) {
+            std::unique_lock<std::mutex> lock(d_mutex);
+            submitBuffer(lock);
+        }
+    }
+}
+
+void FileWriter::copy(File *source, int64_t offset, int64_t length, const char *data)
+{
+    if (length <= 0) {
+        return;
+    }
+
+    Job job = { 0, data, length, source, offset };
+    if (d_direct) {
+        if (!perform(job)) {
+            d_failed = true;
+        }
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        submitBuffer(lock);
+        d_jobs.push_back(job);
+    }
+    d_jobAvailable.notify_one();
+}
+
+bool FileWriter::finish()
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    if (!d_direct) {
+        submitBuffer(lock);
+        while (!d_jobs.empty() || d_busy) {
+            d_jobDone.wait(lock);
+        }
+    }
+    return !d_failed;
+}
+
+void FileWriter::abort()
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    if (d_current) {
+        d_freeBuffers.push_back(d_current);
+        d_current = 0;
+    }
+    for (unsigned int i = 0; i < d_jobs.size(); ++i) {
+        if (d_jobs[i].d_buffer) {
+            d_freeBuffers.push_back(d_jobs[i].d_buffer);
+        }
+    }
+    d_jobs.clear();
+    while (d_busy) {
+        d_jobDone.wait(lock);
+    }
+    d_file = 0;
+}
+
+bool FileWriter::perform(const Job &job)
+{
+    // Copying in the kernel would allocate blocks of zeroes, so they have to be scanned for in sparse files.
+    int64_t written = 0;
+    if (job.d_source && !d_sparse) {
+        written = d_file->copyRange(job.d_source, job.d_offset, job.d_length);
+    }
+    while (written < job.d_length) {
+        int size = static_cast<int>(std::min<int64_t>(job.d_length - written, MaxWriteSize));
+        int bytes = d_sparse ? d_file->writeSparse(job.d_data + written, size, d_punchHoles)
+                             : d_file->write(job.d_data + written, size);
+        if (bytes != size) {
+            return false;
+        }
+        written += size;
+    }
+    return true;
+}
+
+void FileWriter::submitBuffer(std::unique_lock<std::mutex> & /* lock */)
+{
+    if (!d_current) {
+        return;
+    }
+    Job job = { d_current, &(*d_current)[0], d_currentLength, 0, 0 };
+    d_jobs.push_back(job);
+    d_current = 0;
+    d_currentLength = 0;
+    d_jobAvailable.notify_one();
+}
+
+void FileWriter::run()
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (true) {
+        while (d_jobs.empty() && !d_stopping) {
+            d_jobAvailable.wait(lock);
+        }
+        if (d_jobs.empty()) {
+            return;
+        }
+
+        Job job = d_jobs.front();
+        d_jobs.pop_front();
+        d_busy = true;
+
+        // After a failure the rest of the file is discarded.
+        bool failed = d_failed;
+        lock.unlock();
+        if (!failed && !perform(job)) {
+            failed = true;
+        }
+        lock.lock();
+
+        d_busy = false;
+        d_failed = failed;
+        if (job.d_buffer) {
+            d_freeBuffers.push_back(job.d_buffer);
+        }
+        d_jobDone.notify_all();
+    }
+}
+
+} // close namespace rsync
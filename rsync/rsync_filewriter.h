@@ -0,0 +1,115 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#ifndef INCLUDED_RSYNC_FILEWRITER_H
+#define INCLUDED_RSYNC_FILEWRITER_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rsync
+{
+
+class File;
+
+// This class writes the content of a file being downloaded, in order.  With a memory budget it writes on a thread
+// of its own, so the thread receiving the content from the network doesn't have to wait for the disk: data is
+// copied into a pool of buffers, and the caller only waits when all buffers are waiting to be written.  Without a
+// budget, or for a file started as 'direct', everything is written before each call returns.
+//
+// Nothing may be done to the file by anyone else between 'start()' and 'finish()' or 'abort()', except in direct
+// mode.
+class FileWriter
+{
+public:
+
+    // Create a writer that holds up to about 'memoryBudget' bytes waiting to be written.  If 'memoryBudget' is 0,
+    // there is no writer thread.
+    explicit FileWriter(int64_t memoryBudget);
+
+    // Discard anything not yet written and wait for the writer thread to exit.
+    ~FileWriter();
+
+    // Start writing to the current position of 'file'.  If 'sparse' is true, zeroes are skipped over as by
+    // 'File::writeSparse()' with 'punchHoles'.  If 'direct' is true, everything is written by the calling thread.
+    void start(File *file, bool sparse, bool punchHoles, bool direct);
+
+    // Write 'size' bytes from 'data'.  The data is copied if it is written later.
+    void write(const char *data, int size);
+
+    // Copy 'length' bytes at 'offset' of 'source', without passing them through user space if possible and if not
+    // writing sparsely; otherwise write them from 'data', which must stay valid until 'finish()' or 'abort()'
+    // returns.
+    void copy(File *source, int64_t offset, int64_t length, const char *data);
+
+    // Wait until everything has been written.  Return false if any write since 'start()' failed.
+    bool finish();
+
+    // Discard anything not yet written and wait for the write in progress, if any, to complete.
+    void abort();
+
+private:
+    // NOT IMPLEMENTED
+    FileWriter(const FileWriter&);
+    FileWriter& operator=(const FileWriter&);
+
+    struct Job
+    {
+        std::vector<char> *d_buffer;   // the buffer holding the data to be written; 0 for a copy
+        const char *d_data;            // the data to be written
+        int64_t d_length;              // the number of bytes to be written
+        File *d_source;                // the file to copy from; 0 if not a copy
+        int64_t d_offset;              // the offset in 'd_source' to copy from
+    };
+
+    // Write out 'job'.  Return false on error.
+    bool perform(const Job &job);
+
+    // Queue the buffer being filled, if any.  'lock' must be holding 'd_mutex'.
+    void submitBuffer(std::unique_lock<std::mutex> &lock);
+
+    // The loop run by the writer thread.
+    void run();
+
+    File *d_file;                  // the file being written; 0 if none
+    bool d_sparse;                 // whether to skip over zeroes
+    bool d_punchHoles;             // whether to deallocate the zeroes skipped over
+    bool d_direct;                 // whether to write in the calling thread
+    bool d_failed;                 // whether a write has failed since 'start()'
+
+    std::vector<char> *d_current;  // the buffer being filled by the caller; 0 if none
+    int d_currentLength;           // the number of bytes in 'd_current'
+
+    std::vector<std::vector<char>*> d_buffers;      // all buffers
+    std::vector<std::vector<char>*> d_freeBuffers;  // buffers not in use
+    std::deque<Job> d_jobs;        // jobs waiting to be written
+    bool d_busy;                   // whether the writer thread is performing a job
+    bool d_stopping;               // set when the writer thread must exit
+
+    std::mutex d_mutex;            // protects all members above used by both threads
+    std::condition_variable d_jobAvailable;    // signalled when a job is queued
+    std::condition_variable d_jobDone;         // signalled when a job is done or discarded
+
+    std::thread d_writer;          // the writer thread; not started without a memory budget
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_FILEWRITER_H
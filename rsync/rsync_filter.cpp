@@ -0,0 +1,297 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_filter.h>
+
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_log.h>
+
+#include <cstring>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// Return true if 'text' matches 'pattern' as by rsync's 'wildmatch()'.
+bool matchWildcard(const char *pattern, const char *text)
+{
+    for (; *pattern; ++pattern, ++text) {
+        if (*pattern == '*') {
+            // '**' may match '/' too.
+            bool matchSlash = pattern[1] == '*';
+            while (*pattern == '*') {
+                ++pattern;
+            }
+            if (!*pattern) {
+                return matchSlash || !::strchr(text, '/');
+            }
+            for (;; ++text) {
+                if (matchWildcard(pattern, text)) {
+                    return true;
+                }
+                if (!*text || (!matchSlash && *text == '/')) {
+                    return false;
+                }
+            }
+        }
+
+        unsigned char character = *text;
+        if (!character) {
+            return false;
+        }
+
+        if (*pattern == '?') {
+            if (character == '/') {
+                return false;
+            }
+            continue;
+        }
+
+        if (*pattern == '[') {
+            const char *p = pattern + 1;
+            bool negated = *p == '!' || *p == '^';
+            if (negated) {
+                ++p;
+            }
+            // A ']' right after the '[' or the negation is part of the set.
+            bool matched = false;
+            for (const char *first = p; *p && (p == first || *p != ']'); ++p) {
+                if (*p == '\\' && p[1]) {
+                    ++p;
+                }
+                unsigned char low = *p;
+                unsigned char high = low;
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    p += 2;
+                    if (*p == '\\' && p[1]) {
+                        ++p;
+                    }
+                    high = *p;
+                }
+                if (low <= character && character <= high) {
+                    matched = true;
+                }
+            }
+            if (!*p || matched == negated || character == '/') {
+                return false;
+            }
+            pattern = p;
+            continue;
+        }
+
+        if (*pattern == '\\' && pattern[1]) {
+            ++pattern;
+        }
+        if (static_cast<unsigned char>(*pattern) != character) {
+            return false;
+        }
+    }
+    return !*text;
+}
+
+} // unnamed namespace
+
+Filter::Filter()
+{
+}
+
+void Filter::add(const char *rule)
+{
+    std::string text(rule);
+    bool include = false;
+    std::string pattern;
+
+    if (text == "!" || text == "clear") {
+        clear();
+        return;
+    } else if (text.compare(0, 2, ". ") == 0 || text.compare(0, 6, "merge ") == 0) {
+        std::string path = text.substr(text[0] == '.' ? 2 : 6);
+        File file(path.c_str(), false, true);
+        if (!file.isValid()) {
+            LOG_FATAL(FILTER_MERGE) << "Failed to read the filter rules in '" << path << "'" << LOG_END
+        }
+
+        std::string content;
+        char buffer[4096];
+        int size;
+        while ((size = file.read(buffer, sizeof(buffer))) > 0) {
+            content.append(buffer, size);
+        }
+        if (size < 0) {
+            LOG_FATAL(FILTER_MERGE) << "Failed to read the filter rules in '" << path << "'" << LOG_END
+        }
+
+        size_t begin = 0;
+        while (begin < content.size()) {
+            size_t end = content.find('\n', begin);
+            if (end == std::string::npos) {
+                end = content.size();
+            }
+            std::string line = content.substr(begin, end - begin);
+            begin = end + 1;
+            if (line.size() && line[line.size() - 1] == '\r') {
+                line.erase(line.size() - 1);
+            }
+            if (line.empty() || line[0] == '#' || line[0] == ';') {
+                continue;
+            }
+            add(line.c_str());
+        }
+        return;
+    } else if (text.compare(0, 2, "+ ") == 0 || text.compare(0, 8, "include ") == 0) {
+        include = true;
+        pattern = text.substr(text[0] == '+' ? 2 : 8);
+    } else if (text.compare(0, 2, "- ") == 0 || text.compare(0, 8, "exclude ") == 0) {
+        pattern = text.substr(text[0] == '-' ? 2 : 8);
+    }
+
+    if (pattern.empty()) {
+        LOG_FATAL(FILTER_RULE) << "Unsupported filter rule '" << text << "'" << LOG_END
+    }
+
+    d_wireRules.push_back((include ? "+ " : "- ") + pattern);
+
+    Rule newRule;
+    newRule.d_include = include;
+    newRule.d_anchored = pattern[0] == '/';
+    if (newRule.d_anchored) {
+        pattern.erase(0, 1);
+    }
+    newRule.d_directoryOnly = pattern.size() && pattern[pattern.size() - 1] == '/';
+    if (newRule.d_directoryOnly) {
+        pattern.erase(pattern.size() - 1);
+    }
+    newRule.d_pattern = pattern;
+    newRule.d_wildcard = pattern.find_first_of("*?[") != std::string::npos;
+    newRule.d_doubleStar = pattern.find("**") != std::string::npos;
+    newRule.d_doubleStarPrefix = pattern.compare(0, 2, "**") == 0;
+    newRule.d_tripleStarSuffix = pattern.size() >= 4 && pattern.compare(pattern.size() - 4, 4, "/***") == 0;
+    newRule.d_slashes = 0;
+    for (unsigned int i = 0; i < pattern.size(); ++i) {
+        newRule.d_slashes += pattern[i] == '/';
+    }
+    d_rules.push_back(newRule);
+}
+
+void Filter::clear()
+{
+    d_rules.clear();
+    d_wireRules.clear();
+}
+
+bool Filter::isExcluded(const char *path, bool isDirectory) const
+{
+    if (d_rules.empty()) {
+        return false;
+    }
+    std::string name(path);
+    if (name.size() > 1 && name[name.size() - 1] == '/') {
+        name.erase(name.size() - 1);
+    }
+    for (unsigned int i = 0; i < d_rules.size(); ++i) {
+        if (matches(d_rules[i], name, isDirectory)) {
+            return !d_rules[i].d_include;
+        }
+    }
+    return false;
+}
+
+bool Filter::isPathExcluded(const char *path, bool isDirectory) const
+{
+    if (d_rules.empty()) {
+        return false;
+    }
+    size_t length = ::strlen(path);
+    for (size_t i = 1; i + 1 < length; ++i) {
+        if (path[i] == '/' && isExcluded(std::string(path, i).c_str(), true)) {
+            return true;
+        }
+    }
+    return isExcluded(path, isDirectory);
+}
+
+std::string Filter::escape(const char *path, bool isWildcardPattern)
+{
+    if (!isWildcardPattern && !::strpbrk(path, "*?[")) {
+        return path;
+    }
+    std::string pattern;
+    for (const char *p = path; *p; ++p) {
+        if (::strchr("*?[\\", *p)) {
+            pattern += '\\';
+        }
+        pattern += *p;
+    }
+    return pattern;
+}
+
+bool Filter::matches(const Rule &rule, const std::string &path, bool isDirectory)
+{
+    if (rule.d_directoryOnly && !isDirectory) {
+        return false;
+    }
+
+    // Patterns without a '/' only match the last component.
+    size_t begin = 0;
+    if (!rule.d_anchored && rule.d_slashes == 0 && !rule.d_doubleStar) {
+        size_t slash = path.rfind('/');
+        begin = slash == std::string::npos ? 0 : slash + 1;
+    }
+
+    if (!rule.d_wildcard) {
+        size_t length = path.size() - begin;
+        size_t patternLength = rule.d_pattern.size();
+        if (rule.d_anchored) {
+            return path.compare(begin, std::string::npos, rule.d_pattern) == 0;
+        }
+        return patternLength <= length && path.compare(path.size() - patternLength, patternLength, rule.d_pattern) == 0
+               && (patternLength == length || path[path.size() - patternLength - 1] == '/');
+    }
+
+    // A trailing '/***' matches the directory itself.
+    std::string text = path.substr(begin);
+    if (isDirectory && rule.d_tripleStarSuffix) {
+        text += "/";
+    }
+
+    if (!rule.d_anchored && rule.d_slashes && !rule.d_doubleStar) {
+        // Match the last 'd_slashes' + 1 components.
+        size_t start = path.size();
+        for (int slashes = 0; start > 0; --start) {
+            if (path[start - 1] == '/' && ++slashes > rule.d_slashes) {
+                break;
+            }
+        }
+        return matchWildcard(rule.d_pattern.c_str(), text.c_str() + start);
+    } else if (!rule.d_anchored && rule.d_doubleStar && !rule.d_doubleStarPrefix) {
+        // Match the path starting after any '/'.
+        size_t start = 0;
+        while (!matchWildcard(rule.d_pattern.c_str(), text.c_str() + start)) {
+            start = text.find('/', start);
+            if (start == std::string::npos) {
+                return false;
+            }
+            ++start;
+        }
+        return true;
+    }
+    return matchWildcard(rule.d_pattern.c_str(), text.c_str());
+}
+
+} // close namespace rsync
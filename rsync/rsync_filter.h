@@ -0,0 +1,104 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+
+#ifndef INCLUDED_RSYNC_FILTER_H
+#define INCLUDED_RSYNC_FILTER_H
+
+#include <string>
+#include <vector>
+
+namespace rsync
+{
+
+// This class holds an ordered list of include and exclude rules, as given to rsync with the '--filter' option, and
+// decides which paths they exclude the same way rsync does.  The first rule whose pattern matches a path decides
+// whether it is included or excluded; a path that matches no rule is included.  Paths are relative to the top of
+// the transfer, with or without the trailing '/' for directories.
+//
+// As in rsync, a pattern starting with '/' is matched against the whole path, a pattern ending with '/' only
+// matches directories, and any other pattern is matched against the last component of the path if it has no '/'
+// or '**' in it, or else against the end of the path starting after any '/'.  '*' matches anything but '/', '**'
+// matches anything, '?' matches any character but '/', '[...]' matches a character in the set, and a trailing
+// '/***' matches a directory as well as everything under it.
+class Filter
+{
+public:
+
+    // Create an empty list of rules.
+    Filter();
+
+    // Append a rule, which must be one of:
+    //   '+ PATTERN' or 'include PATTERN': include the paths that match 'PATTERN'
+    //   '- PATTERN' or 'exclude PATTERN': exclude the paths that match 'PATTERN'
+    //   '. FILE' or 'merge FILE': append the rules in the local file 'FILE', one per line, skipping empty lines and
+    //                             those starting with '#' or ';'
+    //   '!' or 'clear': remove all rules added so far
+    // Throw an exception if the rule isn't one of these or the file of a merge rule can't be read.
+    void add(const char *rule);
+
+    // Remove all rules.
+    void clear();
+
+    bool isEmpty() const
+    {
+        return d_rules.empty();
+    }
+
+    // Return the rules in the form they are sent to the server, which is '+ PATTERN' or '- PATTERN'.
+    const std::vector<std::string> &getRules() const
+    {
+        return d_wireRules;
+    }
+
+    // Return true if the entry at 'path' is excluded by the rules, not counting the directories above it.  This is
+    // what decides whether an entry is left out when its directory is listed.
+    bool isExcluded(const char *path, bool isDirectory) const;
+
+    // Return true if the entry at 'path' or any directory above it is excluded by the rules, which is what decides
+    // whether an entry is reached when the directories above it are listed one by one.
+    bool isPathExcluded(const char *path, bool isDirectory) const;
+
+    // Return a pattern that matches 'path' and nothing else.  If 'path' has any wildcards, they are escaped with a
+    // backslash, and so are backslashes; otherwise the pattern is 'path' itself, as a pattern without wildcards is
+    // matched as is.  If 'isWildcardPattern' is true, 'path' is escaped either way, so that wildcards can be
+    // appended to the pattern.
+    static std::string escape(const char *path, bool isWildcardPattern = false);
+
+private:
+
+    struct Rule
+    {
+        bool d_include;            // whether matching paths are included rather than excluded
+        std::string d_pattern;     // the pattern without the leading or trailing '/'
+        bool d_anchored;           // whether the pattern started with '/'
+        bool d_directoryOnly;      // whether the pattern ended with '/'
+        bool d_wildcard;           // whether the pattern has any of '*', '?', or '['
+        bool d_doubleStar;         // whether the pattern has '**'
+        bool d_doubleStarPrefix;   // whether the pattern starts with '**'
+        bool d_tripleStarSuffix;   // whether the pattern ends with '***'
+        int d_slashes;             // the number of '/' in 'd_pattern'
+    };
+
+    // Return true if 'rule' matches the entry at 'path', which has no trailing '/'.
+    static bool matches(const Rule &rule, const std::string &path, bool isDirectory);
+
+    std::vector<Rule> d_rules;                 // the include and exclude rules, in order
+    std::vector<std::string> d_wireRules;      // the rules as sent to the server, in order
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_FILTER_H
@@ -0,0 +1,178 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_mappedfile.h>
+
+#include <rsync/rsync_log.h>
+#include <rsync/rsync_pathutil.h>
+#include <rsync/rsync_util.h>
+
+#include <qi/qi_build.h>
+
+#if defined(WIN32) || defined(__MINGW32__)
+
+#include <Windows.h>
+
+namespace rsync
+{
+
+MappedFile::MappedFile()
+    : d_data(0)
+    , d_size(0)
+    , d_path()
+    , d_mapping(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    unmap();
+}
+
+bool MappedFile::map(const char *fullPath, bool reportError)
+{
+    unmap();
+    d_path = fullPath;
+
+    std::basic_string<wchar_t> path = PathUtil::convertToUTF16(fullPath);
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (file == INVALID_HANDLE_VALUE) {
+        if (reportError) {
+            LOG_ERROR(RSYNC_OPEN) << "Failed to open '" << fullPath << "': " << Util::getLastError() << LOG_END
+        }
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 ||
+        static_cast<uint64_t>(size.QuadPart) > static_cast<SIZE_T>(-1)) {
+        CloseHandle(file);
+        return false;
+    }
+
+    // The mapping object keeps the file open, so the handle can be closed right away.
+    d_mapping = CreateFileMappingW(file, 0, PAGE_READONLY, 0, 0, 0);
+    CloseHandle(file);
+    if (!d_mapping) {
+        if (reportError) {
+            LOG_ERROR(RSYNC_MAP) << "Failed to map '" << fullPath << "': " << Util::getLastError() << LOG_END
+        }
+        return false;
+    }
+
+    d_data = static_cast<char *>(MapViewOfFile(d_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!d_data) {
+        if (reportError) {
+            LOG_ERROR(RSYNC_MAP) << "Failed to map '" << fullPath << "': " << Util::getLastError() << LOG_END
+        }
+        CloseHandle(d_mapping);
+        d_mapping = 0;
+        return false;
+    }
+    d_size = size.QuadPart;
+    return true;
+}
+
+void MappedFile::unmap()
+{
+    if (d_data) {
+        UnmapViewOfFile(d_data);
+        d_data = 0;
+    }
+    if (d_mapping) {
+        CloseHandle(d_mapping);
+        d_mapping = 0;
+    }
+    d_size = 0;
+}
+
+} // close namespace rsync
+
+#else // for unix/linux/mac
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace rsync
+{
+
+MappedFile::MappedFile()
+    : d_data(0)
+    , d_size(0)
+    , d_path()
+{
+}
+
+MappedFile::~MappedFile()
+{
+    unmap();
+}
+
+bool MappedFile::map(const char *fullPath, bool reportError)
+{
+    unmap();
+    d_path = fullPath;
+
+    int fd = ::open(fullPath, O_RDONLY);
+    if (fd == -1) {
+        if (reportError) {
+            LOG_ERROR(RSYNC_OPEN) << "Failed to open '" << fullPath << "': " << strerror(errno) << LOG_END
+        }
+        return false;
+    }
+
+    struct stat buf;
+    if (fstat(fd, &buf) != 0 || buf.st_size == 0 ||
+        static_cast<uint64_t>(buf.st_size) > static_cast<size_t>(-1)) {
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    void *data = mmap(0, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        if (reportError) {
+            LOG_ERROR(RSYNC_MAP) << "Failed to map '" << fullPath << "': " << strerror(errno) << LOG_END
+        }
+        return false;
+    }
+
+    // The content will be scanned from the beginning to the end.
+    madvise(data, buf.st_size, MADV_SEQUENTIAL);
+
+    d_data = static_cast<char *>(data);
+    d_size = buf.st_size;
+    return true;
+}
+
+void MappedFile::unmap()
+{
+    if (d_data) {
+        munmap(d_data, d_size);
+        d_data = 0;
+    }
+    d_size = 0;
+}
+
+} // close namespace rsync
+
+#endif // defined(WIN32) || defined(__MINGW32__)
@@ -0,0 +1,82 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#ifndef INCLUDED_RSYNC_MAPPEDFILE_H
+#define INCLUDED_RSYNC_MAPPEDFILE_H
+
+#include <stdint.h>
+
+#include <string>
+
+namespace rsync
+{
+
+// This class maps the entire content of a file into memory for reading.
+//
+// Note that the content is read lazily, so if the file is truncated by another process while it is mapped, touching
+// the missing pages is fatal on some platforms.  Only map files that are not expected to shrink.
+class MappedFile
+{
+public:
+
+    // Default constructor creates an invalid object.
+    MappedFile();
+
+    // Unmap the file.
+    ~MappedFile();
+
+    // Map the file at 'fullPath'.  Return false if the file can't be opened or can't be mapped, which includes empty
+    // files and files too large for the address space.  If an error occurs, report it in log if 'reportError' is
+    // true.
+    bool map(const char *fullPath, bool reportError = false);
+
+    // Unmap the file.
+    void unmap();
+
+    // If a file has been mapped.
+    bool isValid() const
+    {
+        return d_data != 0;
+    }
+
+    // The first byte of the file.
+    const char *getData() const
+    {
+        return d_data;
+    }
+
+    // The size of the file.
+    int64_t getSize() const
+    {
+        return d_size;
+    }
+
+private:
+    // NOT IMPLEMENTED
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    char *d_data;                  // the mapped content
+    int64_t d_size;                // the size of the mapped content
+    std::string d_path;            // the path of the mapped file
+
+#if defined(WIN32) || defined(__MINGW32__)
+    void *d_mapping;               // the file mapping object
+#endif
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_MAPPEDFILE_H
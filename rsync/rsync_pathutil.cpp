@@ -16,6 +16,7 @@
 #include <rsync/rsync_pathutil.h>
 
 #include <rsync/rsync_entry.h>
+#include <rsync/rsync_entrypool.h>
 #include <rsync/rsync_log.h>
 #include <rsync/rsync_util.h>
 #include <rsync/rsync_timeutil.h>
@@ -34,6 +35,28 @@
 namespace rsync
 {
 
+namespace {
+
+// Create an entry in 'pool', or on the heap if 'pool' is 0.
+Entry *newEntry(EntryPool *pool, const char *path, bool isDirectory, int64_t size, int64_t time, uint32_t mode)
+{
+    if (pool) {
+        return pool->create(path, isDirectory, size, time, mode);
+    } else {
+        return new Entry(path, isDirectory, size, time, mode);
+    }
+}
+
+// Delete an entry created by 'newEntry()'.  An entry in a pool is released with the pool.
+void deleteEntry(EntryPool *pool, Entry *entry)
+{
+    if (!pool) {
+        delete entry;
+    }
+}
+
+} //  close unnamed namespace
+
 std::string PathUtil::join(const char *top, const char *path)
 {
     std::string fullPath = top;
@@ -534,7 +557,7 @@ bool PathUtil::readSymlink(const char *fullPath, std::string *target)
 
 void PathUtil::listDirectory(const char *top, const char *relativePath, std::vector<Entry*> *fileList,
                              std::vector<Entry*> *directoryList,
-                             bool /*normalization*/)
+                             bool /*normalization*/, bool /*inodeOrder*/, EntryPool *pool)
 {
     int topLength = ::strlen(top);
     std::string pathInUTF8(top);
@@ -584,7 +607,7 @@ void PathUtil::listDirectory(const char *top, const char *relativePath, std::vec
             }
         }
 
-        Entry *entry = new Entry(fullPath.c_str() + topLength + 1,
+        Entry *entry = newEntry(pool, fullPath.c_str() + topLength + 1,
                                  (fileData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ? 0 : fileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY,
                                  (int64_t(fileData.nFileSizeHigh) << 32) | fileData.nFileSizeLow,
                                  TimeUtil::getUnixTime(fileData.ftLastWriteTime.dwHighDateTime,
@@ -608,7 +631,7 @@ void PathUtil::listDirectory(const char *top, const char *relativePath, std::vec
                 if (readSymlink(PathUtil::join(top, currentList[i]->getPath()).c_str(), &target)) {
                     currentList[i]->setSymlink(target.c_str());
                 } else {
-                    delete currentList[i];
+                    deleteEntry(pool, currentList[i]);
                     currentList[i] = 0;
                     continue;
                 }
@@ -626,12 +649,12 @@ void PathUtil::listDirectory(const char *top, const char *relativePath, std::vec
         if (currentList[i]->isDirectory() && directoryList) {
             directoryList->push_back(currentList[i]);
         } else {
-            delete currentList[i];
+            deleteEntry(pool, currentList[i]);
         }
     }
 }
 
-Entry* PathUtil::createEntry(const char *top, const char *path)
+Entry* PathUtil::createEntry(const char *top, const char *path, EntryPool *pool)
 {
     std::basic_string<wchar_t> fullPath = convertToUTF16(PathUtil::join(top, path).c_str());
     WIN32_FILE_ATTRIBUTE_DATA fileData;
@@ -655,7 +678,7 @@ Entry* PathUtil::createEntry(const char *top, const char *path)
         }
     }
 
-    return new Entry(path, isDirectory, size, time, mode);
+    return newEntry(pool, path, isDirectory, size, time, mode);
 }
 
 bool PathUtil::getFileInfo(const char *fullPath, bool *isDir, int64_t *size, int64_t *time)
@@ -674,6 +697,31 @@ bool PathUtil::getFileInfo(const char *fullPath, bool *isDir, int64_t *size, int
     return true;
 }
 
+bool PathUtil::getFileIdentity(const char *fullPath, int64_t *size, int64_t *time, int64_t *changeTime,
+                               uint64_t *device, uint64_t *inode)
+{
+    std::basic_string<wchar_t> pathInUTF16 = convertToUTF16(fullPath);
+    HANDLE handle = CreateFileW(pathInUTF16.c_str(), FILE_READ_ATTRIBUTES,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, 0);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    BY_HANDLE_FILE_INFORMATION info;
+    BOOL ok = GetFileInformationByHandle(handle, &info);
+    CloseHandle(handle);
+    if (!ok) {
+        return false;
+    }
+
+    *size = (int64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    *time = TimeUtil::getUnixTime(info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime);
+    *changeTime = *time;
+    *device = info.dwVolumeSerialNumber;
+    *inode = (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    return true;
+}
 
 std::string PathUtil::getCurrentDirectory()
 {
@@ -693,6 +741,10 @@ std::string PathUtil::getCurrentDirectory()
 #include <dirent.h>
 #include <utime.h>
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
 #ifdef __APPLE__
 #include <iconv.h>
 
@@ -755,6 +807,68 @@ iconv_t UTFConverter::s_iconv_handle = (iconv_t)-1;
 namespace rsync
 {
 
+#if defined(__linux__)
+namespace {
+
+// The size of the buffer directory entries are read into, twice what the C library uses, so that most directories
+// are read in a single call.
+const int DirectoryBufferSize = 64 * 1024;
+
+// The layout of the entries returned by 'getdents64', which the C library doesn't always declare.
+struct DirectoryEntry
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+// Create the entry for 'record' read from the open directory 'directory', whose full path is 'currentPath' and whose
+// path relative to the top directory is 'relativePath', in 'pool' if it is not 0.  'target' is used to read
+// symlinks.  Return 0 if the entry is a broken symlink.
+Entry *createListedEntry(int directory, const std::string &currentPath, const std::string &relativePath,
+                         const DirectoryEntry *record, EntryPool *pool, std::vector<char> *target)
+{
+    const char *name = record->d_name;
+    uint64_t size = 0;
+    uint64_t time = 0;
+    uint32_t mode = 0;
+    struct stat buf;
+    if (::fstatat(directory, name, &buf, AT_SYMLINK_NOFOLLOW) == 0) {
+        size = buf.st_size;
+        time = buf.st_mtime;
+        mode = buf.st_mode;
+    }
+
+    // Some filesystems don't report the type of entries.
+    bool isDir = record->d_type == DT_DIR || (record->d_type == DT_UNKNOWN && S_ISDIR(mode));
+    Entry *entry = newEntry(pool, (relativePath + name).c_str(), isDir, size, time, mode);
+
+    if (mode & Entry::IS_FILE && mode & Entry::IS_LINK) {
+        // The size of a symlink is the length of its target, except on a few filesystems reporting 0.
+        ssize_t length = 0;
+        target->resize(size > 0 ? static_cast<size_t>(size) + 1 : 256);
+        while ((length = ::readlinkat(directory, name, &(*target)[0], target->size())) ==
+               static_cast<ssize_t>(target->size())) {
+            target->resize(target->size() * 2);
+        }
+        if (length > 0) {
+            entry->setSymlink(std::string(&(*target)[0], length));
+        } else {
+            LOG_INFO(RSYNC_SYMLINK) << "Skip broken symlink '" << currentPath << name << "'" << LOG_END
+            deleteEntry(pool, entry);
+            return 0;
+        }
+    }
+
+    entry->normalizePath();
+    return entry;
+}
+
+} //  close unnamed namespace
+#endif // defined(__linux__)
+
 int64_t PathUtil::getSize(const char *fullPath)
 {
     struct stat buf;
@@ -777,12 +891,18 @@ bool PathUtil::remove(const char *fullPath, bool /*enableLogging*/, bool /*sendT
     return true;
 }
 
-bool PathUtil::rename(const char *from, const char *to, bool /*enableLogging*/)
+bool PathUtil::rename(const char *from, const char *to, bool enableLogging)
 {
     if (exists(to)) {
         remove(to);
     }
-    ::rename(from, to);
+    if (::rename(from, to) != 0) {
+        if (enableLogging) {
+            LOG_ERROR(FILEUTIL_RENAME) << "Failed to rename '" << from << "' to '" << to << "': " << strerror(errno)
+                                       << LOG_END
+        }
+        return false;
+    }
     return true;
 }
 
@@ -832,11 +952,9 @@ bool PathUtil::setMode(const char *fullPath, uint32_t mode)
 }
 
 void PathUtil::listDirectory(const char *top, const char *path, std::vector<Entry*> *fileList,
-                             std::vector<Entry*> *directoryList, bool normalization)
+                             std::vector<Entry*> *directoryList, bool normalization, bool inodeOrder,
+                             EntryPool *pool)
 {
-    DIR *dir;
-    struct dirent *dirEntry;
-    struct stat buf;
 
     size_t topLength = ::strlen(top);
     std::string currentPath(top);
@@ -847,6 +965,62 @@ void PathUtil::listDirectory(const char *top, const char *path, std::vector<Entr
  
     std::vector<Entry*> currentList;
 
+#if defined(__linux__)
+    // Names are only normalized on Mac OS X.
+    (void)normalization;
+
+    // Entries are read in large batches and looked up relative to the open directory, so the kernel doesn't have to
+    // resolve the whole path again for each one.
+    int directory = ::open(currentPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory < 0) {
+        return;
+    }
+
+    // With 'inodeOrder' all entries are read before any of them is looked up.
+    std::string relativePath = currentPath.substr(topLength + 1);
+    std::vector<char> entries(DirectoryBufferSize);
+    std::vector<char> target;
+    std::string records;
+    std::vector<std::pair<uint64_t, size_t> > order;   // the inode and the offset in 'records' of each entry
+    long bytes;
+    while ((bytes = ::syscall(SYS_getdents64, directory, &entries[0], entries.size())) > 0) {
+        for (long offset = 0; offset < bytes; ) {
+            const DirectoryEntry *record = reinterpret_cast<const DirectoryEntry *>(&entries[offset]);
+            offset += record->d_reclen;
+
+            const char *name = record->d_name;
+            if (name[0] == '.') {
+                if (name[1] == 0 || (name[1] == '.' && name[2] == 0)) {
+                    continue;
+                }
+                if (::strncmp(name + 1, "acrosync", 8) == 0) {
+                    continue;
+                }
+            }
+
+            if (inodeOrder) {
+                order.push_back(std::make_pair(record->d_ino, records.size()));
+                records.append(reinterpret_cast<const char *>(record), record->d_reclen);
+            } else if (Entry *entry = createListedEntry(directory, currentPath, relativePath, record, pool, &target)) {
+                currentList.push_back(entry);
+            }
+        }
+    }
+
+    // The records keep their alignment in 'records', as their lengths are multiples of 8.
+    std::sort(order.begin(), order.end());
+    for (unsigned int i = 0; i < order.size(); ++i) {
+        const DirectoryEntry *record = reinterpret_cast<const DirectoryEntry *>(records.data() + order[i].second);
+        if (Entry *entry = createListedEntry(directory, currentPath, relativePath, record, pool, &target)) {
+            currentList.push_back(entry);
+        }
+    }
+
+    ::close(directory);
+#else
+    struct stat buf;
+    DIR *dir;
+    struct dirent *dirEntry;
     if ((dir = opendir(currentPath.c_str())) == NULL) {
         return;
     }
@@ -883,7 +1057,7 @@ void PathUtil::listDirectory(const char *top, const char *path, std::vector<Entr
             mode = buf.st_mode;
         }
         
-        Entry *entry = new Entry(file.c_str() + topLength + 1,
+        Entry *entry = newEntry(pool, file.c_str() + topLength + 1,
                                  isDir, size, time, mode);
         
         if (mode & Entry::IS_FILE && mode & Entry::IS_LINK) {
@@ -893,7 +1067,7 @@ void PathUtil::listDirectory(const char *top, const char *path, std::vector<Entr
                 entry->setSymlink(std::string(buffer, bytes));
             } else {
                 LOG_INFO(RSYNC_SYMLINK) << "Skip broken symlink '" << file << "'" << LOG_END
-                delete entry;
+                deleteEntry(pool, entry);
                 continue;
             }
         }
@@ -904,6 +1078,7 @@ void PathUtil::listDirectory(const char *top, const char *path, std::vector<Entr
     }
 
     closedir(dir);
+#endif // defined(__linux__)
 
     std::sort(currentList.begin(), currentList.end(), Entry::compareLocally);
 
@@ -923,12 +1098,12 @@ void PathUtil::listDirectory(const char *top, const char *path, std::vector<Entr
         if (currentList[i]->isDirectory() && directoryList) {
            directoryList->push_back(currentList[i]);
         } else {
-            delete currentList[i];
+            deleteEntry(pool, currentList[i]);
         }
     }
 }
 
-Entry* PathUtil::createEntry(const char *top, const char *path)
+Entry* PathUtil::createEntry(const char *top, const char *path, EntryPool *pool)
 {
     struct stat buf;
     if (stat(PathUtil::join(top, path).c_str(), &buf) != 0) {
@@ -939,7 +1114,7 @@ Entry* PathUtil::createEntry(const char *top, const char *path)
     int64_t size = buf.st_size;
     int64_t time = buf.st_mtime;
     uint32_t mode = buf.st_mode;
-    return new Entry(path, isDir, size, time, mode);
+    return newEntry(pool, path, isDir, size, time, mode);
 }
 
 bool PathUtil::getFileInfo(const char *fullPath, bool *isDir, int64_t *size, int64_t *time)
@@ -955,6 +1130,22 @@ bool PathUtil::getFileInfo(const char *fullPath, bool *isDir, int64_t *size, int
     return true;
 }
 
+bool PathUtil::getFileIdentity(const char *fullPath, int64_t *size, int64_t *time, int64_t *changeTime,
+                               uint64_t *device, uint64_t *inode)
+{
+    struct stat buf;
+    if (stat(fullPath, &buf) != 0) {
+        return false;
+    }
+
+    *size = buf.st_size;
+    *time = buf.st_mtime;
+    *changeTime = buf.st_ctime;
+    *device = buf.st_dev;
+    *inode = buf.st_ino;
+    return true;
+}
+
 std::string PathUtil::getCurrentDirectory()
 {
     char buffer[1024];
@@ -27,6 +27,7 @@ namespace rsync
 {
 
 class Entry;
+class EntryPool;
 
 struct PathUtil
 {
@@ -72,16 +73,25 @@ struct PathUtil
     // List the directory joined by 'top' and 'path'; add file entries to 'fileList', and directory entries to
     // 'directoryList'.  If 'includedPatterns' is specified, add only those entries that match the patterns.
     // Files or directories matching any pattern specified in 'excludePatterns' will not be included. 
-    // 'normalization' is used to indicate to convert paths from UTF8-MAC to UTF8.
+    // 'normalization' is used to indicate to convert paths from UTF8-MAC to UTF8.  If 'inodeOrder' is true, the
+    // entries are looked up in the order of their inode numbers, which is much faster on rotational disks when the
+    // inodes are not cached; this is only done on Linux.  If 'pool' is not 0, the entries are created in 'pool'.
     static void listDirectory(const char *top, const char *path, std::vector<Entry*> *fileList,
-                       std::vector<Entry*> *directoryList, bool normalization = false);
+                       std::vector<Entry*> *directoryList, bool normalization = false, bool inodeOrder = false,
+                       EntryPool *pool = 0);
 
-    // Create a new entry from the specified path
-    static Entry* createEntry(const char *top, const char *path);
+    // Create a new entry from the specified path, in 'pool' if it is not 0
+    static Entry* createEntry(const char *top, const char *path, EntryPool *pool = 0);
 
     // Return information about a file/directory at the specified path
     static bool getFileInfo(const char *fullPath, bool *isDir, int64_t *size, int64_t *time);
 
+    // Return the size, the modified time, the status change time, and the device and inode numbers of a file, which
+    // together identify a particular version of the file.  On Windows the change time is the modified time, and
+    // the volume serial number and the file index are used as the device and inode numbers.
+    static bool getFileIdentity(const char *fullPath, int64_t *size, int64_t *time, int64_t *changeTime,
+                                uint64_t *device, uint64_t *inode);
+
     // Return current working directory
     static std::string getCurrentDirectory();
 
@@ -0,0 +1,318 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_signaturecache.h>
+
+#include <rsync/rsync_entry.h>
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_log.h>
+#include <rsync/rsync_pathutil.h>
+#include <rsync/rsync_util.h>
+
+#include <openssl/md5.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// The first bytes of every cache file.  Change the version if the layout changes.
+const char Magic[8] = { 'R', 'S', 'I', 'G', 'C', 'A', 'C', '1' };
+
+// The size of each block signature: a 4-byte rolling checksum and a 16-byte digest.
+const int SignatureLength = 20;
+
+// A file modified within this many seconds may be modified again without changing its modified time.
+const int RacyWindow = 2;
+
+// The name of the file that keeps the seed in the cache directory.
+const char SeedFile[] = "seed";
+
+// Cache files have this suffix.
+const char CacheFileSuffix[] = ".sig";
+
+// Return a name for a temporary file next to 'cacheFile' that no other process or thread saving the same cache file
+// will pick.
+std::string getTemporaryFile(const std::string &cacheFile)
+{
+    uint64_t random = 0;
+    if (RAND_bytes(reinterpret_cast<unsigned char *>(&random), sizeof(random)) != 1) {
+        random = (static_cast<uint64_t>(::time(0)) << 32) ^ static_cast<uint64_t>(std::rand()) ^
+                 static_cast<uint64_t>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    }
+
+    static const char hexDigits[] = "0123456789abcdef";
+    std::string name = cacheFile + ".";
+    for (int i = 0; i < 16; ++i) {
+        name += hexDigits[(random >> (i * 4)) & 0xf];
+    }
+    name += ".tmp";
+    return name;
+}
+
+void appendInt32(std::string *buffer, int32_t value)
+{
+    buffer->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void appendInt64(std::string *buffer, int64_t value)
+{
+    buffer->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Serialize the key and the path into the header of a cache file.
+std::string getHeader(const char *fullPath, const SignatureCache::Key &key)
+{
+    std::string header(Magic, sizeof(Magic));
+    appendInt64(&header, key.d_size);
+    appendInt64(&header, key.d_time);
+    appendInt64(&header, key.d_changeTime);
+    appendInt64(&header, static_cast<int64_t>(key.d_device));
+    appendInt64(&header, static_cast<int64_t>(key.d_inode));
+    appendInt32(&header, key.d_blockLength);
+    appendInt32(&header, key.d_protocol);
+    appendInt32(&header, key.d_seed);
+    int32_t pathLength = static_cast<int32_t>(::strlen(fullPath));
+    appendInt32(&header, pathLength);
+    header.append(fullPath, pathLength);
+    return header;
+}
+
+// Return the number of signature bytes for a file of the size and block length in 'key'.
+int64_t getSignatureSize(const SignatureCache::Key &key)
+{
+    int64_t count = (key.d_size - 1) / key.d_blockLength + 1;
+    return count * SignatureLength;
+}
+
+bool compareByTime(const Entry *lhs, const Entry *rhs)
+{
+    return lhs->getTime() < rhs->getTime();
+}
+
+} // unnamed namespace
+
+bool SignatureCache::Key::operator==(const Key &other) const
+{
+    return d_size == other.d_size && d_time == other.d_time && d_changeTime == other.d_changeTime &&
+           d_device == other.d_device && d_inode == other.d_inode && d_blockLength == other.d_blockLength &&
+           d_protocol == other.d_protocol && d_seed == other.d_seed;
+}
+
+SignatureCache::SignatureCache(const char *directory, int64_t maxSize)
+    : d_directory(directory)
+    , d_maxSize(maxSize)
+    , d_totalSize(-1)
+    , d_seed(0)
+{
+    if (!PathUtil::isDirectory(directory) && !PathUtil::createDirectory(directory)) {
+        LOG_ERROR(RSYNC_CACHE) << "Failed to create the signature cache directory '" << directory << "'" << LOG_END
+        return;
+    }
+
+    // Use the seed kept in the directory; otherwise this is a new cache, so pick one.
+    std::string seedFile = PathUtil::join(directory, SeedFile);
+    char buffer[32];
+    int bytes = 0;
+    {
+        File f(seedFile.c_str(), false);
+        bytes = f.read(buffer, sizeof(buffer) - 1);
+    }
+    if (bytes > 0) {
+        buffer[bytes] = 0;
+        d_seed = static_cast<int32_t>(::strtol(buffer, 0, 10));
+    }
+
+    if (d_seed <= 0) {
+        // Anything left in the directory was computed with a different seed.
+        clear();
+
+        uint32_t seed = 0;
+        if (RAND_bytes(reinterpret_cast<unsigned char *>(&seed), sizeof(seed)) != 1) {
+            seed = static_cast<uint32_t>(::time(0));
+        }
+        d_seed = static_cast<int32_t>(seed & 0x7fffffff);
+        if (d_seed == 0) {
+            d_seed = 1;
+        }
+
+        std::stringstream out;
+        out << d_seed;
+        File f(seedFile.c_str(), true, true);
+        if (f.write(out.str().c_str(), static_cast<int>(out.str().size())) != static_cast<int>(out.str().size())) {
+            d_seed = 0;
+        }
+    }
+}
+
+SignatureCache::~SignatureCache()
+{
+}
+
+bool SignatureCache::getKey(const char *fullPath, int32_t blockLength, int32_t protocol, int32_t seed, Key *key)
+{
+    if (!PathUtil::getFileIdentity(fullPath, &key->d_size, &key->d_time, &key->d_changeTime, &key->d_device,
+                                   &key->d_inode)) {
+        return false;
+    }
+    key->d_blockLength = blockLength;
+    key->d_protocol = protocol;
+    key->d_seed = seed;
+    return true;
+}
+
+std::string SignatureCache::getCacheFile(const char *fullPath) const
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5(reinterpret_cast<const unsigned char *>(fullPath), ::strlen(fullPath), digest);
+
+    static const char hexDigits[] = "0123456789abcdef";
+    std::string name;
+    for (int i = 0; i < MD5_DIGEST_LENGTH; ++i) {
+        name += hexDigits[digest[i] >> 4];
+        name += hexDigits[digest[i] & 0xf];
+    }
+    name += CacheFileSuffix;
+    return PathUtil::join(d_directory.c_str(), name.c_str());
+}
+
+bool SignatureCache::load(const char *fullPath, const Key &key, std::string *signatures)
+{
+    if (!isValid() || key.d_seed != d_seed || key.d_size <= 0) {
+        return false;
+    }
+
+    std::string cacheFile = getCacheFile(fullPath);
+    std::string header = getHeader(fullPath, key);
+    int64_t signatureSize = getSignatureSize(key);
+    if (PathUtil::getSize(cacheFile.c_str()) != static_cast<int64_t>(header.size()) + signatureSize) {
+        return false;
+    }
+
+    File f(cacheFile.c_str(), false);
+    std::string buffer(header.size(), 0);
+    if (f.read(&buffer[0], static_cast<int>(buffer.size())) != static_cast<int>(buffer.size()) || buffer != header) {
+        return false;
+    }
+
+    signatures->resize(static_cast<size_t>(signatureSize));
+    if (f.read(&(*signatures)[0], static_cast<int>(signatureSize)) != signatureSize) {
+        signatures->clear();
+        return false;
+    }
+    f.close();
+
+    // Mark the cache file as recently used.
+    PathUtil::setModifiedTime(cacheFile.c_str(), ::time(0));
+    return true;
+}
+
+void SignatureCache::save(const char *fullPath, const Key &key, const std::string &signatures)
+{
+    if (!isValid() || key.d_seed != d_seed || key.d_size <= 0 ||
+        static_cast<int64_t>(signatures.size()) != getSignatureSize(key)) {
+        return;
+    }
+
+    // The signatures are only good if the file stayed the same while it was being read.
+    Key current;
+    if (!getKey(fullPath, key.d_blockLength, key.d_protocol, key.d_seed, &current) || !(current == key)) {
+        return;
+    }
+
+    // A file modified in the last few seconds may change again with the same modified time and size.
+    if (key.d_time >= ::time(0) - RacyWindow || key.d_changeTime >= ::time(0) - RacyWindow) {
+        return;
+    }
+
+    std::string header = getHeader(fullPath, key);
+    int64_t size = static_cast<int64_t>(header.size() + signatures.size());
+    if (size > d_maxSize) {
+        return;
+    }
+
+    // Write to a temporary file first so that a partially written cache file can never be loaded.  The name is
+    // unique so that clients saving the same cache file at once don't write into the same temporary file.
+    std::string cacheFile = getCacheFile(fullPath);
+    std::string temporaryFile = getTemporaryFile(cacheFile);
+    {
+        File f(temporaryFile.c_str(), true, true);
+        if (f.write(header.c_str(), static_cast<int>(header.size())) != static_cast<int>(header.size()) ||
+            f.write(signatures.c_str(), static_cast<int>(signatures.size())) != static_cast<int>(signatures.size())) {
+            f.close();
+            PathUtil::remove(temporaryFile.c_str(), false);
+            return;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(d_mutex);
+    if (d_totalSize >= 0) {
+        int64_t oldSize = PathUtil::getSize(cacheFile.c_str());
+        d_totalSize += size - (oldSize > 0 ? oldSize : 0);
+    }
+    PathUtil::rename(temporaryFile.c_str(), cacheFile.c_str(), false);
+
+    if (d_totalSize < 0 || d_totalSize > d_maxSize) {
+        trim(d_maxSize);
+    }
+}
+
+void SignatureCache::trim(int64_t maxSize)
+{
+    std::vector<Entry*> files;
+    Util::EntryListReleaser releaser(&files);
+    PathUtil::listDirectory(d_directory.c_str(), "", &files, 0);
+
+    std::vector<Entry*> cacheFiles;
+    int64_t totalSize = 0;
+    size_t suffixLength = ::strlen(CacheFileSuffix);
+    for (unsigned int i = 0; i < files.size(); ++i) {
+        const char *path = files[i]->getPath();
+        size_t length = ::strlen(path);
+        if (length > suffixLength && ::strcmp(path + length - suffixLength, CacheFileSuffix) == 0) {
+            cacheFiles.push_back(files[i]);
+            totalSize += files[i]->getSize();
+        }
+    }
+
+    // Remove the least recently used files first.
+    std::sort(cacheFiles.begin(), cacheFiles.end(), compareByTime);
+    for (unsigned int i = 0; i < cacheFiles.size() && totalSize > maxSize; ++i) {
+        PathUtil::remove(PathUtil::join(d_directory.c_str(), cacheFiles[i]->getPath()).c_str(), false);
+        totalSize -= cacheFiles[i]->getSize();
+    }
+    d_totalSize = totalSize;
+}
+
+void SignatureCache::clear()
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    trim(0);
+}
+
+} // close namespace rsync
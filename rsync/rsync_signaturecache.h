@@ -0,0 +1,117 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#ifndef INCLUDED_RSYNC_SIGNATURECACHE_H
+#define INCLUDED_RSYNC_SIGNATURECACHE_H
+
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+
+namespace rsync
+{
+
+// This class keeps the block signatures of local files on disk, so that a file that hasn't changed since its
+// signatures were last computed doesn't have to be read again.
+//
+// Signatures are stored one file per local file in the cache directory, named after the MD5 hash of the local path.
+// Each cache file starts with the key it was computed for: the local path, the size, modified time, change time,
+// device and inode of the file, and the block length, protocol and checksum seed used.  A cache file is only used if
+// the whole key matches, so any change to the local file or to the way signatures are computed is a miss.
+//
+// The total size of the cache files is kept under the limit given to the constructor by removing the least recently
+// used ones.  The modified time of a cache file is updated every time it is used.
+//
+// Signatures depend on the checksum seed, which the server normally picks at random for each session.  The cache
+// therefore comes with its own seed, created at random the first time the cache directory is used and kept there,
+// which the client asks the server to use instead.
+//
+// The cache can be used by multiple threads at the same time.
+class SignatureCache
+{
+public:
+
+    // Everything the signatures of a file depend on.
+    struct Key
+    {
+        int64_t d_size;            // the size of the file
+        int64_t d_time;            // the modified time of the file
+        int64_t d_changeTime;      // the status change time of the file
+        uint64_t d_device;         // the device the file is on
+        uint64_t d_inode;          // the inode number of the file
+        int32_t d_blockLength;     // the block length
+        int32_t d_protocol;        // the protocol version, which decides between MD4 and MD5
+        int32_t d_seed;            // the checksum seed
+
+        bool operator==(const Key &other) const;
+    };
+
+    // Create a cache in 'directory', which will be created if it doesn't exist, that uses no more than 'maxSize'
+    // bytes.
+    SignatureCache(const char *directory, int64_t maxSize);
+
+    ~SignatureCache();
+
+    // If the cache directory can be used.
+    bool isValid() const
+    {
+        return d_seed != 0;
+    }
+
+    // The checksum seed that all signatures in this cache are computed with.
+    int32_t getSeed() const
+    {
+        return d_seed;
+    }
+
+    // Fill in 'key' for the file 'fullPath'.  Return false if the file can't be found.
+    static bool getKey(const char *fullPath, int32_t blockLength, int32_t protocol, int32_t seed, Key *key);
+
+    // Retrieve the signatures of 'fullPath' into 'signatures' if they have been saved with the same 'key'.  The
+    // signatures are returned in the same format as they are sent to the server, a 4-byte rolling checksum followed
+    // by a 16-byte digest for each block.
+    bool load(const char *fullPath, const Key &key, std::string *signatures);
+
+    // Save the signatures of 'fullPath', which were computed after 'key' was obtained.  Nothing will be saved if the
+    // file has changed since then, or if it was modified so recently that it could change again without changing
+    // its modified time.
+    void save(const char *fullPath, const Key &key, const std::string &signatures);
+
+    // Remove all cache files.
+    void clear();
+
+private:
+    // NOT IMPLEMENTED
+    SignatureCache(const SignatureCache&);
+    SignatureCache& operator=(const SignatureCache&);
+
+    // Return the path of the cache file for 'fullPath'.
+    std::string getCacheFile(const char *fullPath) const;
+
+    // Remove the least recently used cache files until the total size is under 'maxSize'.  'd_mutex' must be
+    // locked.
+    void trim(int64_t maxSize);
+
+    std::string d_directory;       // the cache directory
+    int64_t d_maxSize;             // the maximum number of bytes of all cache files
+    int64_t d_totalSize;           // the number of bytes of all cache files; -1 if not known yet
+    int32_t d_seed;                // the checksum seed; 0 if the cache directory can't be used
+    std::mutex d_mutex;            // serializes updates to the cache directory and 'd_totalSize'
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_SIGNATURECACHE_H
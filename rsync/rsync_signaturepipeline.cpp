@@ -0,0 +1,273 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_signaturepipeline.h>
+
+#include <rsync/rsync_checksumutil.h>
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_log.h>
+#include <rsync/rsync_pathutil.h>
+#include <rsync/rsync_signaturecache.h>
+
+#include <chrono>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// The length of the digest of each block.
+const int32_t MDLength = 16;
+
+// The size of the header sent before the block signatures.
+const int HeaderLength = 16;
+
+void appendInt32(std::string *buffer, int32_t value)
+{
+    buffer->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+} // unnamed namespace
+
+SignaturePipeline::SignaturePipeline(int numberOfThreads, int64_t memoryBudget, const int *cancelFlagAddress)
+    : d_memoryBudget(memoryBudget)
+    , d_memoryInUse(0)
+    , d_cancelFlag(cancelFlagAddress)
+    , d_protocol(0)
+    , d_seed(0)
+    , d_cache(0)
+    , d_jobs()
+    , d_firstPending(0)
+    , d_stopping(false)
+{
+    for (int i = 0; i < numberOfThreads; ++i) {
+        d_workers.push_back(std::thread(&SignaturePipeline::run, this));
+    }
+}
+
+SignaturePipeline::~SignaturePipeline()
+{
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_workAvailable.notify_all();
+    for (unsigned int i = 0; i < d_workers.size(); ++i) {
+        d_workers[i].join();
+    }
+    for (unsigned int i = 0; i < d_jobs.size(); ++i) {
+        delete d_jobs[i];
+    }
+}
+
+bool SignaturePipeline::computeSignatures(const char *oldFile, int32_t protocol, int32_t seed, SignatureCache *cache,
+                                          const int *cancelFlagAddress, std::string *signatures)
+{
+    signatures->clear();
+
+    File f;
+
+    // The size of the old file
+    int64_t oldFileSize = 0;
+    if (oldFile) {
+        oldFileSize = PathUtil::getSize(oldFile);
+    }
+
+    // If we can open the old file then send all zeroes
+    if (!oldFile || !f.open(oldFile, false, false)) {
+        for (int i = 0; i < 4; ++i) {
+            appendInt32(signatures, 0);
+        }
+        return true;
+    }
+
+    // The old file will be divided into 'count' blocks each of which has a length of 'blockLength'.
+    int32_t blockLength = ChecksumUtil::getBlockLength(oldFileSize);
+    int32_t count = static_cast<int32_t>((oldFileSize - 1) / blockLength + 1);
+    int32_t remainder = static_cast<int32_t>(oldFileSize - static_cast<int64_t>(count - 1) * blockLength);
+
+    appendInt32(signatures, count);
+    appendInt32(signatures, blockLength);
+    appendInt32(signatures, MDLength);
+    appendInt32(signatures, remainder);
+
+    // If the signatures of the same file have been saved, use them instead.
+    SignatureCache::Key key;
+    bool caching = cache && cache->isValid() && seed == cache->getSeed() &&
+                   SignatureCache::getKey(oldFile, blockLength, protocol, seed, &key) && key.d_size == oldFileSize;
+    std::string cached;
+    if (caching && cache->load(oldFile, key, &cached)) {
+        signatures->append(cached);
+        return true;
+    }
+
+    signatures->reserve(HeaderLength + static_cast<size_t>(count) * (4 + MDLength));
+
+    std::vector<char> chunk(blockLength);
+    uint32_t s1, s2;
+    char digest[MDLength];
+    for (int i = 0; i < count; ++i) {
+        if (cancelFlagAddress && *cancelFlagAddress) {
+            return false;
+        }
+        int bytes = f.read(&chunk[0], blockLength);
+        ChecksumUtil::getRollingChecksum(&chunk[0], bytes, &s1, &s2);
+        appendInt32(signatures, (s1 & 0xffff) | (s2 << 16));
+        ChecksumUtil::getMDDigest(protocol, &chunk[0], bytes, seed, digest);
+        signatures->append(digest, MDLength);
+    }
+
+    if (caching) {
+        cache->save(oldFile, key, signatures->substr(HeaderLength));
+    }
+    return true;
+}
+
+void SignaturePipeline::reset(int32_t protocol, int32_t seed, SignatureCache *cache)
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+
+    // Keep the workers from starting on anything else, and wait for those that have already started.
+    for (unsigned int i = 0; i < d_jobs.size(); ++i) {
+        if (d_jobs[i]->d_state == PENDING) {
+            d_jobs[i]->d_state = DONE;
+        }
+    }
+    d_firstPending = d_jobs.size();
+    while (true) {
+        bool running = false;
+        for (unsigned int i = 0; i < d_jobs.size() && !running; ++i) {
+            running = d_jobs[i]->d_state == RUNNING;
+        }
+        if (!running) {
+            break;
+        }
+        d_jobDone.wait(lock);
+    }
+
+    for (unsigned int i = 0; i < d_jobs.size(); ++i) {
+        delete d_jobs[i];
+    }
+    d_jobs.clear();
+    d_firstPending = 0;
+    d_memoryInUse = 0;
+
+    d_protocol = protocol;
+    d_seed = seed;
+    d_cache = cache;
+}
+
+void SignaturePipeline::add(int index, const std::string &oldFile)
+{
+    Job *job = new Job;
+    job->d_index = index;
+    job->d_oldFile = oldFile;
+    job->d_cost = HeaderLength;
+    if (!oldFile.empty()) {
+        int64_t size = PathUtil::getSize(oldFile.c_str());
+        int64_t count = (size - 1) / ChecksumUtil::getBlockLength(size) + 1;
+        job->d_cost += count * (4 + MDLength);
+    }
+    job->d_state = PENDING;
+
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_jobs.push_back(job);
+    }
+    d_workAvailable.notify_one();
+}
+
+bool SignaturePipeline::take(int *index, std::string *signatures, int timeout)
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    if (d_jobs.empty()) {
+        return false;
+    }
+
+    Job *job = d_jobs.front();
+    if (job->d_state != DONE) {
+        d_jobDone.wait_for(lock, std::chrono::milliseconds(timeout));
+        if (job->d_state != DONE) {
+            return false;
+        }
+    }
+
+    *index = job->d_index;
+    signatures->swap(job->d_signatures);
+    d_memoryInUse -= job->d_cost;
+    d_jobs.pop_front();
+    if (d_firstPending > 0) {
+        --d_firstPending;
+    }
+    delete job;
+
+    lock.unlock();
+    d_workAvailable.notify_all();
+    return true;
+}
+
+void SignaturePipeline::run()
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (true) {
+        Job *job = 0;
+        while (!d_stopping) {
+            while (d_firstPending < d_jobs.size() && d_jobs[d_firstPending]->d_state != PENDING) {
+                ++d_firstPending;
+            }
+            if (d_firstPending < d_jobs.size() && !(d_cancelFlag && *d_cancelFlag)) {
+                Job *next = d_jobs[d_firstPending];
+                if (d_memoryInUse == 0 || d_memoryInUse + next->d_cost <= d_memoryBudget) {
+                    job = next;
+                    break;
+                }
+            }
+            d_workAvailable.wait(lock);
+        }
+        if (!job) {
+            return;
+        }
+
+        job->d_state = RUNNING;
+        d_memoryInUse += job->d_cost;
+        ++d_firstPending;
+        int32_t protocol = d_protocol;
+        int32_t seed = d_seed;
+        SignatureCache *cache = d_cache;
+        lock.unlock();
+
+        std::string signatures;
+        bool completed = false;
+        try {
+            completed = computeSignatures(job->d_oldFile.empty() ? 0 : job->d_oldFile.c_str(), protocol, seed, cache,
+                                          d_cancelFlag, &signatures);
+        } catch (Exception&) {
+            // The signatures will be computed again by the caller of 'take()', which will report the error.
+            completed = false;
+        }
+
+        lock.lock();
+        if (completed) {
+            job->d_signatures.swap(signatures);
+        }
+        job->d_state = DONE;
+        d_jobDone.notify_all();
+    }
+}
+
+} // close namespace rsync
@@ -0,0 +1,115 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#ifndef INCLUDED_RSYNC_SIGNATUREPIPELINE_H
+#define INCLUDED_RSYNC_SIGNATUREPIPELINE_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rsync
+{
+
+class SignatureCache;
+
+// This class computes the block signatures of basis files on a pool of worker threads, ahead of the thread that
+// sends them to the server.  Files are added in the order their signatures are to be sent, and the signatures are
+// taken out in the same order, no matter which worker finishes first.
+//
+// Signatures that have been computed but not yet taken count against a memory budget.  A worker doesn't start on a
+// file whose signatures would exceed the budget, unless nothing else is being held.
+class SignaturePipeline
+{
+public:
+
+    // Create a pipeline with 'numberOfThreads' workers that hold no more than about 'memoryBudget' bytes of
+    // signatures at a time.  Workers stop computing when the value pointed to by 'cancelFlagAddress' becomes
+    // non-zero.
+    SignaturePipeline(int numberOfThreads, int64_t memoryBudget, const int *cancelFlagAddress);
+
+    // Discard all files and wait for the workers to exit.
+    ~SignaturePipeline();
+
+    // Compute the signatures of 'oldFile' in the format sent to the server: the number of blocks, the block
+    // length, the digest length and the length of the last block, followed by a rolling checksum and a digest for
+    // each block.  If 'oldFile' is 0 or can't be opened, the header is all zeroes and there are no blocks.  Use
+    // 'cache' if it is not 0.  Return false if cancelled.
+    static bool computeSignatures(const char *oldFile, int32_t protocol, int32_t seed, SignatureCache *cache,
+                                  const int *cancelFlagAddress, std::string *signatures);
+
+    // Discard all files added, and compute the signatures of files to be added with 'protocol', 'seed' and
+    // 'cache'.
+    void reset(int32_t protocol, int32_t seed, SignatureCache *cache);
+
+    // Add the basis file 'oldFile' for the file with the specified 'index'.  An empty 'oldFile' means there is no
+    // basis file.
+    void add(int index, const std::string &oldFile);
+
+    // Take the signatures of the earliest file added that hasn't been taken yet.  Wait up to 'timeout' milliseconds
+    // for them to be computed, and return false if they aren't ready by then, or if there is no file to take.
+    // 'signatures' is empty if the computation was cancelled or failed.
+    bool take(int *index, std::string *signatures, int timeout);
+
+private:
+    // NOT IMPLEMENTED
+    SignaturePipeline(const SignaturePipeline&);
+    SignaturePipeline& operator=(const SignaturePipeline&);
+
+    enum State {
+        PENDING,
+        RUNNING,
+        DONE
+    };
+
+    struct Job
+    {
+        int d_index;               // the index of the file
+        std::string d_oldFile;     // the basis file; empty if there is none
+        int64_t d_cost;            // the expected size of the signatures
+        State d_state;             // whether the signatures have been computed
+        std::string d_signatures;  // the signatures once computed; empty if cancelled or failed
+    };
+
+    // The loop run by each worker.
+    void run();
+
+    int64_t d_memoryBudget;        // the maximum number of bytes of signatures held
+    int64_t d_memoryInUse;         // the number of bytes of signatures being computed or waiting to be taken
+    const int *d_cancelFlag;       // workers stop if the value becomes non-zero
+
+    int32_t d_protocol;            // the protocol version
+    int32_t d_seed;                // the checksum seed
+    SignatureCache *d_cache;       // the signature cache; may be 0
+
+    std::deque<Job*> d_jobs;       // jobs in the order they were added
+    size_t d_firstPending;         // the position of the first job in 'd_jobs' that may still be pending
+    bool d_stopping;               // set when the workers must exit
+
+    std::mutex d_mutex;            // protects all members above
+    std::condition_variable d_workAvailable;   // signalled when a job is added or memory is released
+    std::condition_variable d_jobDone;         // signalled when a job is done
+
+    std::vector<std::thread> d_workers;        // the worker threads
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_SIGNATUREPIPELINE_H
@@ -62,7 +62,10 @@ public:
     // Reset the steam to the intial state.
     void reset();
 
-    enum {INDEX_DONE = -1 };
+    // Special indices.  Under incremental recursion, the server sends each later segment of the file list after
+    // 'INDEX_FLIST_OFFSET' minus the index of its directory among all directories received, and 'INDEX_FLIST_EOF'
+    // once there are no more segments.
+    enum {INDEX_DONE = -1, INDEX_FLIST_EOF = -2, INDEX_FLIST_OFFSET = -101 };
 
     // Read 'size' bytes to 'buffer'.  Return 'size' until all bytes have been read.  Note that a write can be
     // buffered or unbuffered
@@ -0,0 +1,375 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_tokencompressor.h>
+
+#include <rsync/rsync_log.h>
+#include <rsync/rsync_stream.h>
+
+#include <zlib.h>
+
+#include <algorithm>
+
+#include <cstring>
+
+#include <qi/qi_build.h>
+
+namespace rsync
+{
+
+namespace
+{
+
+// Flags that start each item in the token stream
+const int EndFlag = 0x00;          // the end of the file
+const int TokenLong = 0x20;        // followed by a 32-bit block number
+const int TokenRunLong = 0x21;     // followed by a 32-bit block number and a 16-bit run count
+const int DeflatedData = 0x40;     // plus the high 6 bits of the length, followed by the low 8 bits and the data
+const int TokenRel = 0x80;         // plus a 6-bit block number relative to the end of the previous run
+const int TokenRunRel = 0xc0;      // the same as above, followed by a 16-bit run count
+
+// The maximum length of compressed data that can be sent with a single flag.
+const int MaxDataCount = 16383;
+
+// The amount of literal data given to the compressor at a time.
+const int ChunkSize = 32 * 1024;
+
+// The buffer needed by zlib to inflate 'ChunkSize' bytes in one call.
+const int InflatedSize = ChunkSize * 1001 / 1000 + 16;
+
+// Stored blocks added to the history of the decompressor can be no longer than this.
+const int MaxStoredLength = 0xffff;
+
+Bytef *toBytes(const char *data)
+{
+    return reinterpret_cast<Bytef *>(const_cast<char *>(data));
+}
+
+} // unnamed namespace
+
+TokenCompressor::TokenCompressor(Stream *stream, int32_t protocol)
+    : d_stream(stream)
+    , d_protocol(protocol)
+    , d_deflater(new z_stream)
+    , d_deflaterReady(false)
+    , d_lastToken(-1)
+    , d_runStart(0)
+    , d_lastRunEnd(0)
+    , d_flushPending(false)
+    , d_output(MaxDataCount + 2)
+    , d_inflater(new z_stream)
+    , d_inflaterReady(false)
+    , d_receiveState(RECEIVE_INIT)
+    , d_receivedToken(0)
+    , d_run(0)
+    , d_savedFlag(0)
+    , d_input(MaxDataCount)
+    , d_inflated(InflatedSize)
+{
+    ::memset(d_deflater, 0, sizeof(*d_deflater));
+    ::memset(d_inflater, 0, sizeof(*d_inflater));
+}
+
+TokenCompressor::~TokenCompressor()
+{
+    if (d_deflaterReady) {
+        deflateEnd(d_deflater);
+    }
+    if (d_inflaterReady) {
+        inflateEnd(d_inflater);
+    }
+    delete d_deflater;
+    delete d_inflater;
+}
+
+int64_t TokenCompressor::sendToken(int32_t token, const char *data, int size, const char *block, int blockLength)
+{
+    int64_t bytes = 0;
+
+    if (d_lastToken == -1) {
+        // This is the first token of a file.
+        if (!d_deflaterReady) {
+            if (deflateInit2(d_deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                LOG_FATAL(RSYNC_ZLIB) << "Failed to initialize the compressor" << LOG_END
+            }
+            d_deflaterReady = true;
+        } else {
+            deflateReset(d_deflater);
+        }
+        d_lastRunEnd = 0;
+        d_runStart = token;
+        d_flushPending = false;
+    } else if (d_lastToken == -2) {
+        d_runStart = token;
+    } else if (size != 0 || token != d_lastToken + 1 || token >= d_runStart + 65536) {
+        // The current run has ended, so send it out.
+        int32_t relative = d_runStart - d_lastRunEnd;
+        int32_t run = d_lastToken - d_runStart;
+        if (relative >= 0 && relative <= 63) {
+            d_stream->writeUInt8(static_cast<uint8_t>((run == 0 ? TokenRel : TokenRunRel) + relative));
+            bytes += 1;
+        } else {
+            d_stream->writeUInt8(static_cast<uint8_t>(run == 0 ? TokenLong : TokenRunLong));
+            d_stream->writeInt32(d_runStart);
+            bytes += 5;
+        }
+        if (run != 0) {
+            d_stream->writeUInt8(static_cast<uint8_t>(run & 0xff));
+            d_stream->writeUInt8(static_cast<uint8_t>((run >> 8) & 0xff));
+            bytes += 2;
+        }
+        d_lastRunEnd = d_lastToken;
+        d_runStart = token;
+    }
+
+    d_lastToken = token;
+
+    if (size != 0 || d_flushPending) {
+        bytes += deflateData(token, data, size);
+        d_flushPending = token == -2;
+    }
+
+    if (token == -1) {
+        d_stream->writeUInt8(EndFlag);
+        bytes += 1;
+    } else if (token != -2) {
+        // Add the matched block to the history of the compressor, which has just been flushed, without producing any
+        // output.  The receiver adds the block as stored blocks of no more than 'MaxStoredLength' bytes, and before
+        // protocol 31 every such piece starts at the beginning of the block.
+        int offset = 0;
+        while (blockLength > 0) {
+            int length = std::min(blockLength, MaxStoredLength);
+            blockLength -= length;
+            if (deflateSetDictionary(d_deflater, toBytes(block + offset), length) != Z_OK) {
+                LOG_FATAL(RSYNC_ZLIB) << "Failed to add a matched block to the compressor" << LOG_END
+            }
+            if (d_protocol >= 31) {
+                offset += length;
+            }
+        }
+    }
+
+    return bytes;
+}
+
+int64_t TokenCompressor::deflateData(int32_t token, const char *data, int size)
+{
+    int64_t bytes = 0;
+    char *output = &d_output[0];
+    int flush = Z_NO_FLUSH;
+
+    d_deflater->avail_in = 0;
+    d_deflater->avail_out = 0;
+    do {
+        if (d_deflater->avail_in == 0 && size != 0) {
+            int length = std::min(size, ChunkSize);
+            d_deflater->next_in = toBytes(data);
+            d_deflater->avail_in = length;
+            data += length;
+            size -= length;
+        }
+        if (d_deflater->avail_out == 0) {
+            d_deflater->next_out = reinterpret_cast<Bytef *>(output + 2);
+            d_deflater->avail_out = MaxDataCount;
+            if (flush != Z_NO_FLUSH) {
+                // The last 4 bytes of the previous output were held back in case they were the end of the flush.
+                ::memcpy(d_deflater->next_out, output + MaxDataCount - 2, 4);
+                d_deflater->next_out += 4;
+                d_deflater->avail_out -= 4;
+            }
+        }
+        if (size == 0 && token != -2) {
+            flush = Z_SYNC_FLUSH;
+        }
+
+        int rc = deflate(d_deflater, flush);
+        if (rc != Z_OK) {
+            LOG_FATAL(RSYNC_ZLIB) << "Failed to compress data: deflate returned " << rc << LOG_END
+        }
+
+        if (size == 0 || d_deflater->avail_out == 0) {
+            int length = MaxDataCount - d_deflater->avail_out;
+            if (flush != Z_NO_FLUSH) {
+                // A flush always ends with 0, 0, 0xff, 0xff, which the receiver puts back by itself.
+                length -= 4;
+            }
+            if (length > 0) {
+                output[0] = static_cast<char>(DeflatedData + (length >> 8));
+                output[1] = static_cast<char>(length & 0xff);
+                d_stream->write(output, length + 2);
+                bytes += length + 2;
+            }
+        }
+    } while (size != 0 || d_deflater->avail_out == 0);
+
+    return bytes;
+}
+
+int32_t TokenCompressor::receiveToken(const char **data, int64_t *bytesRead)
+{
+    while (true) {
+        switch (d_receiveState) {
+        case RECEIVE_INIT:
+            if (!d_inflaterReady) {
+                if (inflateInit2(d_inflater, -15) != Z_OK) {
+                    LOG_FATAL(RSYNC_ZLIB) << "Failed to initialize the decompressor" << LOG_END
+                }
+                d_inflaterReady = true;
+            } else {
+                inflateReset(d_inflater);
+            }
+            d_receiveState = RECEIVE_IDLE;
+            d_receivedToken = 0;
+            break;
+
+        case RECEIVE_IDLE:
+        case RECEIVE_INFLATED: {
+            int flag;
+            if (d_savedFlag) {
+                flag = d_savedFlag & 0xff;
+                d_savedFlag = 0;
+            } else {
+                flag = d_stream->readUInt8();
+                *bytesRead += 1;
+            }
+
+            if ((flag & 0xc0) == DeflatedData) {
+                int length = ((flag & 0x3f) << 8) + d_stream->readUInt8();
+                d_stream->read(&d_input[0], length);
+                *bytesRead += 1 + length;
+                d_inflater->next_in = toBytes(&d_input[0]);
+                d_inflater->avail_in = length;
+                d_receiveState = RECEIVE_INFLATING;
+                break;
+            }
+
+            if (d_receiveState == RECEIVE_INFLATED) {
+                // Make sure all data inflated so far has been returned.
+                d_inflater->avail_in = 0;
+                d_inflater->next_out = reinterpret_cast<Bytef *>(&d_inflated[0]);
+                d_inflater->avail_out = InflatedSize;
+                int rc = inflate(d_inflater, Z_SYNC_FLUSH);
+                int length = InflatedSize - d_inflater->avail_out;
+                if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                    LOG_FATAL(RSYNC_ZLIB) << "Failed to decompress data: inflate returned " << rc << LOG_END
+                }
+                if (length != 0 && rc != Z_BUF_ERROR) {
+                    // Handle the flag after this data has been consumed.
+                    d_savedFlag = flag + 0x10000;
+                    *data = &d_inflated[0];
+                    return length;
+                }
+
+                // The sender has flushed its stream, but didn't send the last 4 bytes of the flush.
+                if (!inflateSyncPoint(d_inflater)) {
+                    LOG_FATAL(RSYNC_ZLIB) << "The decompressor lost sync" << LOG_END
+                }
+                d_input[0] = d_input[1] = 0;
+                d_input[2] = d_input[3] = static_cast<char>(0xff);
+                d_inflater->next_in = toBytes(&d_input[0]);
+                d_inflater->avail_in = 4;
+                inflate(d_inflater, Z_SYNC_FLUSH);
+                d_receiveState = RECEIVE_IDLE;
+            }
+
+            if (flag == EndFlag) {
+                d_receiveState = RECEIVE_INIT;
+                return 0;
+            }
+
+            // This must be a match or a run of matches.
+            if (flag & TokenRel) {
+                d_receivedToken += flag & 0x3f;
+                flag >>= 6;
+            } else {
+                d_receivedToken = d_stream->readInt32();
+                *bytesRead += 4;
+            }
+            if (flag & 1) {
+                d_run = d_stream->readUInt8();
+                d_run += d_stream->readUInt8() << 8;
+                *bytesRead += 2;
+                d_receiveState = RECEIVE_RUNNING;
+            }
+            return -1 - d_receivedToken;
+        }
+
+        case RECEIVE_INFLATING: {
+            d_inflater->next_out = reinterpret_cast<Bytef *>(&d_inflated[0]);
+            d_inflater->avail_out = InflatedSize;
+            int rc = inflate(d_inflater, Z_NO_FLUSH);
+            int length = InflatedSize - d_inflater->avail_out;
+            if (rc != Z_OK) {
+                LOG_FATAL(RSYNC_ZLIB) << "Failed to decompress data: inflate returned " << rc << LOG_END
+            }
+            if (d_inflater->avail_in == 0) {
+                d_receiveState = RECEIVE_INFLATED;
+            }
+            if (length != 0) {
+                *data = &d_inflated[0];
+                return length;
+            }
+            break;
+        }
+
+        case RECEIVE_RUNNING:
+            ++d_receivedToken;
+            if (--d_run == 0) {
+                d_receiveState = RECEIVE_IDLE;
+            }
+            return -1 - d_receivedToken;
+        }
+    }
+}
+
+void TokenCompressor::seeToken(const char *block, int blockLength)
+{
+    // Feed the block to the decompressor as stored blocks, each preceded by a made-up header.
+    unsigned char header[5];
+    int storedLength = 0;
+
+    header[0] = 0;
+    d_inflater->avail_in = 0;
+    do {
+        if (d_inflater->avail_in == 0 && blockLength != 0) {
+            if (storedLength == 0) {
+                storedLength = std::min(blockLength, MaxStoredLength);
+                header[1] = static_cast<unsigned char>(storedLength & 0xff);
+                header[2] = static_cast<unsigned char>(storedLength >> 8);
+                header[3] = static_cast<unsigned char>(~header[1]);
+                header[4] = static_cast<unsigned char>(~header[2]);
+                d_inflater->next_in = header;
+                d_inflater->avail_in = sizeof(header);
+            } else {
+                d_inflater->next_in = toBytes(block);
+                d_inflater->avail_in = storedLength;
+                if (d_protocol >= 31) {
+                    block += storedLength;
+                }
+                blockLength -= storedLength;
+                storedLength = 0;
+            }
+        }
+        d_inflater->next_out = reinterpret_cast<Bytef *>(&d_inflated[0]);
+        d_inflater->avail_out = InflatedSize;
+        int rc = inflate(d_inflater, Z_SYNC_FLUSH);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            LOG_FATAL(RSYNC_ZLIB) << "Failed to add a matched block to the decompressor: inflate returned " << rc
+                                  << LOG_END
+        }
+    } while (blockLength != 0 || d_inflater->avail_out == 0);
+}
+
+} // close namespace rsync
@@ -0,0 +1,99 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#ifndef INCLUDED_RSYNC_TOKENCOMPRESSOR_H
+#define INCLUDED_RSYNC_TOKENCOMPRESSOR_H
+
+#include <stdint.h>
+
+#include <vector>
+
+struct z_stream_s;
+
+namespace rsync
+{
+
+class Stream;
+
+// This class sends and receives the file content in the compressed token format used by rsync when the '-z' option
+// is given.  Literal data is compressed with a single raw deflate stream per file, which is flushed before each
+// match so that matches can be sent as tokens in between.  The content of each matched block is added to the history
+// of the stream on both sides without being sent, so literal data can still refer to it.
+//
+// Matches are encoded as block numbers relative to the end of the previous run of consecutive blocks, and such runs
+// are sent as a single token.
+class TokenCompressor
+{
+public:
+
+    // Create a compressor that sends and receives tokens over 'stream' for the protocol version 'protocol'.
+    TokenCompressor(Stream *stream, int32_t protocol);
+
+    ~TokenCompressor();
+
+    // Send 'size' bytes of literal data from 'data' followed by the match of the block 'token'.  'token' can also
+    // be -1 to mark the end of the file, or -2 to send the literal data only.  For a match, 'block' and
+    // 'blockLength' are the content of the matched block.  Return the number of bytes written to the stream.
+    int64_t sendToken(int32_t token, const char *data, int size, const char *block, int blockLength);
+
+    // Receive the next token.  Return the number of bytes of literal data pointed to by '*data' if positive,
+    // -(block + 1) for a match, or 0 at the end of the file.  The number of bytes read from the stream is added to
+    // '*bytesRead'.
+    int32_t receiveToken(const char **data, int64_t *bytesRead);
+
+    // Add the content of the block just returned by 'receiveToken()' to the history of the decompressor.
+    void seeToken(const char *block, int blockLength);
+
+private:
+    // NOT IMPLEMENTED
+    TokenCompressor(const TokenCompressor&);
+    TokenCompressor& operator=(const TokenCompressor&);
+
+    enum ReceiveState {
+        RECEIVE_INIT,              // at the start of a file
+        RECEIVE_IDLE,              // waiting for the next flag
+        RECEIVE_INFLATING,         // compressed data has been received but not all inflated
+        RECEIVE_INFLATED,          // all compressed data received has been inflated
+        RECEIVE_RUNNING            // in the middle of a run of consecutive blocks
+    };
+
+    // Compress 'size' bytes from 'data' and send them out, flushing the compressed stream unless 'token' is -2.
+    // Return the number of bytes written.
+    int64_t deflateData(int32_t token, const char *data, int size);
+
+    Stream *d_stream;              // the stream tokens are sent to and received from
+    int32_t d_protocol;            // the protocol version
+
+    z_stream_s *d_deflater;        // the compressed stream for sending
+    bool d_deflaterReady;          // whether 'd_deflater' has been initialized
+    int32_t d_lastToken;           // the last token sent; -1 at the start of a file
+    int32_t d_runStart;            // the first block of the current run
+    int32_t d_lastRunEnd;          // the last block of the previous run
+    bool d_flushPending;           // whether data has been compressed but not flushed
+    std::vector<char> d_output;    // the buffer for compressed data being sent
+
+    z_stream_s *d_inflater;        // the compressed stream for receiving
+    bool d_inflaterReady;          // whether 'd_inflater' has been initialized
+    ReceiveState d_receiveState;   // where the receiver is in the token stream
+    int32_t d_receivedToken;       // the last block received
+    int32_t d_run;                 // the number of blocks left in the current run
+    int d_savedFlag;               // a flag that has been read but not yet handled; 0 if none
+    std::vector<char> d_input;     // the buffer for compressed data received
+    std::vector<char> d_inflated;  // the buffer for inflated data
+};
+
+} // close namespace rsync
+
+#endif // INCLUDED_RSYNC_TOKENCOMPRESSOR_H
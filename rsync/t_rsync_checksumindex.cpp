@@ -0,0 +1,107 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_checksumindex.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <cstdlib>
+#include <vector>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+uint32_t getRandomChecksum()
+{
+    return (static_cast<uint32_t>(std::rand()) << 16) ^ static_cast<uint32_t>(std::rand());
+}
+
+// Build an index of 'count' blocks whose checksums are drawn from 'distinct' values, and compare every lookup with
+// a multimap.
+void testIndex(ChecksumIndex *index, int count, int distinct)
+{
+    std::vector<uint32_t> values;
+    for (int i = 0; i < distinct; ++i) {
+        values.push_back(getRandomChecksum());
+    }
+
+    std::vector<uint32_t> checksums;
+    index->reset(count);
+    for (int i = 0; i < count; ++i) {
+        checksums.push_back(values[std::rand() % distinct]);
+        index->add(i, checksums[i]);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        // The chain must visit every block with the same checksum, from the last one added to the first one.
+        int expected = count;
+        for (int block = index->find(checksums[i]); block != -1; block = index->next(block)) {
+            ASSERT(block < expected);
+            ASSERT(checksums[block] == checksums[i]);
+            for (int j = block + 1; j < expected; ++j) {
+                ASSERT(checksums[j] != checksums[i]);
+            }
+            expected = block;
+        }
+        for (int j = 0; j < expected; ++j) {
+            ASSERT(checksums[j] != checksums[i]);
+        }
+    }
+
+    for (int i = 0; i < 1000; ++i) {
+        uint32_t checksum = getRandomChecksum();
+        bool found = false;
+        for (int j = 0; j < count && !found; ++j) {
+            found = checksums[j] == checksum;
+        }
+        if (!found) {
+            ASSERT(index->find(checksum) == -1);
+        }
+    }
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    ChecksumIndex index;
+    ASSERT(index.find(0) == -1);
+    ASSERT(index.find(getRandomChecksum()) == -1);
+
+    // Grow and shrink the same index to make sure nothing is left over from the previous file.
+    testIndex(&index, 1, 1);
+    testIndex(&index, 1000, 1000);
+    testIndex(&index, 1000, 10);
+    testIndex(&index, 5000, 4000);
+    testIndex(&index, 10, 3);
+
+    index.reset(3);
+    index.add(0, 0);
+    index.add(1, 0xffffffff);
+    index.add(2, 0);
+    ASSERT(index.find(0) == 2);
+    ASSERT(index.next(2) == 0);
+    ASSERT(index.next(0) == -1);
+    ASSERT(index.find(0xffffffff) == 1);
+    ASSERT(index.next(1) == -1);
+
+    index.reset(0);
+    ASSERT(index.find(0) == -1);
+
+    return ASSERT_COUNT;
+}
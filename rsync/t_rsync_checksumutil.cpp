@@ -0,0 +1,114 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_checksumutil.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <cstdlib>
+#include <cstring>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+// This is the loop that 'Client' used before the vector kernels were added.
+void getReferenceChecksum(const char *chunk, int size, uint32_t &s1, uint32_t &s2)
+{
+    s1 = s2 = 0;
+    for (int i = 0; i < size; ++i) {
+        s1 += static_cast<int32_t>(static_cast<signed char>(chunk[i]));
+        s2 += s1;
+    }
+}
+
+void checkAllKernels(const char *chunk, int size)
+{
+    uint32_t s1, s2;
+    getReferenceChecksum(chunk, size, s1, s2);
+
+    uint32_t t1 = 0, t2 = 0;
+    ChecksumUtil::getRollingChecksum(chunk, size, &t1, &t2);
+    ASSERT(t1 == s1);
+    ASSERT(t2 == s2);
+
+    ChecksumUtil::Kernel kernels[] = { ChecksumUtil::SCALAR, ChecksumUtil::SSE2, ChecksumUtil::AVX2 };
+    for (unsigned int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+        if (!ChecksumUtil::isKernelSupported(kernels[i])) {
+            ASSERT(!ChecksumUtil::getRollingChecksum(kernels[i], chunk, size, &t1, &t2));
+            continue;
+        }
+        t1 = t2 = 0;
+        ASSERT(ChecksumUtil::getRollingChecksum(kernels[i], chunk, size, &t1, &t2));
+        ASSERT(t1 == s1);
+        ASSERT(t2 == s2);
+    }
+}
+
+void testRandomData()
+{
+    const int maxSize = 0x20000 + 64;
+    char *buffer = new char[maxSize];
+    for (int i = 0; i < maxSize; ++i) {
+        buffer[i] = static_cast<char>(std::rand());
+    }
+
+    // Every length around the vector widths, at every alignment.
+    for (int offset = 0; offset < 32; ++offset) {
+        for (int size = 0; size <= 200; ++size) {
+            checkAllKernels(buffer + offset, size);
+        }
+    }
+
+    // Typical block lengths.
+    int sizes[] = { 700, 701, 4096, 65535, 65536, 0x20000 - 1, 0x20000 };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        checkAllKernels(buffer, sizes[i]);
+        checkAllKernels(buffer + 7, sizes[i]);
+    }
+
+    delete [] buffer;
+}
+
+void testExtremeBytes()
+{
+    // Make sure the sums wrap around exactly the same way.
+    const int size = 0x20000;
+    char *buffer = new char[size];
+
+    char values[] = { 0, 1, 0x7f, static_cast<char>(0x80), static_cast<char>(0xff) };
+    for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        ::memset(buffer, values[i], size);
+        checkAllKernels(buffer, size);
+        checkAllKernels(buffer, size - 5);
+    }
+
+    delete [] buffer;
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    ASSERT(ChecksumUtil::isKernelSupported(ChecksumUtil::SCALAR));
+    ASSERT(ChecksumUtil::isKernelSupported(ChecksumUtil::getDefaultKernel()));
+
+    testRandomData();
+    testExtremeBytes();
+
+    return ASSERT_COUNT;
+}
@@ -0,0 +1,214 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+#include <rsync/rsync_directoryscanner.h>
+
+#include <rsync/rsync_entry.h>
+#include <rsync/rsync_entrypool.h>
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_filter.h>
+#include <rsync/rsync_pathutil.h>
+#include <rsync/rsync_util.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+// Create a random tree of files and directories under 'path', 'depth' levels deep.
+void createTree(const std::string &path, int depth)
+{
+    int count = 1 + std::rand() % 8;
+    for (int i = 0; i < count; ++i) {
+        std::stringstream name;
+        name << (std::rand() % 2 ? "d" : "f") << std::rand() % 1000;
+        std::string child = PathUtil::join(path.c_str(), name.str().c_str());
+        if (PathUtil::exists(child.c_str())) {
+            continue;
+        }
+        if (depth > 0 && std::rand() % 2) {
+            ASSERT(PathUtil::createDirectory(child.c_str()));
+            createTree(child, depth - 1);
+        } else {
+            File file(child.c_str(), true);
+            ASSERT(file.write(name.str().c_str(), static_cast<int>(name.str().size())) > 0);
+        }
+    }
+}
+
+// Return the paths of 'entries' in order.
+std::vector<std::string> getPaths(const std::vector<Entry*> &entries)
+{
+    std::vector<std::string> paths;
+    for (unsigned int i = 0; i < entries.size(); ++i) {
+        paths.push_back(entries[i]->getPath());
+    }
+    return paths;
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    std::string top = PathUtil::join(PathUtil::getCurrentDirectory().c_str(), "test_dir");
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    ASSERT(PathUtil::createDirectory(top.c_str()));
+    createTree(top, 5);
+
+    // The file list built one directory at a time.
+    std::vector<Entry*> expected, directories;
+    Util::EntryListReleaser expectedReleaser(&expected);
+    PathUtil::listDirectory(top.c_str(), "", &expected, &directories, true);
+    while (directories.size()) {
+        Entry *entry = directories.back();
+        directories.pop_back();
+        expected.push_back(entry);
+        PathUtil::listDirectory(top.c_str(), entry->getPath(), &expected, &directories, true);
+    }
+    ASSERT(expected.size() > 0);
+
+    for (int threads = 0; threads < 9; threads += 4) {
+        int cancelFlag = 0;
+        DirectoryScanner scanner(threads, &cancelFlag);
+        // The order the entries are looked up in doesn't change the result.
+        for (int i = 0; i < 3; ++i) {
+            std::vector<Entry*> fileList;
+            Util::EntryListReleaser fileListReleaser(&fileList);
+            fileList.push_back(new Entry("./", true, 0, 0, 0));
+            scanner.setInodeOrderEnabled(i == 1);
+            ASSERT(scanner.scan(top.c_str(), true, &fileList));
+            ASSERT(fileList.size() == expected.size() + 1);
+            delete fileList[0];
+            fileList.erase(fileList.begin());
+            ASSERT(getPaths(fileList) == getPaths(expected));
+            for (unsigned int j = 0; j < fileList.size(); ++j) {
+                ASSERT(fileList[j]->isDirectory() == expected[j]->isDirectory());
+                ASSERT(fileList[j]->getSize() == expected[j]->getSize());
+            }
+        }
+
+        // Entries created in a pool stay valid until the pool is destroyed.
+        EntryPool pool;
+        std::vector<Entry*> fileList;
+        ASSERT(scanner.scan(top.c_str(), true, &fileList, &pool));
+        ASSERT(getPaths(fileList) == getPaths(expected));
+
+        // Entries retrieved while the scan is in progress come in the same order.
+        {
+            std::vector<Entry*> fileList;
+            Util::EntryListReleaser fileListReleaser(&fileList);
+            scanner.start(top.c_str(), true);
+            while (scanner.next(&fileList)) {
+            }
+            ASSERT(!scanner.next(&fileList));
+            ASSERT(getPaths(fileList) == getPaths(expected));
+        }
+
+        // The entries not retrieved are released with the scanner, or with the pools of its workers.
+        for (int i = 0; i < 2; ++i) {
+            EntryPool pool;
+            std::vector<Entry*> fileList;
+            std::vector<Entry*> pooledList;
+            Util::EntryListReleaser fileListReleaser(&fileList);
+            {
+                DirectoryScanner partialScanner(threads, &cancelFlag);
+                partialScanner.start(top.c_str(), true, i == 0 ? &pool : 0);
+                ASSERT(partialScanner.next(i == 0 ? &pooledList : &fileList));
+                if (i == 0) {
+                    ASSERT(pooledList.size() <= expected.size());
+                    ASSERT(getPaths(pooledList) ==
+                           getPaths(std::vector<Entry*>(expected.begin(), expected.begin() + pooledList.size())));
+                }
+            }
+            ASSERT(fileList.size() <= expected.size());
+            ASSERT(getPaths(fileList) ==
+                   getPaths(std::vector<Entry*>(expected.begin(), expected.begin() + fileList.size())));
+        }
+    }
+
+    // Excluded entries are left out, along with everything under excluded directories.
+    Filter filter;
+    filter.add("- f*[13]");
+    filter.add("- /d*[24]/");
+    filter.add("- d*/d*[57]/");
+    std::vector<Entry*> included;
+    for (unsigned int i = 0; i < expected.size(); ++i) {
+        if (!filter.isPathExcluded(expected[i]->getPath(), expected[i]->isDirectory())) {
+            included.push_back(expected[i]);
+        }
+    }
+    for (int threads = 0; threads < 5; threads += 4) {
+        for (int i = 0; i < 2; ++i) {
+            int cancelFlag = 0;
+            EntryPool pool;
+            std::vector<Entry*> fileList;
+            std::vector<Entry*> pooledList;
+            Util::EntryListReleaser fileListReleaser(&fileList);
+            DirectoryScanner scanner(threads, &cancelFlag);
+            scanner.setFilter(&filter);
+            ASSERT(scanner.scan(top.c_str(), true, i == 0 ? &pooledList : &fileList, i == 0 ? &pool : 0));
+            ASSERT(getPaths(i == 0 ? pooledList : fileList) == getPaths(included));
+        }
+    }
+
+    // Nothing more is listed once cancelled.
+    {
+        int cancelFlag = 1;
+        DirectoryScanner scanner(2, &cancelFlag);
+        std::vector<Entry*> fileList;
+        Util::EntryListReleaser fileListReleaser(&fileList);
+        ASSERT(!scanner.scan(top.c_str(), true, &fileList));
+        ASSERT(fileList.empty());
+    }
+
+    // Or once stopped, in which case the entries already listed are still handed out in order, while directories
+    // not listed yet come without their entries.
+    for (int threads = 0; threads < 5; threads += 4) {
+        int cancelFlag = 0;
+        std::atomic<bool> stopFlag(false);
+        DirectoryScanner scanner(threads, &cancelFlag);
+        scanner.setStopFlag(&stopFlag);
+        std::vector<Entry*> fileList;
+        Util::EntryListReleaser fileListReleaser(&fileList);
+        scanner.start(top.c_str(), true);
+        ASSERT(scanner.next(&fileList));
+        stopFlag = true;
+        while (scanner.next(&fileList)) {
+        }
+        unsigned int j = 0;
+        for (unsigned int i = 0; i < fileList.size(); ++i) {
+            while (j < expected.size() && ::strcmp(expected[j]->getPath(), fileList[i]->getPath())) {
+                ++j;
+            }
+            ASSERT(j++ < expected.size());
+        }
+
+        std::vector<Entry*> stoppedList;
+        ASSERT(!scanner.scan(top.c_str(), true, &stoppedList));
+        ASSERT(stoppedList.empty());
+    }
+
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    return ASSERT_COUNT;
+}
@@ -0,0 +1,564 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_client.h>
+
+#include <rsync/rsync_entry.h>
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_io.h>
+#include <rsync/rsync_log.h>
+#include <rsync/rsync_pathutil.h>
+#include <rsync/rsync_stream.h>
+#include <rsync/rsync_util.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+//qi: TEST_PROGRAM = 1
+//qi: LDFLAGS += -lssh2 -lssl -lcrypto -lz
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+const int64_t RemoteTime = 1500000000;
+
+// The file whose first transfer is corrupted, so that it has to be downloaded again.
+const char *FlakyFile = "a/old";
+
+struct RemoteEntry
+{
+    const char *d_path;
+    const char *d_content;         // 0 for a directory
+};
+
+// The remote tree, directory by directory, each in the order of the server: files first, then directories.
+const RemoteEntry RemoteEntries[] = {
+    { ".", 0 },
+    { "file1", "the first file" },
+    { "same", "unchanged" },
+    { "a", 0 },
+    { "d", 0 },
+    { "a/old", "the new content of an old file" },
+    { "a/x", "x" },
+    { "a/b", 0 },
+    { "a/c", 0 },
+    { "d/z", "z" },
+    { "a/b/y", "y" },
+};
+const int NumberOfRemoteEntries = sizeof(RemoteEntries) / sizeof(RemoteEntries[0]);
+
+// Return the directory of the entry at 'index' of 'RemoteEntries', which is empty for the top directory.
+std::string getParent(int index)
+{
+    std::string path = RemoteEntries[index].d_path;
+    size_t slash = path.rfind('/');
+    return (path == "." || slash == std::string::npos) ? "" : path.substr(0, slash);
+}
+
+// Append the entries of 'RemoteEntries' in the directory 'directory' to 'entries', followed by the entries under
+// each subdirectory if 'recursive' is true.
+void getEntries(const std::string &directory, bool recursive, std::vector<int> *entries)
+{
+    for (int i = 0; i < NumberOfRemoteEntries; ++i) {
+        if (getParent(i) != directory) {
+            continue;
+        }
+        entries->push_back(i);
+        if (recursive && !RemoteEntries[i].d_content && ::strcmp(RemoteEntries[i].d_path, ".") != 0) {
+            getEntries(RemoteEntries[i].d_path, true, entries);
+        }
+    }
+}
+
+// Collects what the server writes.
+class StringIO : public IO
+{
+public:
+    StringIO(std::string &data)
+        : IO()
+        , d_data(data)
+    {
+    }
+
+    virtual int read(char *, int)
+    {
+        return 0;
+    }
+
+    virtual int write(const char *buffer, int size)
+    {
+        d_data.append(buffer, size);
+        return size;
+    }
+
+    virtual bool isReadable(int) { return false; }
+    virtual bool isWritable(int) { return true; }
+    virtual bool isClosed() { return false; }
+    virtual void createChannel(const char*, int*) {}
+    virtual void closeChannel() {}
+    virtual void getConnectInfo(std::string*, std::string*, std::string*) {}
+    virtual void flush() {}
+
+private:
+    // NOT IMPLEMENTED
+    StringIO(const StringIO&);
+    StringIO& operator=(const StringIO&);
+
+    std::string &d_data;
+};
+
+// A daemon serving 'RemoteEntries' as the sender, which answers whatever the client has written whenever the client
+// runs out of data to read.  It follows protocol 30, with incremental recursion if the client asks for it, in which
+// case a segment of the file list is sent each time the client has had nothing to read for a while.  Anything the
+// server would reject fails an assertion.
+class ScriptedServer : public IO
+{
+public:
+    ScriptedServer()
+        : IO()
+        , d_output("@RSYNCD: 30.0\n@RSYNCD: OK\n")
+        , d_outputPosition(0)
+        , d_outputIO(d_output)
+        , d_stream(&d_outputIO)
+        , d_input()
+        , d_data()
+        , d_dataPosition(0)
+        , d_started(false)
+        , d_incremental(false)
+        , d_lastIndex(-1)
+        , d_idleReads(0)
+        , d_segments()
+        , d_directories()
+        , d_nextDirectory(1)
+        , d_nextIndex(0)
+        , d_listEnded(false)
+        , d_finished(0)
+        , d_phase(0)
+        , d_requests()
+        , d_basisRequests()
+    {
+    }
+
+    virtual int read(char *buffer, int size)
+    {
+        if (d_outputPosition == d_output.size()) {
+            respond();
+        }
+        int bytes = static_cast<int>(std::min<size_t>(size, d_output.size() - d_outputPosition));
+        ::memcpy(buffer, d_output.data() + d_outputPosition, bytes);
+        d_outputPosition += bytes;
+        return bytes;
+    }
+
+    virtual int write(const char *buffer, int size)
+    {
+        d_input.append(buffer, size);
+        return size;
+    }
+
+    // Only called when the client is blocked on a read, which the server must be able to answer.
+    virtual bool isReadable(int)
+    {
+        for (int i = 0; i < IdleReadsPerSegment && d_outputPosition == d_output.size(); ++i) {
+            respond();
+        }
+        if (d_outputPosition == d_output.size()) {
+            LOG_FATAL(TEST_STALLED) << "The client is waiting for data the server would never send" << LOG_END
+        }
+        return true;
+    }
+
+    virtual bool isWritable(int) { return true; }
+    virtual bool isClosed() { return false; }
+    virtual void createChannel(const char*, int*) {}
+    virtual void closeChannel() {}
+    virtual void getConnectInfo(std::string*, std::string*, std::string*) {}
+    virtual void flush() {}
+
+    bool isIncremental() const
+    {
+        return d_incremental;
+    }
+
+    // Return true if all segments of the file list have been sent and finished.
+    bool isListFinished() const
+    {
+        return d_listEnded && (!d_incremental || d_segments.empty());
+    }
+
+    int getNumberOfSegments() const
+    {
+        return d_finished;
+    }
+
+    // Return the number of times the file at 'path' was asked for, and with a basis file.
+    int getRequests(const std::string &path)
+    {
+        return d_requests[path];
+    }
+
+    int getBasisRequests(const std::string &path)
+    {
+        return d_basisRequests[path];
+    }
+
+private:
+    // NOT IMPLEMENTED
+    ScriptedServer(const ScriptedServer&);
+    ScriptedServer& operator=(const ScriptedServer&);
+
+    // The number of reads with nothing to answer before the next segment is sent.
+    enum { IdleReadsPerSegment = 3 };
+
+    struct Segment
+    {
+        int d_firstIndex;          // the index of the first entry
+        std::vector<int> d_entries;    // positions in 'RemoteEntries'
+    };
+
+    // Answer everything the client has written so far.
+    void respond()
+    {
+        if (!d_started) {
+            // The arguments, each ending with a null, end with an empty one.
+            size_t end = d_input.find(std::string("\0\0", 2));
+            if (end == std::string::npos) {
+                return;
+            }
+            d_incremental = d_input.find(std::string("\0-tude.i\0", 9)) < end;
+            d_input.erase(0, end + 2);
+            d_started = true;
+
+            d_stream.writeUInt8(d_incremental ? 1 : 0);
+            d_stream.writeInt32(4242);
+            d_stream.enableBuffer();
+            d_stream.enableWriteMultiplex();
+            d_nextIndex = d_incremental ? 1 : 0;
+            sendSegment(-1);
+            d_stream.flushWriteBuffer();
+            d_listEnded = !d_incremental;
+
+            // The filter rules are never more than the empty one ending them.
+            d_dataPosition = 4;
+            return;
+        }
+
+        // Everything the client writes after the arguments is multiplexed.
+        while (d_input.size() >= 4) {
+            uint32_t flag;
+            ::memcpy(&flag, d_input.data(), 4);
+            size_t length = flag & 0xffffff;
+            if (d_input.size() < 4 + length) {
+                break;
+            }
+            d_data.append(d_input, 4, length);
+            d_input.erase(0, 4 + length);
+        }
+
+        bool answered = false;
+        int index;
+        while (readRequest(&index)) {
+            answered = true;
+            if (index == Stream::INDEX_DONE) {
+                finishSegment();
+            }
+        }
+
+        d_idleReads = answered ? 0 : d_idleReads + 1;
+        if (d_idleReads >= IdleReadsPerSegment && d_incremental && !d_listEnded) {
+            d_idleReads = 0;
+            if (d_nextDirectory < d_directories.size()) {
+                sendSegment(static_cast<int>(d_nextDirectory++));
+            } else {
+                d_stream.writeIndex(Stream::INDEX_FLIST_EOF);
+                d_listEnded = true;
+            }
+        }
+        d_stream.flushWriteBuffer();
+    }
+
+    // Send the entries in the directory numbered 'directory', or the first segment if 'directory' is -1.
+    void sendSegment(int directory)
+    {
+        Segment segment;
+        segment.d_firstIndex = d_nextIndex;
+        if (directory < 0) {
+            getEntries("", !d_incremental, &segment.d_entries);
+        } else {
+            d_stream.writeIndex(Stream::INDEX_FLIST_OFFSET - directory);
+            getEntries(RemoteEntries[d_directories[directory]].d_path, false, &segment.d_entries);
+        }
+
+        // The entries are sent out of order, as the client has to sort them anyway, but the top directory comes first.
+        std::vector<int> entries(segment.d_entries.rbegin(), segment.d_entries.rend());
+        if (directory < 0) {
+            entries.pop_back();
+            entries.insert(entries.begin(), segment.d_entries[0]);
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const RemoteEntry &remoteEntry = RemoteEntries[entries[i]];
+            int length = static_cast<int>(::strlen(remoteEntry.d_path));
+            d_stream.writeUInt8(0x40);
+            d_stream.writeVariableInt32(length);
+            d_stream.write(remoteEntry.d_path, length);
+            d_stream.writeVariableInt64(remoteEntry.d_content ? ::strlen(remoteEntry.d_content) : 0, 3);
+            d_stream.writeVariableInt64(RemoteTime, 4);
+            d_stream.writeInt32(remoteEntry.d_content ? (Entry::IS_FILE | 0644) : (Entry::IS_DIR | 0755));
+        }
+        d_stream.writeUInt8(0);
+
+        for (size_t i = 0; i < segment.d_entries.size(); ++i) {
+            if (!RemoteEntries[segment.d_entries[i]].d_content) {
+                d_directories.push_back(segment.d_entries[i]);
+            }
+        }
+        d_nextIndex += static_cast<int>(segment.d_entries.size()) + 1;
+        d_segments.push_back(segment);
+    }
+
+    // Read the next index the client has written and answer it if it asks for a file.  Return false if the client
+    // hasn't written it completely.
+    bool readRequest(int *index)
+    {
+        size_t position = d_dataPosition;
+        if (position >= d_data.size()) {
+            return false;
+        }
+        uint8_t byte = d_data[position++];
+        if (byte == 0) {
+            d_dataPosition = position;
+            *index = Stream::INDEX_DONE;
+            return true;
+        }
+
+        // Only files are asked for, so the index can't be negative.
+        ASSERT(byte != 0xff);
+        int value;
+        if (byte == 0xfe) {
+            if (position + 2 > d_data.size()) {
+                return false;
+            }
+            uint8_t high = d_data[position];
+            if (high & 0x80) {
+                if (position + 4 > d_data.size()) {
+                    return false;
+                }
+                value = ((high & 0x7f) << 24) | static_cast<uint8_t>(d_data[position + 1]) |
+                        (static_cast<uint8_t>(d_data[position + 2]) << 8) |
+                        (static_cast<uint8_t>(d_data[position + 3]) << 16);
+                position += 4;
+            } else {
+                value = d_lastIndex + ((high << 8) | static_cast<uint8_t>(d_data[position + 1]));
+                position += 2;
+            }
+        } else {
+            value = d_lastIndex + byte;
+        }
+
+        // The flags and the header of the signatures follow.
+        if (position + 18 > d_data.size()) {
+            return false;
+        }
+        int32_t header[4];
+        ::memcpy(header, d_data.data() + position + 2, sizeof(header));
+        size_t end = position + 18 + static_cast<size_t>(header[0]) * (4 + header[2]);
+        if (end > d_data.size()) {
+            return false;
+        }
+        d_dataPosition = end;
+        d_lastIndex = value;
+        *index = value;
+        sendFile(value, header);
+        return true;
+    }
+
+    // Send the file at 'index', echoing 'header'.
+    void sendFile(int index, const int32_t header[4])
+    {
+        const RemoteEntry *entry = 0;
+        for (size_t i = 0; i < d_segments.size(); ++i) {
+            int offset = index - d_segments[i].d_firstIndex;
+            if (offset >= 0 && offset < static_cast<int>(d_segments[i].d_entries.size())) {
+                entry = &RemoteEntries[d_segments[i].d_entries[offset]];
+            }
+        }
+        ASSERT(entry && entry->d_content);
+        if (!entry || !entry->d_content) {
+            LOG_FATAL(TEST_INDEX) << "The client asked for an unknown index " << index << LOG_END
+        }
+
+        int count = ++d_requests[entry->d_path];
+        if (header[0] > 0) {
+            ++d_basisRequests[entry->d_path];
+        }
+
+        d_stream.writeIndex(index);
+        d_stream.writeUInt16(0x8000);
+        for (int i = 0; i < 4; ++i) {
+            d_stream.writeInt32(header[i]);
+        }
+        int length = static_cast<int>(::strlen(entry->d_content));
+        d_stream.writeInt32(length);
+        d_stream.write(entry->d_content, length);
+        d_stream.writeInt32(0);
+
+        Util::md_struct context;
+        char digest[16];
+        Util::md_init(30, &context);
+        Util::md_update(30, &context, entry->d_content, length);
+        Util::md_final(30, &context, digest);
+        if (count == 1 && ::strcmp(entry->d_path, FlakyFile) == 0) {
+            digest[0] ^= 1;
+        }
+        d_stream.write(digest, sizeof(digest));
+    }
+
+    // Handle the end of a segment, or of a phase.
+    void finishSegment()
+    {
+        if (d_incremental && !d_segments.empty()) {
+            // The last segment sent would be taken as the end of the list.
+            ASSERT(d_segments.size() > 1 || d_listEnded);
+            d_segments.pop_front();
+            ++d_finished;
+            d_stream.writeIndex(Stream::INDEX_DONE);
+            if (!d_segments.empty()) {
+                return;
+            }
+        } else if (d_phase <= 2) {
+            d_stream.writeIndex(Stream::INDEX_DONE);
+        }
+        ++d_phase;
+    }
+
+    std::string d_output;          // what the server has written
+    size_t d_outputPosition;       // how much of 'd_output' the client has read
+    StringIO d_outputIO;           // appends to 'd_output'
+    Stream d_stream;               // writes to 'd_outputIO'
+
+    std::string d_input;           // what the client has written and the server hasn't read
+    std::string d_data;            // the data the client has written once multiplexed
+    size_t d_dataPosition;         // how much of 'd_data' has been read
+    bool d_started;                // whether the arguments have been received
+    bool d_incremental;            // whether the file list is sent in segments
+    int d_lastIndex;               // the last index received
+    int d_idleReads;               // the number of reads in a row with nothing to answer
+
+    std::deque<Segment> d_segments;        // segments sent and not yet finished
+    std::vector<int> d_directories;        // the directories sent, in order; the top directory is never sent again
+    size_t d_nextDirectory;                // the next directory to send a segment for
+    int d_nextIndex;                       // the index of the first entry of the next segment
+    bool d_listEnded;                      // whether all segments have been sent
+    int d_finished;                        // the number of segments finished
+    int d_phase;                           // the number of phases ended
+
+    std::map<std::string, int> d_requests;         // the number of times each file was asked for
+    std::map<std::string, int> d_basisRequests;    // the number of times each file was asked for with a basis
+};
+
+void createFile(const std::string &path, const char *content, int64_t time)
+{
+    {
+        File file(path.c_str(), true);
+        ASSERT(file.isValid());
+        int length = static_cast<int>(::strlen(content));
+        ASSERT(file.write(content, length) == length);
+    }
+    ASSERT(PathUtil::setModifiedTime(path.c_str(), time));
+}
+
+std::string readFile(const std::string &path)
+{
+    File file(path.c_str());
+    ASSERT(file.isValid());
+    char buffer[256];
+    int bytes = file.isValid() ? file.read(buffer, sizeof(buffer)) : 0;
+    return std::string(buffer, bytes > 0 ? bytes : 0);
+}
+
+// Download 'RemoteEntries' into 'top', where one file is up to date and one is out of date.
+void testDownload(const std::string &top, bool incremental, int numberOfThreads)
+{
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    ASSERT(PathUtil::createDirectory(top.c_str()));
+    ASSERT(PathUtil::createDirectory(PathUtil::join(top.c_str(), "a").c_str()));
+    createFile(PathUtil::join(top.c_str(), "same"), "unchanged", RemoteTime);
+    createFile(PathUtil::join(top.c_str(), "a/old"), "old content", RemoteTime - 3600);
+
+    int cancelFlag = 0;
+    ScriptedServer server;
+    Client client(&server, "rsync", 30, &cancelFlag);
+    client.setIncrementalRecursionEnabled(incremental);
+    client.setSignatureThreads(numberOfThreads, 1024 * 1024);
+    client.setFinalizerThreads(numberOfThreads);
+
+    int updated = -1;
+    try {
+        std::string temporaryFile = top + ".tmp";
+        updated = client.download((top + "/").c_str(), "remote/", temporaryFile.c_str());
+    } catch (Exception &) {
+        ASSERT(false);
+    }
+
+    ASSERT(updated == 5);
+    ASSERT(server.isIncremental() == incremental);
+    ASSERT(server.isListFinished());
+    if (incremental) {
+        ASSERT(server.getNumberOfSegments() == 5);
+    }
+
+    // Only the files out of date are asked for, once, except the one that has to be downloaded again without the
+    // old file.
+    ASSERT(server.getRequests("same") == 0);
+    ASSERT(server.getRequests("file1") == 1);
+    ASSERT(server.getRequests("a/x") == 1);
+    ASSERT(server.getRequests("a/b/y") == 1);
+    ASSERT(server.getRequests("d/z") == 1);
+    ASSERT(server.getRequests(FlakyFile) == 2);
+    ASSERT(server.getBasisRequests(FlakyFile) == 1);
+
+    for (int i = 0; i < NumberOfRemoteEntries; ++i) {
+        std::string path = PathUtil::join(top.c_str(), RemoteEntries[i].d_path);
+        if (RemoteEntries[i].d_content) {
+            ASSERT(readFile(path) == RemoteEntries[i].d_content);
+        } else {
+            ASSERT(PathUtil::isDirectory(path.c_str()));
+        }
+    }
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    std::string top = PathUtil::join(PathUtil::getCurrentDirectory().c_str(), "test_dir");
+
+    // The whole file list at once.
+    testDownload(top, false, 0);
+
+    // The file list in segments, with the files of each segment downloaded as it arrives.
+    testDownload(top, true, 0);
+    testDownload(top, true, 2);
+
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    return ASSERT_COUNT;
+}
@@ -0,0 +1,121 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL. 
+
+
+#include <rsync/rsync_entrypool.h>
+
+#include <rsync/rsync_entry.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    // Entries created by a pool must behave the same as those created on the heap.
+    for (int i = 0; i < 10; ++i) {
+        EntryPool pool;
+        std::vector<Entry*> pooled;
+        std::vector<Entry*> heap;
+
+        int count = 1 + rand() % 5000;
+        for (int j = 0; j < count; ++j) {
+            std::string path;
+            int depth = rand() % 4;
+            for (int k = 0; k <= depth; ++k) {
+                char name[32];
+                snprintf(name, sizeof(name), "%s%d", k == 0 ? "" : "/", rand() % (k == depth ? 1000 : 5));
+                path += name;
+            }
+            // Make some paths long enough not to fit in any block but a new one.
+            if (rand() % 1000 == 0) {
+                path += std::string(64 * 1024 + rand() % 1024, 'x');
+            }
+            bool isDirectory = rand() % 4 == 0;
+            int64_t size = rand();
+            int64_t time = rand();
+            uint32_t mode = isDirectory ? 0 : (rand() % 2 ? Entry::IS_LINK : 0);
+
+            Entry *entry = pool.create(path.c_str(), isDirectory, size, time, mode);
+            Entry *expected = new Entry(path.c_str(), isDirectory, size, time, mode);
+            if (expected->isLink()) {
+                std::string symlink(rand() % 100 + 1, 'a' + rand() % 26);
+                entry->setSymlink(symlink);
+                expected->setSymlink(symlink);
+                if (rand() % 2) {
+                    entry->setSymlink(symlink + "/");
+                    expected->setSymlink(symlink + "/");
+                }
+            }
+            entry->normalizePath();
+            expected->normalizePath();
+            pooled.push_back(entry);
+            heap.push_back(expected);
+        }
+
+        std::sort(pooled.begin(), pooled.end(), Entry::compareGlobally);
+        std::sort(heap.begin(), heap.end(), Entry::compareGlobally);
+
+        for (int j = 0; j < count; ++j) {
+            ASSERT(::strcmp(pooled[j]->getPath(), heap[j]->getPath()) == 0);
+            ASSERT(pooled[j]->isDirectory() == heap[j]->isDirectory());
+            ASSERT(pooled[j]->getSize() == heap[j]->getSize());
+            ASSERT(pooled[j]->getTime() == heap[j]->getTime());
+            ASSERT(pooled[j]->getMode() == heap[j]->getMode());
+            ASSERT(pooled[j]->getLocalName() == heap[j]->getLocalName());
+            if (heap[j]->isLink()) {
+                ASSERT(::strcmp(pooled[j]->getSymlink(), heap[j]->getSymlink()) == 0);
+                ASSERT(pooled[j]->getSymlinkLength() == heap[j]->getSymlinkLength());
+            }
+            if (j > 0) {
+                ASSERT(pooled[j - 1]->contains(pooled[j]) == heap[j - 1]->contains(heap[j]));
+            }
+        }
+
+        for (int j = 0; j < count; ++j) {
+            delete heap[j];
+        }
+
+        // Entries taken over from another pool are released with this pool.
+        EntryPool other;
+        Entry *entry = other.create("a/b", false, 1, 2, 0);
+        pool.splice(&other);
+        ASSERT(::strcmp(entry->getPath(), "a/b") == 0);
+        entry = other.create("a/c", false, 1, 2, 0);
+        ASSERT(::strcmp(entry->getPath(), "a/c") == 0);
+        if (i % 2) {
+            pool.clear();
+            entry = pool.create("a/d/", true, 1, 2, 0);
+            ASSERT(entry->isDirectory() && entry->getSize() == 0);
+        }
+    }
+
+    return ASSERT_COUNT;
+}
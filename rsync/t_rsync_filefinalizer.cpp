@@ -0,0 +1,126 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+#include <rsync/rsync_filefinalizer.h>
+
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_pathutil.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+std::string readFile(const std::string &path)
+{
+    std::string content(static_cast<size_t>(PathUtil::getSize(path.c_str())), 0);
+    File f(path.c_str());
+    if (!content.empty()) {
+        ASSERT(f.read(&content[0], static_cast<int>(content.size())) == static_cast<int>(content.size()));
+    }
+    return content;
+}
+
+// Write 'count' files, half of them over existing files, and check that they all end up in place.
+void testFinalizer(FileFinalizer *finalizer, const std::string &top, int count)
+{
+    std::vector<std::string> contents;
+    for (int i = 0; i < count; ++i) {
+        std::stringstream name;
+        name << "file" << i;
+        std::string destination = PathUtil::join(top.c_str(), name.str().c_str());
+        PathUtil::remove(destination.c_str(), false);
+        if (i % 2) {
+            File old(destination.c_str(), true);
+            ASSERT(old.write("old", 3) == 3);
+        }
+
+        std::string content(std::rand() % 10000, static_cast<char>(i));
+        contents.push_back(content);
+
+        // Anonymous files may not be supported, in which case a named one is used.
+        File *file = new File();
+        std::string temporaryFile;
+        if (i % 3 == 0 || !file->openAnonymous(top.c_str())) {
+            temporaryFile = destination + ".tmp";
+            ASSERT(file->open(temporaryFile.c_str(), true, true));
+        }
+        ASSERT(file->write(content.c_str(), static_cast<int>(content.size())) == static_cast<int>(content.size()));
+        finalizer->add(file, temporaryFile, destination, 1000000000 + i, 0600);
+    }
+
+    std::vector<std::string> failures;
+    finalizer->wait(&failures);
+    ASSERT(failures.empty());
+
+    for (int i = 0; i < count; ++i) {
+        std::stringstream name;
+        name << "file" << i;
+        std::string destination = PathUtil::join(top.c_str(), name.str().c_str());
+        ASSERT(readFile(destination) == contents[i]);
+        ASSERT(!PathUtil::exists((destination + ".tmp").c_str()));
+        ASSERT(!PathUtil::exists(PathUtil::join(top.c_str(), (".acrosync-tmp-" + name.str()).c_str()).c_str()));
+
+        bool isDir;
+        int64_t size;
+        int64_t time;
+        ASSERT(PathUtil::getFileInfo(destination.c_str(), &isDir, &size, &time));
+        ASSERT(time == 1000000000 + i);
+    }
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    std::string top = PathUtil::join(PathUtil::getCurrentDirectory().c_str(), "test_dir");
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    ASSERT(PathUtil::createDirectory(top.c_str()));
+
+    // Finishing files in turn, and on more threads than files, so that they finish in any order.
+    {
+        FileFinalizer finalizer(0);
+        testFinalizer(&finalizer, top, 20);
+    }
+    {
+        FileFinalizer finalizer(4);
+        testFinalizer(&finalizer, top, 200);
+        testFinalizer(&finalizer, top, 3);
+    }
+
+    // A file that can't be moved into place is reported and removed.
+    {
+        FileFinalizer finalizer(2);
+        std::string temporaryFile = PathUtil::join(top.c_str(), "orphan.tmp");
+        std::string destination = PathUtil::join(top.c_str(), "missing/orphan");
+        File *file = new File(temporaryFile.c_str(), true);
+        finalizer.add(file, temporaryFile, destination, 0, 0600);
+
+        std::vector<std::string> failures;
+        finalizer.wait(&failures);
+        ASSERT(failures.size() == 1 && failures[0] == destination);
+        ASSERT(!PathUtil::exists(temporaryFile.c_str()));
+    }
+
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    return ASSERT_COUNT;
+}
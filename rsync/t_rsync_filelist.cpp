@@ -0,0 +1,166 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL. 
+
+
+#include <rsync/rsync_filelist.h>
+
+#include <rsync/rsync_entry.h>
+#include <rsync/rsync_util.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+namespace {
+
+// Create a random list of entries with distinct paths from a small set of names, so that many entries share
+// directories and many paths differ only near the end.
+void createEntries(int count, std::vector<Entry*> *entries)
+{
+    std::set<std::string> paths;
+    const char *names[] = { "a", "b", "ab", "a b", "a.b", "b-", "c" };
+    int numberOfNames = sizeof(names) / sizeof(names[0]);
+    entries->push_back(new Entry("./", true, 0, 0, 0));
+    for (int i = 0; i < count; ++i) {
+        std::string path;
+        int depth = rand() % 4;
+        for (int j = 0; j <= depth; ++j) {
+            if (j > 0) {
+                path += "/";
+            }
+            path += names[rand() % numberOfNames];
+        }
+        if (!paths.insert(path).second) {
+            continue;
+        }
+        bool isDirectory = rand() % 3 == 0;
+        uint32_t mode = isDirectory ? Entry::IS_ALL_READABLE : Entry::IS_FILE | (rand() % 4 == 0 ? Entry::IS_LINK : 0);
+        Entry *entry = new Entry(path.c_str(), isDirectory, rand(), rand(), mode);
+        if (entry->isLink()) {
+            entry->setSymlink(std::string(rand() % 10, 'l'));
+        }
+        entry->normalizePath();
+        entries->push_back(entry);
+    }
+}
+
+} // unnamed namespace
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    for (int i = 0; i < 10; ++i) {
+        std::vector<Entry*> entries;
+        Util::EntryListReleaser releaser(&entries);
+        createEntries(1 + rand() % 2000, &entries);
+
+        FileList fileList;
+        for (unsigned int j = 0; j < entries.size(); ++j) {
+            ASSERT(fileList.add(*entries[j]) == static_cast<int>(j));
+        }
+        ASSERT(fileList.size() == static_cast<int>(entries.size()));
+
+        // Comparisons must agree with those of entries, within the list and with another list.
+        FileList otherList;
+        std::vector<Entry*> otherEntries;
+        Util::EntryListReleaser otherReleaser(&otherEntries);
+        createEntries(100, &otherEntries);
+        for (unsigned int j = 0; j < otherEntries.size(); ++j) {
+            otherList.add(*otherEntries[j]);
+        }
+        for (int j = 0; j < 10000; ++j) {
+            int lhs = rand() % entries.size();
+            int rhs = rand() % entries.size();
+            int other = rand() % otherEntries.size();
+            ASSERT(FileList::compare(fileList, lhs, fileList, rhs) ==
+                   Entry::compareGlobally(entries[lhs], entries[rhs]));
+            ASSERT(FileList::compare(fileList, lhs, otherList, other) ==
+                   Entry::compareGlobally(entries[lhs], otherEntries[other]));
+            ASSERT(FileList::compare(otherList, other, fileList, lhs) ==
+                   Entry::compareGlobally(otherEntries[other], entries[lhs]));
+        }
+
+        // Sorting must give the same order as sorting the entries, with every attribute moved along.
+        std::sort(entries.begin() + 1, entries.end(), Entry::compareGlobally);
+        fileList.sort(1);
+        for (unsigned int j = 0; j < entries.size(); ++j) {
+            ASSERT(fileList.getPath(j) == entries[j]->getPath());
+            ASSERT(fileList.isDirectory(j) == entries[j]->isDirectory());
+            ASSERT(fileList.isLink(j) == entries[j]->isLink());
+            ASSERT(fileList.isRegular(j) == entries[j]->isRegular());
+            ASSERT(fileList.isReadable(j) == entries[j]->isReadable());
+            ASSERT(static_cast<int32_t>(fileList.getMode(j)) == entries[j]->getMode());
+            ASSERT(fileList.getSize(j) == entries[j]->getSize());
+            ASSERT(fileList.getTime(j) == entries[j]->getTime());
+            if (entries[j]->isLink()) {
+                ASSERT(::strcmp(fileList.getSymlink(j), entries[j]->getSymlink()) == 0);
+            }
+            int k = rand() % entries.size();
+            ASSERT(fileList.contains(j, k) == entries[j]->contains(entries[k]));
+            ASSERT(fileList.isOlderThan(j, fileList, k) == entries[j]->isOlderThan(*entries[k]));
+        }
+    }
+
+    for (int i = 0; i < 10; ++i) {
+        std::vector<Entry*> entries;
+        Util::EntryListReleaser releaser(&entries);
+        createEntries(1 + rand() % 2000, &entries);
+
+        // Entries appended to a sorted list are sorted into it, and sorting again changes nothing.  With 'begin' at
+        // 0, the top directory is sorted along with the others.
+        FileList fileList;
+        int half = entries.size() / 2;
+        for (int j = 0; j < half; ++j) {
+            fileList.add(*entries[j]);
+        }
+        fileList.sort(0);
+        for (unsigned int j = half; j < entries.size(); ++j) {
+            fileList.add(*entries[j]);
+        }
+        fileList.sort(0);
+        fileList.sort(0);
+        std::sort(entries.begin(), entries.end(), Entry::compareGlobally);
+        for (unsigned int j = 0; j < entries.size(); ++j) {
+            ASSERT(fileList.getPath(j) == entries[j]->getPath());
+            ASSERT(fileList.getTime(j) == entries[j]->getTime());
+        }
+    }
+
+    // Directories are given a trailing '/'.
+    FileList fileList;
+    fileList.add("a/b", true, 100, 0, 0);
+    ASSERT(fileList.getPath(0) == "a/b/");
+    ASSERT(fileList.isDirectory(0));
+    ASSERT(fileList.getSize(0) == 0);
+    fileList.addSize(0, 10);
+    ASSERT(fileList.getSize(0) == 10);
+
+    return ASSERT_COUNT;
+}
@@ -93,6 +93,114 @@ int main(int /* argc */, char ** /* argv */)
     ASSERT(f.read(buffer, ::strlen(content)) == 0);
     f.close();
 
+    // Copy part of a file into the middle of another.  Whatever can't be copied in the kernel is written instead.
+    {
+        std::string source(300000, 0);
+        for (unsigned int i = 0; i < source.size(); ++i) {
+            source[i] = static_cast<char>(rand());
+        }
+        std::string sourcePath = PathUtil::join(top.c_str(), "test_copy1");
+        std::string targetPath = PathUtil::join(top.c_str(), "test_copy2");
+        {
+            File out(sourcePath.c_str(), true);
+            ASSERT(out.write(source.c_str(), source.size()) == source.size());
+        }
+
+        File in(sourcePath.c_str());
+        File out(targetPath.c_str(), true);
+        ASSERT(out.write("head", 4) == 4);
+        int64_t copied = out.copyRange(&in, 4000, 250000);
+        ASSERT(copied >= 0 && copied <= 250000);
+        ASSERT(out.seek(0, File::SEEK_FROM_CURRENT) == 4 + copied);
+        ASSERT(out.write(source.c_str() + 4000 + copied, 250000 - copied) == 250000 - copied);
+        ASSERT(out.write("tail", 4) == 4);
+        out.close();
+
+        std::string expected = "head" + source.substr(4000, 250000) + "tail";
+        std::string result(expected.size() + 1, 0);
+        File f(targetPath.c_str());
+        ASSERT(f.read(&result[0], result.size()) == expected.size());
+        result.resize(expected.size());
+        ASSERT(result == expected);
+        f.close();
+        in.close();
+
+        ASSERT(PathUtil::remove(sourcePath.c_str(), false));
+        ASSERT(PathUtil::remove(targetPath.c_str(), false));
+    }
+
+    // Update a file in place and cut it short.
+    {
+        std::string path = PathUtil::join(top.c_str(), "test_update");
+        createFile(top.c_str(), "test_update", "0123456789");
+        File f;
+        ASSERT(f.openForUpdate(path.c_str(), true));
+        ASSERT(f.seek(2, File::SEEK_FROM_BEGIN) == 2);
+        ASSERT(f.write("ab", 2) == 2);
+        ASSERT(f.read(buffer, 2) == 2);
+        ASSERT(::strncmp(buffer, "45", 2) == 0);
+        ASSERT(f.truncate(7));
+        ASSERT(f.seek(0, File::SEEK_FROM_CURRENT) == 6);
+        f.close();
+
+        ASSERT(f.open(path.c_str(), false, true));
+        ASSERT(f.read(buffer, sizeof(buffer)) == 7);
+        ASSERT(::strncmp(buffer, "01ab456", 7) == 0);
+        f.close();
+        ASSERT(PathUtil::remove(path.c_str(), false));
+    }
+
+    // Reserve space for a file, which doesn't change its size, and release what isn't written.
+    {
+        std::string path = PathUtil::join(top.c_str(), "test_allocate");
+        File f(path.c_str(), true, true);
+        ASSERT(f.allocate(1000000));
+        ASSERT(PathUtil::getSize(path.c_str()) == 0);
+        ASSERT(f.write("0123456789", 10) == 10);
+        ASSERT(f.truncate(10));
+        f.close();
+        ASSERT(PathUtil::getSize(path.c_str()) == 10);
+        ASSERT(PathUtil::remove(path.c_str(), false));
+    }
+
+    // Write data with long runs of zeroes, ending with zeroes, both to a new file and over an existing one.
+    {
+        std::string data(100000, 0);
+        for (unsigned int i = 1000; i < 3000; ++i) {
+            data[i] = static_cast<char>(rand() | 1);
+        }
+        data[50001] = 'x';
+        data[70000] = 'y';
+
+        std::string path = PathUtil::join(top.c_str(), "test_sparse");
+        for (int punchHoles = 0; punchHoles < 2; ++punchHoles) {
+            File f;
+            if (punchHoles) {
+                ASSERT(f.openForUpdate(path.c_str(), true));
+                std::string old(120000, 'z');
+                ASSERT(f.write(old.c_str(), old.size()) == old.size());
+                ASSERT(f.seek(0, File::SEEK_FROM_BEGIN) == 0);
+            } else {
+                ASSERT(f.open(path.c_str(), true, true));
+            }
+            ASSERT(f.write("head", 4) == 4);
+            ASSERT(f.writeSparse(data.c_str(), 60000, punchHoles != 0) == 60000);
+            ASSERT(f.writeSparse(data.c_str() + 60000, 40000, punchHoles != 0) == 40000);
+            ASSERT(f.seek(0, File::SEEK_FROM_CURRENT) == 100004);
+            ASSERT(f.truncate(100004));
+            f.close();
+
+            std::string expected = "head" + data;
+            std::string result(expected.size() + 1, 0);
+            ASSERT(f.open(path.c_str(), false, true));
+            ASSERT(f.read(&result[0], result.size()) == expected.size());
+            result.resize(expected.size());
+            ASSERT(result == expected);
+            f.close();
+        }
+        ASSERT(PathUtil::remove(path.c_str(), false));
+    }
+
     createFile(top.c_str(), "test_file2", "this is another test");
 
     // Call these two 'file' but they are acutally directories
@@ -0,0 +1,130 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_filewriter.h>
+
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_pathutil.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <cstdlib>
+#include <string>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+std::string randomData(int size)
+{
+    std::string data(size, 0);
+    for (int i = 0; i < size; ++i) {
+        data[i] = static_cast<char>(std::rand());
+    }
+    return data;
+}
+
+std::string readFile(const std::string &path)
+{
+    std::string content(static_cast<size_t>(PathUtil::getSize(path.c_str())), 0);
+    File f(path.c_str());
+    if (!content.empty()) {
+        ASSERT(f.read(&content[0], static_cast<int>(content.size())) == static_cast<int>(content.size()));
+    }
+    return content;
+}
+
+// Write pieces of all sizes, some of them copied from 'sourcePath', and check that they end up in order.
+void testWriter(FileWriter *writer, bool direct, bool sparse, const std::string &sourcePath,
+                const std::string &targetPath)
+{
+    std::string source = readFile(sourcePath);
+    File sourceFile(sourcePath.c_str());
+    File targetFile(targetPath.c_str(), true);
+    writer->start(&targetFile, sparse, false, direct);
+
+    std::string expected;
+    for (int i = 0; i < 200; ++i) {
+        if (std::rand() % 4 == 0) {
+            int64_t offset = std::rand() % (source.size() / 2);
+            int64_t length = std::rand() % (source.size() / 2);
+            writer->copy(&sourceFile, offset, length, source.c_str() + offset);
+            expected += source.substr(offset, length);
+        } else {
+            std::string piece = randomData(std::rand() % 100000);
+            if (std::rand() % 2) {
+                piece.assign(std::rand() % 30000, 0);
+            }
+            writer->write(piece.c_str(), static_cast<int>(piece.size()));
+            expected += piece;
+        }
+    }
+    ASSERT(writer->finish());
+    ASSERT(targetFile.truncate(expected.size()));
+    targetFile.close();
+    ASSERT(readFile(targetPath) == expected);
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    std::string top = PathUtil::join(PathUtil::getCurrentDirectory().c_str(), "test_dir");
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    ASSERT(PathUtil::createDirectory(top.c_str()));
+
+    std::string sourcePath = PathUtil::join(top.c_str(), "source");
+    std::string targetPath = PathUtil::join(top.c_str(), "target");
+    {
+        std::string source = randomData(1000000);
+        File f(sourcePath.c_str(), true);
+        ASSERT(f.write(source.c_str(), static_cast<int>(source.size())) == static_cast<int>(source.size()));
+    }
+
+    // Writing directly, and with only a few buffers so that the caller has to wait for them.
+    {
+        FileWriter writer(0);
+        testWriter(&writer, false, false, sourcePath, targetPath);
+        testWriter(&writer, true, true, sourcePath, targetPath);
+    }
+    {
+        FileWriter writer(600000);
+        testWriter(&writer, false, false, sourcePath, targetPath);
+        testWriter(&writer, false, true, sourcePath, targetPath);
+        testWriter(&writer, true, false, sourcePath, targetPath);
+    }
+
+    // A failed write is reported when finishing, and the file can be abandoned half way.
+    {
+        FileWriter writer(1000000);
+        std::string data = randomData(700000);
+
+        File readOnly(sourcePath.c_str());
+        writer.start(&readOnly, false, false, false);
+        writer.write(data.c_str(), static_cast<int>(data.size()));
+        ASSERT(!writer.finish());
+
+        File targetFile(targetPath.c_str(), true);
+        writer.start(&targetFile, false, false, false);
+        writer.write(data.c_str(), static_cast<int>(data.size()));
+        writer.abort();
+        ASSERT(writer.finish());
+    }
+
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    return ASSERT_COUNT;
+}
@@ -0,0 +1,176 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_filter.h>
+
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_log.h>
+#include <rsync/rsync_pathutil.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <string>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+namespace {
+
+// Return true if a filter with the single rule '- pattern' excludes the entry at 'path'.
+bool excludes(const char *pattern, const char *path, bool isDirectory = false)
+{
+    Filter filter;
+    filter.add((std::string("- ") + pattern).c_str());
+    return filter.isExcluded(path, isDirectory);
+}
+
+// Return true if adding 'rule' throws an exception.
+bool isRejected(const char *rule)
+{
+    Filter filter;
+    try {
+        filter.add(rule);
+    } catch (Exception &) {
+        return filter.isEmpty();
+    }
+    return false;
+}
+
+} // unnamed namespace
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    // Patterns without a '/' match the last component anywhere.
+    ASSERT(excludes("*.o", "a.o"));
+    ASSERT(excludes("*.o", "x/y/a.o"));
+    ASSERT(!excludes("*.o", "a.oo"));
+    ASSERT(excludes("core", "x/core"));
+    ASSERT(!excludes("core", "x/core.1"));
+    ASSERT(!excludes("core", "core/x"));
+
+    // A leading '/' anchors the pattern at the top.
+    ASSERT(excludes("/foo", "foo"));
+    ASSERT(excludes("/foo", "foo/", true));
+    ASSERT(!excludes("/foo", "x/foo"));
+    ASSERT(excludes("/x/*.c", "x/a.c"));
+    ASSERT(!excludes("/x/*.c", "y/x/a.c"));
+
+    // A trailing '/' only matches directories.
+    ASSERT(excludes("foo/", "foo", true));
+    ASSERT(excludes("foo/", "x/foo/", true));
+    ASSERT(!excludes("foo/", "foo"));
+
+    // Other patterns with a '/' match the end of the path at a component boundary.
+    ASSERT(excludes("foo/bar", "foo/bar"));
+    ASSERT(excludes("foo/bar", "x/foo/bar"));
+    ASSERT(!excludes("foo/bar", "xfoo/bar"));
+    ASSERT(excludes("a/*/c", "a/b/c"));
+    ASSERT(excludes("a/*/c", "x/a/b/c"));
+    ASSERT(!excludes("a/*/c", "a/b/d/c"));
+
+    // '**' matches across '/'.
+    ASSERT(excludes("/a/**/c", "a/b/d/c"));
+    ASSERT(!excludes("/a/**/c", "x/a/b/c"));
+    ASSERT(excludes("a/**/c", "x/a/b/d/c"));
+    ASSERT(excludes("**/c", "a/b/c"));
+    ASSERT(excludes("/a/**", "a/b/c"));
+    ASSERT(!excludes("/a/*", "a/b/c"));
+
+    // '?' and character sets.
+    ASSERT(excludes("?.txt", "a.txt"));
+    ASSERT(!excludes("?.txt", "ab.txt"));
+    ASSERT(excludes("[ab]*.txt", "a1.txt"));
+    ASSERT(!excludes("[ab]*.txt", "c.txt"));
+    ASSERT(excludes("[!ab]*.txt", "c.txt"));
+    ASSERT(excludes("[a-c].txt", "b.txt"));
+    ASSERT(!excludes("[a-c].txt", "d.txt"));
+    ASSERT(excludes("\\*.txt", "*.txt"));
+    ASSERT(!excludes("\\*.txt", "a.txt"));
+
+    // Escaped paths only match themselves.
+    ASSERT(Filter::escape("a/b c") == "a/b c");
+    ASSERT(Filter::escape("a\\b") == "a\\b");
+    ASSERT(excludes(("/" + Filter::escape("a\\b")).c_str(), "a\\b"));
+    ASSERT(Filter::escape("a*[b]\\?") == "a\\*\\[b]\\\\\\?");
+    ASSERT(excludes(("/" + Filter::escape("x/a*[b]\\?")).c_str(), "x/a*[b]\\?"));
+    ASSERT(!excludes(("/" + Filter::escape("x/a*[b]\\?")).c_str(), "x/ab\\c"));
+    ASSERT(Filter::escape("a\\b", true) == "a\\\\b");
+    ASSERT(excludes(("/" + Filter::escape("a\\b", true) + "/**").c_str(), "a\\b/c/d"));
+    ASSERT(!excludes(("/" + Filter::escape("a\\b", true) + "/**").c_str(), "ab/c"));
+
+    // The first matching rule decides, and directories above a path exclude it only as a whole path.
+    Filter filter;
+    ASSERT(filter.isEmpty());
+    filter.add("+ *.c");
+    filter.add("include */");
+    filter.add("exclude *");
+    ASSERT(!filter.isExcluded("x.c", false));
+    ASSERT(filter.isExcluded("x.h", false));
+    ASSERT(!filter.isExcluded("src/", true));
+    ASSERT(!filter.isPathExcluded("src/lib/x.c", false));
+    ASSERT(filter.getRules().size() == 3);
+    ASSERT(filter.getRules()[0] == "+ *.c");
+    ASSERT(filter.getRules()[1] == "+ */");
+    ASSERT(filter.getRules()[2] == "- *");
+
+    filter.add("!");
+    ASSERT(filter.isEmpty());
+    ASSERT(filter.getRules().empty());
+    filter.add("+ *.c");
+    filter.add("- *");
+    ASSERT(filter.isExcluded("src/", true));
+    ASSERT(!filter.isExcluded("src/x.c", false));
+    ASSERT(filter.isPathExcluded("src/x.c", false));
+
+    // A trailing '/***' matches the directory and everything under it.
+    filter.clear();
+    filter.add("+ /keep/***");
+    filter.add("- *");
+    ASSERT(!filter.isPathExcluded("keep/", true));
+    ASSERT(!filter.isPathExcluded("keep/a/b", false));
+    ASSERT(filter.isPathExcluded("other", false));
+    ASSERT(filter.isPathExcluded("keeper", false));
+
+    // Rules are read from merge files, skipping comments and empty lines.
+    std::string rules = PathUtil::join(PathUtil::getCurrentDirectory().c_str(), "test_filter_rules");
+    {
+        File file(rules.c_str(), true);
+        std::string content = "# comment\r\n- *.o\n\n; comment\n+ /a\r\n";
+        ASSERT(file.write(content.c_str(), static_cast<int>(content.size())) > 0);
+    }
+    filter.clear();
+    filter.add((". " + rules).c_str());
+    filter.add(("merge " + rules).c_str());
+    ASSERT(filter.getRules().size() == 4);
+    ASSERT(filter.getRules()[0] == "- *.o");
+    ASSERT(filter.getRules()[1] == "+ /a");
+    ASSERT(filter.isExcluded("x/y.o", false));
+    PathUtil::remove(rules.c_str());
+
+    // Unsupported rules are rejected.
+    ASSERT(isRejected("-"));
+    ASSERT(isRejected("- "));
+    ASSERT(isRejected("-! *.o"));
+    ASSERT(isRejected(": .rsync-filter"));
+    ASSERT(isRejected("pattern"));
+    ASSERT(isRejected((". " + rules).c_str()));
+
+    return ASSERT_COUNT;
+}
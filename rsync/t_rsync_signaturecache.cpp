@@ -0,0 +1,193 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_signaturecache.h>
+
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_pathutil.h>
+#include <rsync/rsync_timeutil.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <thread>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+const int BlockLength = 700;
+
+// Create a file of 'size' random bytes whose modified time is well in the past.
+void createFile(const std::string &path, int size)
+{
+    std::string content;
+    for (int i = 0; i < size; ++i) {
+        content += static_cast<char>(std::rand());
+    }
+    {
+        File f(path.c_str(), true);
+        ASSERT(f.isValid());
+        ASSERT(f.write(content.c_str(), size) == size);
+    }
+    ASSERT(PathUtil::setModifiedTime(path.c_str(), ::time(0) - 3600));
+}
+
+// Return some random signatures of the right length for 'key'.
+std::string getSignatures(const SignatureCache::Key &key)
+{
+    int count = static_cast<int>((key.d_size - 1) / key.d_blockLength + 1);
+    std::string signatures;
+    for (int i = 0; i < count * 20; ++i) {
+        signatures += static_cast<char>(std::rand());
+    }
+    return signatures;
+}
+
+// Save 'signatures' for 'fullPath' in 'cache' 'count' times.
+void saveRepeatedly(SignatureCache *cache, const std::string &fullPath, const SignatureCache::Key &key,
+                    const std::string &signatures, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        cache->save(fullPath.c_str(), key, signatures);
+    }
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    std::string top = PathUtil::join(PathUtil::getCurrentDirectory().c_str(), "test_dir");
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    ASSERT(PathUtil::createDirectory(top.c_str()));
+
+    std::string directory = PathUtil::join(top.c_str(), "cache");
+    std::string file1 = PathUtil::join(top.c_str(), "file1");
+    std::string file2 = PathUtil::join(top.c_str(), "file2");
+    createFile(file1, 5000);
+    createFile(file2, 3000);
+
+    // The change time can't be set back, so wait until the files are no longer considered recently changed.
+    TimeUtil::sleep(3000);
+
+    int32_t seed;
+    {
+        SignatureCache cache(directory.c_str(), 1024 * 1024);
+        ASSERT(cache.isValid());
+        seed = cache.getSeed();
+        ASSERT(seed > 0);
+
+        SignatureCache::Key key;
+        ASSERT(SignatureCache::getKey(file1.c_str(), BlockLength, 30, seed, &key));
+        ASSERT(key.d_size == 5000);
+
+        std::string signatures;
+        ASSERT(!cache.load(file1.c_str(), key, &signatures));
+
+        std::string expected = getSignatures(key);
+        cache.save(file1.c_str(), key, expected);
+        ASSERT(cache.load(file1.c_str(), key, &signatures));
+        ASSERT(signatures == expected);
+
+        // Two clients sharing the directory may save the same file at once; whichever saves last wins, but the
+        // signatures saved are never a mix of the two.
+        {
+            SignatureCache otherCache(directory.c_str(), 1024 * 1024);
+            ASSERT(otherCache.getSeed() == seed);
+            std::string otherSignatures = getSignatures(key);
+            std::thread thread(saveRepeatedly, &otherCache, file1, key, otherSignatures, 200);
+            saveRepeatedly(&cache, file1, key, expected, 200);
+            thread.join();
+            ASSERT(cache.load(file1.c_str(), key, &signatures));
+            ASSERT(signatures == expected || signatures == otherSignatures);
+            cache.save(file1.c_str(), key, expected);
+        }
+
+        // Anything that changes the signatures is a miss.
+        SignatureCache::Key other = key;
+        other.d_blockLength = BlockLength * 2;
+        ASSERT(!cache.load(file1.c_str(), other, &signatures));
+        other = key;
+        other.d_protocol = 29;
+        ASSERT(!cache.load(file1.c_str(), other, &signatures));
+        other = key;
+        other.d_time += 1;
+        ASSERT(!cache.load(file1.c_str(), other, &signatures));
+
+        // Signatures saved for one file are never returned for another.
+        SignatureCache::Key key2;
+        ASSERT(SignatureCache::getKey(file2.c_str(), BlockLength, 30, seed, &key2));
+        ASSERT(!cache.load(file2.c_str(), key2, &signatures));
+
+        // Signatures of the wrong length or computed with another seed are not saved.
+        cache.save(file2.c_str(), key2, expected);
+        ASSERT(!cache.load(file2.c_str(), key2, &signatures));
+        other = key2;
+        other.d_seed = seed + 1;
+        cache.save(file2.c_str(), other, getSignatures(other));
+        ASSERT(!cache.load(file2.c_str(), other, &signatures));
+
+        // Signatures are not saved if the file has changed since the key was obtained.
+        createFile(file2, 3000);
+        cache.save(file2.c_str(), key2, getSignatures(key2));
+        ASSERT(SignatureCache::getKey(file2.c_str(), BlockLength, 30, seed, &key2));
+        ASSERT(!cache.load(file2.c_str(), key2, &signatures));
+
+        // Nor if it has changed too recently.
+        cache.save(file2.c_str(), key2, getSignatures(key2));
+        ASSERT(!cache.load(file2.c_str(), key2, &signatures));
+    }
+
+    {
+        // The seed is kept in the directory, and so are the signatures.
+        SignatureCache cache(directory.c_str(), 1024 * 1024);
+        ASSERT(cache.getSeed() == seed);
+
+        SignatureCache::Key key;
+        std::string signatures;
+        ASSERT(SignatureCache::getKey(file1.c_str(), BlockLength, 30, seed, &key));
+        ASSERT(cache.load(file1.c_str(), key, &signatures));
+
+        cache.clear();
+        ASSERT(!cache.load(file1.c_str(), key, &signatures));
+    }
+
+    {
+        // Only one file fits, so the least recently used one is removed.
+        createFile(file2, 5000);
+        TimeUtil::sleep(3000);
+
+        SignatureCache cache(directory.c_str(), 300);
+        SignatureCache::Key key1, key2;
+        std::string signatures;
+        ASSERT(SignatureCache::getKey(file1.c_str(), BlockLength, 30, seed, &key1));
+        ASSERT(SignatureCache::getKey(file2.c_str(), BlockLength, 30, seed, &key2));
+
+        cache.save(file1.c_str(), key1, getSignatures(key1));
+        ASSERT(cache.load(file1.c_str(), key1, &signatures));
+
+        TimeUtil::sleep(1000);
+        cache.save(file2.c_str(), key2, getSignatures(key2));
+        ASSERT(cache.load(file2.c_str(), key2, &signatures));
+        ASSERT(!cache.load(file1.c_str(), key1, &signatures));
+    }
+
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    return ASSERT_COUNT;
+}
@@ -0,0 +1,145 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_signaturepipeline.h>
+
+#include <rsync/rsync_file.h>
+#include <rsync/rsync_pathutil.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+void createFile(const std::string &path, int size)
+{
+    std::string content;
+    for (int i = 0; i < size; ++i) {
+        content += static_cast<char>(std::rand());
+    }
+    File f(path.c_str(), true);
+    ASSERT(f.isValid());
+    ASSERT(f.write(content.c_str(), size) == size);
+}
+
+// Add all files to 'pipeline' and check that the signatures come out in order and are the same as those computed
+// directly.
+void testPipeline(SignaturePipeline *pipeline, const std::vector<std::string> &files, int protocol)
+{
+    pipeline->reset(protocol, 12345, 0);
+    for (unsigned int i = 0; i < files.size(); ++i) {
+        pipeline->add(i * 2, files[i]);
+    }
+
+    for (unsigned int i = 0; i < files.size(); ++i) {
+        std::string expected;
+        ASSERT(SignaturePipeline::computeSignatures(files[i].empty() ? 0 : files[i].c_str(), protocol, 12345, 0, 0,
+                                                    &expected));
+
+        int index = -1;
+        std::string signatures;
+        while (!pipeline->take(&index, &signatures, 100)) {
+        }
+        ASSERT(index == static_cast<int>(i * 2));
+        ASSERT(signatures == expected);
+    }
+
+    int index;
+    std::string signatures;
+    ASSERT(!pipeline->take(&index, &signatures, 0));
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    std::string top = PathUtil::join(PathUtil::getCurrentDirectory().c_str(), "test_dir");
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    ASSERT(PathUtil::createDirectory(top.c_str()));
+
+    int sizes[] = { 1, 699, 700, 701, 5000, 100000, 600000, 2000000 };
+    std::vector<std::string> files;
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        std::stringstream name;
+        name << "file" << i;
+        files.push_back(PathUtil::join(top.c_str(), name.str().c_str()));
+        createFile(files.back(), sizes[i]);
+    }
+
+    // No base file, or a base file that doesn't exist.
+    files.push_back("");
+    files.push_back(PathUtil::join(top.c_str(), "missing"));
+
+    std::string signatures;
+    ASSERT(SignaturePipeline::computeSignatures(0, 30, 0, 0, 0, &signatures));
+    ASSERT(signatures == std::string(16, 0));
+
+    // The header describes the blocks that follow.
+    ASSERT(SignaturePipeline::computeSignatures(files[4].c_str(), 30, 0, 0, 0, &signatures));
+    const int32_t *header = reinterpret_cast<const int32_t *>(signatures.c_str());
+    ASSERT(header[0] == 8);
+    ASSERT(header[1] == 700);
+    ASSERT(header[2] == 16);
+    ASSERT(header[3] == 5000 - 7 * 700);
+    ASSERT(signatures.size() == 16 + 8 * 20);
+
+    {
+        SignaturePipeline pipeline(4, 64 * 1024 * 1024, 0);
+        testPipeline(&pipeline, files, 30);
+        testPipeline(&pipeline, files, 29);
+    }
+
+    {
+        // A budget smaller than any file still lets one file through at a time.
+        SignaturePipeline pipeline(3, 1, 0);
+        testPipeline(&pipeline, files, 30);
+    }
+
+    {
+        // Files not taken are discarded by 'reset()' and by the destructor.
+        SignaturePipeline pipeline(2, 64 * 1024 * 1024, 0);
+        pipeline.reset(30, 0, 0);
+        for (unsigned int i = 0; i < files.size(); ++i) {
+            pipeline.add(i, files[i]);
+        }
+        testPipeline(&pipeline, files, 30);
+        for (unsigned int i = 0; i < files.size(); ++i) {
+            pipeline.add(i, files[i]);
+        }
+    }
+
+    {
+        // Nothing is computed once cancelled.
+        int cancelled = 1;
+        ASSERT(!SignaturePipeline::computeSignatures(files[5].c_str(), 30, 0, 0, &cancelled, &signatures));
+
+        SignaturePipeline pipeline(2, 64 * 1024 * 1024, &cancelled);
+        pipeline.reset(30, 0, 0);
+        pipeline.add(0, files[5]);
+        int index;
+        ASSERT(!pipeline.take(&index, &signatures, 100));
+    }
+
+    PathUtil::removeDirectoryRecursively(top.c_str());
+    return ASSERT_COUNT;
+}
@@ -0,0 +1,282 @@
+// Copyright (C) 2015 Acrosync LLC
+//
+// Unless explicitly acquired and licensed from Licensor under another
+// license, the contents of this file are subject to the Reciprocal Public
+// License ("RPL") Version 1.5, or subsequent versions as allowed by the RPL,
+// and You may not copy or use this file in either source code or executable
+// form, except in compliance with the terms and conditions of the RPL.
+//
+// All software distributed under the RPL is provided strictly on an "AS
+// IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, AND
+// LICENSOR HEREBY DISCLAIMS ALL SUCH WARRANTIES, INCLUDING WITHOUT
+// LIMITATION, ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE, QUIET ENJOYMENT, OR NON-INFRINGEMENT. See the RPL for specific
+// language governing rights and limitations under the RPL.
+
+#include <rsync/rsync_tokencompressor.h>
+
+#include <rsync/rsync_io.h>
+#include <rsync/rsync_stream.h>
+
+#include <testutil/testutil_assert.h>
+#include <testutil/testutil_newdeletemonitor.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//qi: TEST_PROGRAM = 1
+#include <qi/qi_build.h>
+
+using namespace rsync;
+
+class StringIO : public IO
+{
+public:
+    StringIO(std::string &data)
+        : IO()
+        , d_data(data)
+        , d_position(0)
+    {
+    }
+
+    virtual ~StringIO()
+    {
+    }
+
+    virtual int read(char *buffer, int size)
+    {
+        int bytes = size;
+        if (d_position + size > int(d_data.size())) {
+            bytes = d_data.size() - d_position;
+        }
+        ::memcpy(buffer, d_data.c_str() + d_position, bytes);
+        d_position += bytes;
+        return bytes;
+    }
+
+    virtual int write(const char *buffer, int size)
+    {
+        d_data += std::string(buffer, size);
+        return size;
+    }
+
+    virtual bool isReadable(int /* timeoutInMilliSeconds */)
+    {
+        return true;
+    }
+
+    virtual bool isWritable(int /* timeoutInMilliSeconds */)
+    {
+        return true;
+    }
+
+    virtual bool isClosed()
+    {
+        return false;
+    }
+
+    void reset()
+    {
+        d_position = 0;
+    }
+
+    bool isConsumed() const
+    {
+        return d_position == int(d_data.size());
+    }
+
+    void createChannel(const char*, int*) {}
+
+    void closeChannel() {}
+
+    void getConnectInfo(std::string*, std::string*, std::string*) {}
+
+    void flush() {}
+
+private:
+    // NOT IMPLEMENTED
+    StringIO(const StringIO&);
+    StringIO& operator=(const StringIO&);
+
+    std::string& d_data;
+    int d_position;
+};
+
+// What is sent for a file: literal data followed by a block, or -1 for the end of the file, or -2 for no block.
+struct Token
+{
+    std::string d_literal;
+    int d_block;
+};
+
+std::string randomData(int size)
+{
+    std::string data(size, 0);
+    for (int i = 0; i < size; ++i) {
+        data[i] = static_cast<char>(std::rand());
+    }
+    return data;
+}
+
+std::string textData(int size)
+{
+    const char *words[] = { "alpha ", "beta ", "gamma\n", "delta ", "epsilon ", "zeta\n" };
+    std::string data;
+    while (static_cast<int>(data.size()) < size) {
+        data += words[std::rand() % 6];
+    }
+    data.resize(size);
+    return data;
+}
+
+// Send each file in 'files' and receive it back.  Return the number of bytes sent.
+int64_t sendAndReceive(int32_t protocol, const std::vector<std::string> &blocks,
+                       const std::vector<std::vector<Token> > &files)
+{
+    std::string data;
+    StringIO stringIO(data);
+    Stream stream(&stringIO);
+
+    int64_t bytesSent = 0;
+    {
+        TokenCompressor compressor(&stream, protocol);
+        for (unsigned int i = 0; i < files.size(); ++i) {
+            for (unsigned int j = 0; j < files[i].size(); ++j) {
+                const Token &token = files[i][j];
+                const char *block = 0;
+                int blockLength = 0;
+                if (token.d_block >= 0) {
+                    block = blocks[token.d_block].c_str();
+                    blockLength = static_cast<int>(blocks[token.d_block].size());
+                }
+                bytesSent += compressor.sendToken(token.d_block, token.d_literal.c_str(),
+                                                  static_cast<int>(token.d_literal.size()), block, blockLength);
+            }
+        }
+    }
+    ASSERT(bytesSent == static_cast<int64_t>(data.size()));
+
+    int64_t bytesRead = 0;
+    TokenCompressor decompressor(&stream, protocol);
+    for (unsigned int i = 0; i < files.size(); ++i) {
+        std::string expected;
+        for (unsigned int j = 0; j < files[i].size(); ++j) {
+            expected += files[i][j].d_literal;
+            if (files[i][j].d_block >= 0) {
+                expected += blocks[files[i][j].d_block];
+            }
+        }
+
+        std::string received;
+        const char *literal;
+        int32_t token;
+        while ((token = decompressor.receiveToken(&literal, &bytesRead)) != 0) {
+            if (token > 0) {
+                received.append(literal, token);
+            } else {
+                int block = -token - 1;
+                ASSERT(block < static_cast<int>(blocks.size()));
+                if (block >= static_cast<int>(blocks.size())) {
+                    return bytesSent;
+                }
+                received += blocks[block];
+                decompressor.seeToken(blocks[block].c_str(), static_cast<int>(blocks[block].size()));
+            }
+        }
+        ASSERT(received == expected);
+    }
+    ASSERT(stringIO.isConsumed());
+    ASSERT(bytesRead == bytesSent);
+    return bytesSent;
+}
+
+Token makeToken(const std::string &literal, int block)
+{
+    Token token;
+    token.d_literal = literal;
+    token.d_block = block;
+    return token;
+}
+
+void testTokens(int32_t protocol)
+{
+    std::vector<std::string> blocks;
+    for (int i = 0; i < 2000; ++i) {
+        blocks.push_back(textData(700));
+    }
+
+    std::vector<std::vector<Token> > files;
+
+    // An empty file, and a file that is all literal data.
+    files.push_back(std::vector<Token>(1, makeToken("", -1)));
+    files.push_back(std::vector<Token>(1, makeToken(textData(100000), -1)));
+
+    // Runs of consecutive blocks, blocks far apart and blocks going backwards.
+    std::vector<Token> tokens;
+    for (int i = 0; i < 300; ++i) {
+        tokens.push_back(makeToken("", i));
+    }
+    tokens.push_back(makeToken("", 1500));
+    tokens.push_back(makeToken("", 1501));
+    tokens.push_back(makeToken("", 10));
+    tokens.push_back(makeToken(textData(3000), 11));
+    tokens.push_back(makeToken(randomData(50000), -2));
+    tokens.push_back(makeToken(textData(20), 1999));
+    tokens.push_back(makeToken(textData(5000), -1));
+    files.push_back(tokens);
+
+    // Literal data that repeats the blocks before it.
+    tokens.clear();
+    tokens.push_back(makeToken("", 7));
+    tokens.push_back(makeToken(blocks[7] + blocks[7], 8));
+    tokens.push_back(makeToken(blocks[8] + blocks[7], -1));
+    files.push_back(tokens);
+
+    sendAndReceive(protocol, blocks, files);
+}
+
+void testLongBlocks(int32_t protocol)
+{
+    // Blocks longer than a stored block are added to the history in pieces.
+    std::vector<std::string> blocks;
+    blocks.push_back(textData(0x20000));
+    blocks.push_back(randomData(0x18000));
+
+    std::vector<std::vector<Token> > files;
+    std::vector<Token> tokens;
+    tokens.push_back(makeToken("", 0));
+    tokens.push_back(makeToken(blocks[0].substr(0x1f000), 1));
+    tokens.push_back(makeToken(blocks[1].substr(0x17000) + blocks[1].substr(0x100, 0x1000), -1));
+    files.push_back(tokens);
+
+    sendAndReceive(protocol, blocks, files);
+}
+
+void testCompression()
+{
+    // Text compresses well; random data can't be compressed but doesn't grow much either.
+    std::vector<std::string> blocks;
+    std::vector<std::vector<Token> > files;
+    files.push_back(std::vector<Token>(1, makeToken(textData(1000000), -1)));
+    ASSERT(sendAndReceive(30, blocks, files) < 1000000 / 3);
+
+    files.clear();
+    files.push_back(std::vector<Token>(1, makeToken(randomData(1000000), -1)));
+    ASSERT(sendAndReceive(30, blocks, files) < 1000000 + 1000000 / 100);
+}
+
+int main(int /* argc */, char ** /* argv */)
+{
+    TESTUTIL_INIT_RAND;
+
+    testTokens(29);
+    testTokens(30);
+    testTokens(31);
+    testLongBlocks(30);
+    testLongBlocks(31);
+    testCompression();
+
+    return ASSERT_COUNT;
+}
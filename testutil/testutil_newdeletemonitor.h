@@ -1,6 +1,7 @@
 #ifndef TESTUTIL_NEWDELETEMONITOR
 #define TESTUTIL_NEWDELETEMONITOR
 
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <new>
@@ -11,19 +12,20 @@
 
 namespace {
 
-static int BLOCKS_IN_USE = -1;
+// Atomic so that tests running worker threads are counted correctly.
+static std::atomic<int> BLOCKS_IN_USE(-1);
 
 void checkMemoryOnExit()
 {
     if (BLOCKS_IN_USE) {
-        std::fprintf(stderr, "Memory Leak: %d block(s) not released\n", BLOCKS_IN_USE);
+        std::fprintf(stderr, "Memory Leak: %d block(s) not released\n", BLOCKS_IN_USE.load());
     }
 }
 
 void *allocateMemory(std::size_t size)
 {
-    if (BLOCKS_IN_USE == -1) {
-        BLOCKS_IN_USE = 0;
+    int uninitialized = -1;
+    if (BLOCKS_IN_USE.compare_exchange_strong(uninitialized, 0)) {
         std::atexit(&checkMemoryOnExit);
     }
     ++BLOCKS_IN_USE;